@@ -0,0 +1,205 @@
+#include "Advertisement.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+Advertisement catalog_advertisement(std::vector<RemoteResource> catalog, uint32_t epoch, uint32_t version)
+{
+    Advertisement advertisement;
+    advertisement.epoch = epoch;
+    advertisement.version = version;
+    if (catalog.size() > MAX_LISTED_RESOURCES)
+    {
+        advertisement.kind = AdvertKind::SUMMARY;
+        advertisement.summary = BloomFilter::for_entries(std::min(catalog.size(), MAX_SUMMARIZED_RESOURCES));
+        for (const auto &resource : catalog)
+        {
+            advertisement.summary->insert(resource.name);
+        }
+        return advertisement;
+    }
+    advertisement.kind = AdvertKind::SNAPSHOT;
+    advertisement.changes.reserve(catalog.size());
+    for (auto &resource : catalog)
+    {
+        advertisement.changes.push_back({std::move(resource)});
+    }
+    return advertisement;
+}
+
+std::vector<P2PBroadcastMessage> build_advertisement(const Advertisement &advertisement)
+{
+    std::vector<P2PBroadcastMessage> messages(1);
+    if (advertisement.summary)
+    {
+        const std::vector<uint8_t> &bytes = advertisement.summary->bytes();
+        messages.resize((bytes.size() + MAX_SUMMARY_BYTES - 1) / MAX_SUMMARY_BYTES);
+        for (size_t i = 0; i < messages.size(); ++i)
+        {
+            P2PBroadcastMessage &message = messages[i];
+            message.filter_bits = advertisement.summary->bit_count();
+            message.filter_hashes = advertisement.summary->hash_count();
+            message.summary_length = static_cast<uint16_t>(
+                std::min(MAX_SUMMARY_BYTES, bytes.size() - i * MAX_SUMMARY_BYTES));
+            std::memcpy(message.summary, bytes.data() + i * MAX_SUMMARY_BYTES, message.summary_length);
+        }
+    }
+    size_t datagram_size = HEADER_WIRE_SIZE + ADVERT_FIELDS_WIRE_SIZE;
+    for (const auto &change : advertisement.changes)
+    {
+        const RemoteResource &resource = change.resource;
+        if (resource.name.size() >= sizeof(AdvertisedResource::name))
+        {
+            continue;
+        }
+        size_t entry_size = (change.removed ? REMOVED_ENTRY_WIRE_SIZE : ADVERT_ENTRY_WIRE_SIZE) + resource.name.size();
+        if (messages.back().resource_count == MAX_ADVERT_ENTRIES || datagram_size + entry_size > MAX_DATAGRAM_SIZE)
+        {
+            messages.emplace_back();
+            datagram_size = HEADER_WIRE_SIZE + ADVERT_FIELDS_WIRE_SIZE;
+        }
+        P2PBroadcastMessage &message = messages.back();
+        AdvertisedResource &entry = message.resources[message.resource_count++];
+        entry.removed = change.removed;
+        std::memcpy(entry.name, resource.name.c_str(), resource.name.size() + 1);
+        entry.size = resource.size;
+        std::memcpy(entry.content_hash, resource.content_hash.data(), sizeof(entry.content_hash));
+        datagram_size += entry_size;
+    }
+
+    for (size_t i = 0; i < messages.size(); ++i)
+    {
+        messages[i].header.message_type = static_cast<uint8_t>(MessageType::BROADCAST);
+        messages[i].kind = static_cast<uint8_t>(advertisement.kind);
+        messages[i].epoch = advertisement.epoch;
+        messages[i].base_version = advertisement.base_version;
+        messages[i].version = advertisement.version;
+        messages[i].part = static_cast<uint16_t>(i);
+        messages[i].part_count = static_cast<uint16_t>(messages.size());
+    }
+    return messages;
+}
+
+CatalogUpdate AdvertisementAssembler::gap(PeerCatalog &peer, Clock::time_point now)
+{
+    if (peer.snapshot_requested != Clock::time_point::min() && now - peer.snapshot_requested < SNAPSHOT_REQUEST_INTERVAL)
+    {
+        return CatalogUpdate::NONE;
+    }
+    peer.snapshot_requested = now;
+    return CatalogUpdate::GAP;
+}
+
+CatalogUpdate AdvertisementAssembler::add(const std::string &sender, const P2PBroadcastMessage &message,
+                                          Clock::time_point now, Advertisement &advertisement)
+{
+    if (message.part_count == 0 || message.part_count > MAX_ADVERT_PARTS || message.part >= message.part_count)
+    {
+        return CatalogUpdate::NONE;
+    }
+    PeerCatalog &peer = peers[sender];
+    AdvertKind kind = static_cast<AdvertKind>(message.kind);
+    bool same_epoch = peer.known && peer.epoch == message.epoch;
+
+    // Decided from any single datagram, so nothing is collected that could not be applied anyway.
+    if (same_epoch && message.version == peer.version)
+    {
+        return CatalogUpdate::NONE;
+    }
+    if (kind == AdvertKind::DELTA && (!same_epoch || message.base_version != peer.version))
+    {
+        // Deltas older than what we hold are just late.
+        if (same_epoch && message.version < peer.version)
+        {
+            return CatalogUpdate::NONE;
+        }
+        return gap(peer, now);
+    }
+    if (kind != AdvertKind::DELTA && same_epoch && message.version < peer.version)
+    {
+        return CatalogUpdate::NONE;
+    }
+
+    if (!peer.collecting || peer.kind != kind || peer.pending_epoch != message.epoch ||
+        peer.pending_version != message.version || peer.parts.size() != message.part_count ||
+        peer.filter_bits != message.filter_bits || peer.filter_hashes != message.filter_hashes)
+    {
+        peer.collecting = true;
+        peer.kind = kind;
+        peer.pending_epoch = message.epoch;
+        peer.pending_version = message.version;
+        peer.filter_bits = message.filter_bits;
+        peer.filter_hashes = message.filter_hashes;
+        peer.parts.assign(message.part_count, {});
+        peer.summary_parts.assign(message.part_count, {});
+        peer.received.assign(message.part_count, false);
+        peer.missing = message.part_count;
+    }
+    if (peer.received[message.part])
+    {
+        return CatalogUpdate::NONE;
+    }
+
+    std::vector<CatalogChange> &part = peer.parts[message.part];
+    for (size_t i = 0; i < message.resource_count; ++i)
+    {
+        const AdvertisedResource &entry = message.resources[i];
+        CatalogChange &change = part.emplace_back();
+        change.removed = entry.removed;
+        change.resource.name = entry.name;
+        change.resource.size = entry.size;
+        std::memcpy(change.resource.content_hash.data(), entry.content_hash, change.resource.content_hash.size());
+    }
+    peer.summary_parts[message.part].assign(message.summary, message.summary + message.summary_length);
+    peer.received[message.part] = true;
+    if (--peer.missing > 0)
+    {
+        return CatalogUpdate::NONE;
+    }
+
+    advertisement.kind = kind;
+    advertisement.epoch = message.epoch;
+    advertisement.base_version = message.base_version;
+    advertisement.version = message.version;
+    advertisement.changes.clear();
+    for (auto &changes : peer.parts)
+    {
+        advertisement.changes.insert(advertisement.changes.end(), std::make_move_iterator(changes.begin()),
+                                     std::make_move_iterator(changes.end()));
+    }
+    advertisement.summary.reset();
+    std::vector<uint8_t> summary;
+    if (kind == AdvertKind::SUMMARY)
+    {
+        for (const auto &bytes : peer.summary_parts)
+        {
+            summary.insert(summary.end(), bytes.begin(), bytes.end());
+        }
+    }
+    peer.collecting = false;
+    peer.parts.clear();
+    peer.summary_parts.clear();
+    peer.received.clear();
+    if (kind == AdvertKind::SUMMARY)
+    {
+        try
+        {
+            advertisement.summary.emplace(message.filter_bits, message.filter_hashes, std::move(summary));
+        }
+        catch (const std::invalid_argument &)
+        {
+            return CatalogUpdate::NONE;
+        }
+    }
+
+    peer.known = true;
+    peer.epoch = message.epoch;
+    peer.version = message.version;
+    if (kind == AdvertKind::DELTA)
+    {
+        return CatalogUpdate::DELTA;
+    }
+    peer.snapshot_requested = Clock::time_point::min();
+    return kind == AdvertKind::SNAPSHOT ? CatalogUpdate::SNAPSHOT : CatalogUpdate::SUMMARY;
+}
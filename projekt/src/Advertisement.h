@@ -0,0 +1,94 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "BloomFilter.h"
+#include "Protocol.h"
+#include "Resource.h"
+#include "Transfer.h"
+
+// Larger catalogs are announced as a Bloom filter summary instead of being listed.
+constexpr size_t MAX_LISTED_RESOURCES = 128;
+// A summary of a larger catalog than this would not fit MAX_ADVERT_PARTS datagrams and is made denser instead.
+constexpr size_t MAX_SUMMARIZED_RESOURCES = MAX_ADVERT_PARTS * MAX_SUMMARY_BYTES * 8 / BLOOM_BITS_PER_ENTRY;
+// A peer that keeps seeing advertisements it cannot apply asks for a snapshot at most this often.
+constexpr std::chrono::seconds SNAPSHOT_REQUEST_INTERVAL{5};
+
+// An advertisement as a whole, however many datagrams it takes. The changes of a snapshot are all additions, a
+// summary has none but its filter.
+struct Advertisement
+{
+    AdvertKind kind = AdvertKind::SNAPSHOT;
+    uint32_t epoch = 0;
+    uint32_t base_version = 0;
+    uint32_t version = 0;
+    std::vector<CatalogChange> changes;
+    std::optional<BloomFilter> summary;
+};
+
+// Lists the whole catalog, or summarizes it if it has more than MAX_LISTED_RESOURCES resources.
+Advertisement catalog_advertisement(std::vector<RemoteResource> catalog, uint32_t epoch, uint32_t version);
+
+// Splits an advertisement into as few datagrams as fit it. Only the header fields that identify the sender are
+// left to the caller. Names too long to be requested are left out.
+std::vector<P2PBroadcastMessage> build_advertisement(const Advertisement &advertisement);
+
+// What a datagram means for our copy of the sender's catalog.
+enum class CatalogUpdate
+{
+    // Nothing to do yet, or nothing new.
+    NONE,
+    // The advertisement replaces the catalog.
+    SNAPSHOT,
+    // The advertisement replaces the catalog with a summary of it.
+    SUMMARY,
+    // The advertisement changes the catalog.
+    DELTA,
+    // The sender's catalog moved past a version we missed; only a snapshot can bring us up to date.
+    GAP,
+};
+
+// Puts the advertisements of other peers back together from their datagrams and keeps track of which version of
+// each one's catalog we hold. A datagram of another advertisement from a peer discards whatever was collected of
+// its previous one, so a lost datagram costs just that announcement. Not thread-safe.
+class AdvertisementAssembler
+{
+public:
+    // Fills advertisement and takes its version as the one we hold whenever SNAPSHOT or DELTA is returned. GAP is
+    // returned at most once per SNAPSHOT_REQUEST_INTERVAL for each sender.
+    CatalogUpdate add(const std::string &sender, const P2PBroadcastMessage &message, Clock::time_point now,
+                      Advertisement &advertisement);
+
+    // Forgets the sender; its next advertisement is treated like one from a peer never heard of.
+    void forget(const std::string &sender) { peers.erase(sender); }
+
+private:
+    struct PeerCatalog
+    {
+        bool known = false;
+        uint32_t epoch = 0;
+        uint32_t version = 0;
+        Clock::time_point snapshot_requested = Clock::time_point::min();
+
+        // The advertisement being collected.
+        bool collecting = false;
+        AdvertKind kind = AdvertKind::SNAPSHOT;
+        uint32_t pending_epoch = 0;
+        uint32_t pending_version = 0;
+        uint32_t filter_bits = 0;
+        uint8_t filter_hashes = 0;
+        std::vector<std::vector<CatalogChange>> parts;
+        std::vector<std::vector<uint8_t>> summary_parts;
+        std::vector<bool> received;
+        size_t missing = 0;
+    };
+
+    CatalogUpdate gap(PeerCatalog &peer, Clock::time_point now);
+
+    std::map<std::string, PeerCatalog> peers;
+};
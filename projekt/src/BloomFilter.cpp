@@ -0,0 +1,57 @@
+#include "BloomFilter.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+BloomFilter::Key BloomFilter::key(const std::string &name)
+{
+    uint64_t h1 = 0xcbf29ce484222325ULL;
+    for (unsigned char c : name)
+    {
+        h1 ^= c;
+        h1 *= 0x100000001b3ULL;
+    }
+    uint64_t h2 = h1 + 0x9e3779b97f4a7c15ULL;
+    h2 = (h2 ^ (h2 >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h2 = (h2 ^ (h2 >> 27)) * 0x94d049bb133111ebULL;
+    h2 ^= h2 >> 31;
+    return {h1, h2 | 1};
+}
+
+BloomFilter BloomFilter::for_entries(size_t entries)
+{
+    // Whole bytes, and never empty so every probe has a bit to land on.
+    size_t byte_count = std::max<size_t>(1, (entries * BLOOM_BITS_PER_ENTRY + 7) / 8);
+    return BloomFilter(static_cast<uint32_t>(byte_count * 8), BLOOM_HASH_COUNT, std::vector<uint8_t>(byte_count));
+}
+
+BloomFilter::BloomFilter(uint32_t bit_count, uint8_t hash_count, std::vector<uint8_t> bits)
+    : bits_total(bit_count), probes(hash_count), bits(std::move(bits))
+{
+    if (bit_count == 0 || hash_count == 0 || this->bits.size() != (static_cast<size_t>(bit_count) + 7) / 8)
+    {
+        throw std::invalid_argument("Malformed Bloom filter.");
+    }
+}
+
+void BloomFilter::insert(const Key &key)
+{
+    for (uint8_t i = 0; i < probes; ++i)
+    {
+        uint64_t bit = (key.h1 + i * key.h2) % bits_total;
+        bits[bit / 8] |= static_cast<uint8_t>(1u << (bit % 8));
+    }
+}
+
+bool BloomFilter::may_contain(const Key &key) const
+{
+    for (uint8_t i = 0; i < probes; ++i)
+    {
+        uint64_t bit = (key.h1 + i * key.h2) % bits_total;
+        if ((bits[bit / 8] & (1u << (bit % 8))) == 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Filter bits spent per summarized resource; with the matching number of probes about 1% false positives.
+constexpr size_t BLOOM_BITS_PER_ENTRY = 10;
+constexpr uint8_t BLOOM_HASH_COUNT = 7;
+
+// Set of resource names that can answer "definitely not" or "probably". Every peer has to derive the same bit
+// positions from a name, so the hashing is part of the protocol: probe i of a name sets bit
+// (h1 + i * h2) mod bit_count, where h1 is the 64-bit FNV-1a hash of the name and h2 the splitmix64 finalizer of
+// h1, forced odd.
+class BloomFilter
+{
+public:
+    // The bit positions of a name before reduction to a filter size, so one name can probe many filters cheaply.
+    struct Key
+    {
+        uint64_t h1;
+        uint64_t h2;
+    };
+
+    static Key key(const std::string &name);
+
+    // An empty filter sized for the given number of names.
+    static BloomFilter for_entries(size_t entries);
+
+    // Takes over bits as received; throws std::invalid_argument if they do not match bit_count.
+    BloomFilter(uint32_t bit_count, uint8_t hash_count, std::vector<uint8_t> bits);
+
+    void insert(const std::string &name) { insert(key(name)); }
+
+    void insert(const Key &key);
+
+    bool may_contain(const Key &key) const;
+
+    uint32_t bit_count() const { return bits_total; }
+
+    uint8_t hash_count() const { return probes; }
+
+    const std::vector<uint8_t> &bytes() const { return bits; }
+
+private:
+    uint32_t bits_total;
+    uint8_t probes;
+    std::vector<uint8_t> bits;
+};
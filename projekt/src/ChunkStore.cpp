@@ -0,0 +1,100 @@
+#include "ChunkStore.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "Transfer.h"
+
+class StoredResourceData : public ResourceData
+{
+public:
+    StoredResourceData(std::shared_ptr<ChunkStore> store, std::shared_ptr<const ChunkHashes> hashes,
+                       size_t length, std::vector<const u_char *> chunks) :
+        store(std::move(store)), hashes(std::move(hashes)), length(length), chunks(std::move(chunks))
+    {
+    }
+
+    ~StoredResourceData() override { store->release(*hashes, length); }
+
+    const u_char *chunk(uint64_t index) const override { return chunks[index]; }
+
+    size_t size() const override { return length; }
+
+private:
+    std::shared_ptr<ChunkStore> store;
+    std::shared_ptr<const ChunkHashes> hashes;
+    size_t length;
+    std::vector<const u_char *> chunks;
+};
+
+size_t ChunkStore::DigestHash::operator()(const Digest &digest) const
+{
+    size_t hash;
+    std::memcpy(&hash, digest.data(), sizeof(hash));
+    return hash;
+}
+
+static size_t chunk_length(uint64_t total_length, uint64_t index)
+{
+    return std::min<uint64_t>(MAX_CHUNK_SIZE, total_length - index * MAX_CHUNK_SIZE);
+}
+
+std::shared_ptr<const ResourceData> ChunkStore::add(const std::shared_ptr<const MappedResourceData> &file,
+                                                    const std::shared_ptr<const ChunkHashes> &hashes)
+{
+    std::vector<const u_char *> resource_chunks(hashes->chunk_count());
+    std::lock_guard<std::mutex> lock(mutex);
+    for (uint64_t i = 0; i < resource_chunks.size(); ++i)
+    {
+        size_t length = chunk_length(file->size(), i);
+        auto [chunk, inserted] = chunks.try_emplace(hashes->chunk_digest(i), Chunk{file->chunk(i), file.get(), 0});
+        if (inserted)
+        {
+            File &owner = files[file.get()];
+            owner.mapping = file;
+            ++owner.chunks;
+            ++totals.stored_chunks;
+            totals.stored_bytes += length;
+        }
+        ++chunk->second.references;
+        ++totals.referenced_chunks;
+        totals.referenced_bytes += length;
+        resource_chunks[i] = chunk->second.data;
+    }
+    return std::make_shared<StoredResourceData>(shared_from_this(), hashes, file->size(), std::move(resource_chunks));
+}
+
+ChunkStoreStats ChunkStore::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return totals;
+}
+
+void ChunkStore::release(const ChunkHashes &hashes, uint64_t total_length)
+{
+    // Unmapped after the lock is released.
+    std::vector<std::shared_ptr<const MappedResourceData>> unused;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (uint64_t i = 0; i < hashes.chunk_count(); ++i)
+    {
+        size_t length = chunk_length(total_length, i);
+        auto chunk = chunks.find(hashes.chunk_digest(i));
+        --totals.referenced_chunks;
+        totals.referenced_bytes -= length;
+        if (--chunk->second.references > 0)
+        {
+            continue;
+        }
+
+        auto owner = files.find(chunk->second.file);
+        if (--owner->second.chunks == 0)
+        {
+            unused.push_back(std::move(owner->second.mapping));
+            files.erase(owner);
+        }
+        chunks.erase(chunk);
+        --totals.stored_chunks;
+        totals.stored_bytes -= length;
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "ContentHash.h"
+#include "ResourceData.h"
+
+struct ChunkStoreStats
+{
+    // Distinct chunks held, and the chunks of all resources together.
+    uint64_t stored_chunks = 0;
+    uint64_t referenced_chunks = 0;
+    uint64_t stored_bytes = 0;
+    uint64_t referenced_bytes = 0;
+};
+
+// Content-addressed store for the chunks of local resources, keyed by chunk digest. A chunk several resources have
+// in common is kept once, in whichever file brought it in first, and reference counted; a resource is just the
+// ordered list of its chunks. A file stays mapped only while one of its chunks is still in use, so registering a
+// copy of something already stored costs no extra mapping at all. Safe for concurrent use.
+class ChunkStore : public std::enable_shared_from_this<ChunkStore>
+{
+public:
+    // Registers the chunks of file, whose digests hashes holds. The returned data hands its chunks back once the
+    // last reference to it goes away, so a transfer still reading a removed resource keeps working.
+    std::shared_ptr<const ResourceData> add(const std::shared_ptr<const MappedResourceData> &file,
+                                            const std::shared_ptr<const ChunkHashes> &hashes);
+
+    ChunkStoreStats stats() const;
+
+private:
+    friend class StoredResourceData;
+
+    struct DigestHash
+    {
+        // Digests are uniformly distributed already.
+        size_t operator()(const Digest &digest) const;
+    };
+
+    struct Chunk
+    {
+        const u_char *data;
+        const MappedResourceData *file;
+        uint64_t references;
+    };
+
+    struct File
+    {
+        std::shared_ptr<const MappedResourceData> mapping;
+        uint64_t chunks;
+    };
+
+    void release(const ChunkHashes &hashes, uint64_t total_length);
+
+    mutable std::mutex mutex;
+    std::unordered_map<Digest, Chunk, DigestHash> chunks;
+    std::unordered_map<const MappedResourceData *, File> files;
+    ChunkStoreStats totals;
+};
@@ -0,0 +1,194 @@
+#include "Compression.h"
+
+#include <memory>
+
+#ifdef P2P_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef P2P_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef P2P_HAVE_ZSTD
+// Chunks are small, so a low level already gets most of what zstd can do with them.
+static const int ZSTD_LEVEL = 3;
+
+// Setting up a context costs more than compressing a chunk, so every thread keeps its own.
+static ZSTD_CCtx *zstd_compression_context()
+{
+    static thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> context(ZSTD_createCCtx(),
+                                                                                    ZSTD_freeCCtx);
+    return context.get();
+}
+
+static ZSTD_DCtx *zstd_decompression_context()
+{
+    static thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> context(ZSTD_createDCtx(),
+                                                                                    ZSTD_freeDCtx);
+    return context.get();
+}
+#endif
+
+bool compression_supported(Compression compression)
+{
+    switch (compression)
+    {
+    case Compression::NONE:
+        return true;
+    case Compression::LZ4:
+#ifdef P2P_HAVE_LZ4
+        return true;
+#else
+        return false;
+#endif
+    case Compression::ZSTD:
+#ifdef P2P_HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+bool parse_compression(const std::string &text, Compression &compression)
+{
+    for (Compression candidate : {Compression::NONE, Compression::LZ4, Compression::ZSTD})
+    {
+        if (text == compression_name(candidate))
+        {
+            compression = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *compression_name(Compression compression)
+{
+    switch (compression)
+    {
+    case Compression::NONE:
+        break;
+    case Compression::LZ4:
+        return "lz4";
+    case Compression::ZSTD:
+        return "zstd";
+    }
+    return "none";
+}
+
+// Returns the compressed length, 0 if it would not be shorter than length.
+static size_t compress_chunk(Compression compression, const u_char *source, size_t length, u_char *destination)
+{
+    if (length < 2)
+    {
+        return 0;
+    }
+    switch (compression)
+    {
+    case Compression::NONE:
+        break;
+    case Compression::LZ4:
+#ifdef P2P_HAVE_LZ4
+        return static_cast<size_t>(LZ4_compress_default(reinterpret_cast<const char *>(source),
+                                                        reinterpret_cast<char *>(destination),
+                                                        static_cast<int>(length), static_cast<int>(length - 1)));
+#else
+        break;
+#endif
+    case Compression::ZSTD:
+#ifdef P2P_HAVE_ZSTD
+    {
+        size_t compressed =
+            ZSTD_compressCCtx(zstd_compression_context(), destination, length - 1, source, length, ZSTD_LEVEL);
+        return ZSTD_isError(compressed) ? 0 : compressed;
+    }
+#else
+        break;
+#endif
+    }
+    return 0;
+}
+
+static size_t expand_chunk(Compression compression, const u_char *source, size_t length, u_char *destination,
+                           size_t capacity)
+{
+    switch (compression)
+    {
+    case Compression::NONE:
+        break;
+    case Compression::LZ4:
+#ifdef P2P_HAVE_LZ4
+    {
+        int expanded = LZ4_decompress_safe(reinterpret_cast<const char *>(source), reinterpret_cast<char *>(destination),
+                                           static_cast<int>(length), static_cast<int>(capacity));
+        return expanded > 0 ? static_cast<size_t>(expanded) : 0;
+    }
+#else
+        break;
+#endif
+    case Compression::ZSTD:
+#ifdef P2P_HAVE_ZSTD
+    {
+        size_t expanded = ZSTD_decompressDCtx(zstd_decompression_context(), destination, capacity, source, length);
+        return ZSTD_isError(expanded) ? 0 : expanded;
+    }
+#else
+        break;
+#endif
+    }
+    return 0;
+}
+
+static int64_t nanoseconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+size_t ChunkCompressor::compress(Compression compression, const u_char *source, size_t length, u_char *destination)
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t compressed = compress_chunk(compression, source, length, destination);
+    compress_nanoseconds.fetch_add(nanoseconds_since(start), std::memory_order_relaxed);
+
+    chunks_tried.fetch_add(1, std::memory_order_relaxed);
+    raw_bytes.fetch_add(length, std::memory_order_relaxed);
+    sent_bytes.fetch_add(compressed > 0 ? compressed : length, std::memory_order_relaxed);
+    if (compressed > 0)
+    {
+        chunks_compressed.fetch_add(1, std::memory_order_relaxed);
+    }
+    return compressed;
+}
+
+size_t ChunkCompressor::expand(Compression compression, const u_char *source, size_t length, u_char *destination,
+                               size_t capacity)
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t expanded = expand_chunk(compression, source, length, destination, capacity);
+    expand_nanoseconds.fetch_add(nanoseconds_since(start), std::memory_order_relaxed);
+
+    if (expanded > 0)
+    {
+        chunks_expanded.fetch_add(1, std::memory_order_relaxed);
+        received_bytes.fetch_add(length, std::memory_order_relaxed);
+        expanded_bytes.fetch_add(expanded, std::memory_order_relaxed);
+    }
+    return expanded;
+}
+
+CompressionStats ChunkCompressor::stats() const
+{
+    CompressionStats stats;
+    stats.chunks_tried = chunks_tried.load(std::memory_order_relaxed);
+    stats.chunks_compressed = chunks_compressed.load(std::memory_order_relaxed);
+    stats.raw_bytes = raw_bytes.load(std::memory_order_relaxed);
+    stats.sent_bytes = sent_bytes.load(std::memory_order_relaxed);
+    stats.compress_time = std::chrono::nanoseconds(compress_nanoseconds.load(std::memory_order_relaxed));
+    stats.chunks_expanded = chunks_expanded.load(std::memory_order_relaxed);
+    stats.received_bytes = received_bytes.load(std::memory_order_relaxed);
+    stats.expanded_bytes = expanded_bytes.load(std::memory_order_relaxed);
+    stats.expand_time = std::chrono::nanoseconds(expand_nanoseconds.load(std::memory_order_relaxed));
+    return stats;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+// Codecs a downloader may ask senders to compress the chunks of a range with. Every chunk is compressed on its own,
+// so it can be expanded whatever became of the chunks around it.
+enum class Compression : uint8_t
+{
+    NONE,
+    // Cheap enough to keep up with the link on any CPU.
+    LZ4,
+    // Smaller chunks for more CPU time.
+    ZSTD,
+};
+
+// Once this many chunks of a transfer in a row did not shrink, only every this many-th chunk is tried.
+constexpr uint32_t COMPRESSION_PROBE_INTERVAL = 16;
+
+// Whether this build has the codec; NONE always counts as supported.
+bool compression_supported(Compression compression);
+
+// Parses "none", "lz4" or "zstd"; returns false for anything else.
+bool parse_compression(const std::string &text, Compression &compression);
+
+const char *compression_name(Compression compression);
+
+struct CompressionStats
+{
+    // Chunks we tried to compress, and how many of them came out shorter and were sent compressed.
+    uint64_t chunks_tried = 0;
+    uint64_t chunks_compressed = 0;
+    // Bytes of the chunks tried, before and as they were sent, compressed or not.
+    uint64_t raw_bytes = 0;
+    uint64_t sent_bytes = 0;
+    std::chrono::nanoseconds compress_time{0};
+    // Compressed chunks received, their bytes on the wire and once expanded.
+    uint64_t chunks_expanded = 0;
+    uint64_t received_bytes = 0;
+    uint64_t expanded_bytes = 0;
+    std::chrono::nanoseconds expand_time{0};
+
+    double send_ratio() const { return sent_bytes > 0 ? static_cast<double>(raw_bytes) / sent_bytes : 1; }
+
+    double receive_ratio() const
+    {
+        return received_bytes > 0 ? static_cast<double>(expanded_bytes) / received_bytes : 1;
+    }
+};
+
+// Compresses and expands chunks, keeping count of what that saved and what it cost across all transfers. Safe for
+// concurrent use.
+class ChunkCompressor
+{
+public:
+    // Compresses a chunk into destination, which holds at least length bytes, and returns the compressed length, or 0
+    // if it did not come out shorter than length.
+    size_t compress(Compression compression, const u_char *source, size_t length, u_char *destination);
+
+    // Expands a compressed chunk into destination, which holds capacity bytes, and returns the expanded length, or 0
+    // if the chunk is malformed, does not fit or the codec is not supported.
+    size_t expand(Compression compression, const u_char *source, size_t length, u_char *destination, size_t capacity);
+
+    CompressionStats stats() const;
+
+private:
+    std::atomic<uint64_t> chunks_tried{0};
+    std::atomic<uint64_t> chunks_compressed{0};
+    std::atomic<uint64_t> raw_bytes{0};
+    std::atomic<uint64_t> sent_bytes{0};
+    std::atomic<int64_t> compress_nanoseconds{0};
+    std::atomic<uint64_t> chunks_expanded{0};
+    std::atomic<uint64_t> received_bytes{0};
+    std::atomic<uint64_t> expanded_bytes{0};
+    std::atomic<int64_t> expand_nanoseconds{0};
+};
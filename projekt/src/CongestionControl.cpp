@@ -0,0 +1,144 @@
+#include "CongestionControl.h"
+
+#include <algorithm>
+#include <cmath>
+
+// RFC 9438 constants: the cubic's scaling in chunks per second cubed and the multiplicative decrease.
+static const double CUBIC_C = 0.4;
+static const double CUBIC_BETA = 0.7;
+// Additive increase per round trip that makes the Reno estimate as aggressive as CUBIC on average.
+static const double RENO_ALPHA = 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA);
+
+static double seconds(Clock::duration duration)
+{
+    return std::chrono::duration<double>(duration).count();
+}
+
+std::unique_ptr<CongestionController> make_congestion_controller(CongestionAlgorithm algorithm)
+{
+    switch (algorithm)
+    {
+    case CongestionAlgorithm::FIXED:
+        return std::make_unique<FixedWindowController>();
+    case CongestionAlgorithm::CUBIC:
+        break;
+    }
+    return std::make_unique<CubicController>();
+}
+
+void CubicController::on_delivered(uint32_t chunks, Clock::time_point sent_at, Clock::time_point now,
+                                   std::chrono::microseconds smoothed_rtt)
+{
+    // Nothing grows while the losses of the last reduction are still being repaired.
+    if (sent_at <= recovery_start)
+    {
+        return;
+    }
+    if (congestion_window < slow_start_threshold)
+    {
+        congestion_window = std::min<double>(congestion_window + chunks, MAX_WINDOW_CHUNKS);
+        return;
+    }
+
+    if (!epoch_started)
+    {
+        epoch_started = true;
+        epoch_start = now;
+        window_max = std::max(window_max, congestion_window);
+        time_to_max = std::cbrt((window_max - congestion_window) / CUBIC_C);
+        reno_window = congestion_window;
+    }
+    // Aim for where the curve will be one round trip from now, but never more than half again the window.
+    double t = seconds(now - epoch_start) + seconds(smoothed_rtt) - time_to_max;
+    double target = std::clamp(window_max + CUBIC_C * t * t * t, congestion_window, congestion_window * 1.5);
+    congestion_window += (target - congestion_window) / congestion_window * chunks;
+
+    reno_window += RENO_ALPHA * chunks / reno_window;
+    congestion_window = std::min<double>(std::max(congestion_window, reno_window), MAX_WINDOW_CHUNKS);
+}
+
+void CubicController::on_loss(Clock::time_point sent_at, Clock::time_point now, bool timeout)
+{
+    if (sent_at <= recovery_start && !timeout)
+    {
+        return;
+    }
+    recovery_start = now;
+    epoch_started = false;
+
+    // Fast convergence: a flow that lost before getting back to its old maximum gives up some more, making room for
+    // newer flows.
+    window_max = congestion_window < window_max ? congestion_window * (1 + CUBIC_BETA) / 2 : congestion_window;
+    slow_start_threshold = std::max<double>(congestion_window * CUBIC_BETA, MIN_WINDOW_CHUNKS);
+    // After a timeout nothing is known to be getting through anymore, so the window starts over.
+    congestion_window = timeout ? MIN_WINDOW_CHUNKS : slow_start_threshold;
+}
+
+uint32_t CubicController::window() const
+{
+    return static_cast<uint32_t>(std::max<double>(congestion_window, MIN_WINDOW_CHUNKS));
+}
+
+double CubicController::pacing_rate(std::chrono::microseconds smoothed_rtt) const
+{
+    if (smoothed_rtt.count() <= 0)
+    {
+        return 0;
+    }
+    double gain = congestion_window < slow_start_threshold ? SLOW_START_PACING_GAIN : PACING_GAIN;
+    return gain * congestion_window * MAX_CHUNK_SIZE / seconds(smoothed_rtt);
+}
+
+
+void TokenBucket::set_rate(double bytes_per_second, Clock::time_point now)
+{
+    refill(now);
+    rate = bytes_per_second;
+}
+
+void TokenBucket::consume(size_t bytes, Clock::time_point now)
+{
+    refill(now);
+    if (rate > 0)
+    {
+        tokens -= static_cast<double>(bytes);
+    }
+}
+
+Clock::time_point TokenBucket::ready_at(size_t bytes, Clock::time_point now) const
+{
+    if (rate <= 0)
+    {
+        return now;
+    }
+    double available = tokens + (now > last_refill ? rate * seconds(now - last_refill) : 0);
+    double missing = static_cast<double>(std::min(bytes, capacity)) - std::min(available, double(capacity));
+    if (missing <= 0)
+    {
+        return now;
+    }
+    return now + std::chrono::ceil<Clock::duration>(std::chrono::duration<double>(missing / rate));
+}
+
+size_t TokenBucket::available(Clock::time_point now) const
+{
+    if (rate <= 0)
+    {
+        return std::numeric_limits<size_t>::max();
+    }
+    double available = tokens + (now > last_refill ? rate * seconds(now - last_refill) : 0);
+    return static_cast<size_t>(std::clamp(available, 0.0, static_cast<double>(capacity)));
+}
+
+void TokenBucket::refill(Clock::time_point now)
+{
+    if (rate > 0 && now > last_refill)
+    {
+        tokens = std::min(tokens + rate * seconds(now - last_refill), static_cast<double>(capacity));
+    }
+    else if (rate <= 0)
+    {
+        tokens = static_cast<double>(capacity);
+    }
+    last_refill = std::max(last_refill, now);
+}
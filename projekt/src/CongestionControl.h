@@ -0,0 +1,120 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+
+#include "Protocol.h"
+
+using Clock = std::chrono::steady_clock;
+
+// The sender never has chunks in flight beyond what the receiver is able to report on.
+constexpr uint32_t MAX_WINDOW_CHUNKS = SACK_WINDOW_CHUNKS;
+// Window of a transfer before anything is known about the path, as for TCP (RFC 6928).
+constexpr uint32_t INITIAL_WINDOW_CHUNKS = 10;
+constexpr uint32_t MIN_WINDOW_CHUNKS = 2;
+// Chunks the pacer lets out back to back; also the initial window, which goes out before any RTT is known.
+constexpr uint32_t PACING_BURST_CHUNKS = INITIAL_WINDOW_CHUNKS;
+// Pacing runs ahead of the window by this much so the window, not the pacer, ends up the limit.
+constexpr double SLOW_START_PACING_GAIN = 2.0;
+constexpr double PACING_GAIN = 1.25;
+
+enum class CongestionAlgorithm
+{
+    CUBIC,
+    // A constant window of MAX_WINDOW_CHUNKS without pacing, for links known to be uncontended.
+    FIXED,
+};
+
+// Decides how many chunks of one transfer may be in flight and how fast they are paced out. Driven by the
+// transfer's acknowledgements and loss detection; the transfer's mutex guards it.
+class CongestionController
+{
+public:
+    virtual ~CongestionController() = default;
+
+    // Chunks newly delivered by an acknowledgement that arrived at now, the latest of them sent at sent_at.
+    virtual void on_delivered(uint32_t chunks, Clock::time_point sent_at, Clock::time_point now,
+                              std::chrono::microseconds smoothed_rtt) = 0;
+
+    // A chunk sent at sent_at was lost, found out by a retransmission timeout or by later chunks overtaking it.
+    virtual void on_loss(Clock::time_point sent_at, Clock::time_point now, bool timeout) = 0;
+
+    virtual uint32_t window() const = 0;
+
+    // Bytes per second to pace chunks at, 0 for no pacing.
+    virtual double pacing_rate(std::chrono::microseconds smoothed_rtt) const = 0;
+};
+
+std::unique_ptr<CongestionController> make_congestion_controller(CongestionAlgorithm algorithm);
+
+// CUBIC (RFC 9438) counted in chunks: the window grows along a cubic curve centred on the window at the last loss,
+// and at least as fast as Reno would, and shrinks by a factor of 0.7 once per round trip that sees losses.
+class CubicController : public CongestionController
+{
+public:
+    void on_delivered(uint32_t chunks, Clock::time_point sent_at, Clock::time_point now,
+                      std::chrono::microseconds smoothed_rtt) override;
+
+    void on_loss(Clock::time_point sent_at, Clock::time_point now, bool timeout) override;
+
+    uint32_t window() const override;
+
+    double pacing_rate(std::chrono::microseconds smoothed_rtt) const override;
+
+private:
+    double congestion_window = INITIAL_WINDOW_CHUNKS;
+    double slow_start_threshold = MAX_WINDOW_CHUNKS;
+    // Window the cubic levels off at, about where the last loss happened.
+    double window_max = 0;
+    // Start of the current congestion avoidance epoch, set by its first acknowledgement, and the seconds from there
+    // until the cubic is back at window_max.
+    bool epoch_started = false;
+    Clock::time_point epoch_start{};
+    double time_to_max = 0;
+    // Window a Reno flow would have reached in this epoch.
+    double reno_window = 0;
+    // Losses of chunks sent before this belong to the reduction made then.
+    Clock::time_point recovery_start{};
+};
+
+class FixedWindowController : public CongestionController
+{
+public:
+    void on_delivered(uint32_t, Clock::time_point, Clock::time_point, std::chrono::microseconds) override {}
+
+    void on_loss(Clock::time_point, Clock::time_point, bool) override {}
+
+    uint32_t window() const override { return MAX_WINDOW_CHUNKS; }
+
+    double pacing_rate(std::chrono::microseconds) const override { return 0; }
+};
+
+// Token bucket in bytes. Starts full, so a burst can go out before the rate is known. Sending may overdraw it, which
+// the following sends make up for.
+class TokenBucket
+{
+public:
+    explicit TokenBucket(size_t capacity) : capacity(capacity), tokens(static_cast<double>(capacity)) {}
+
+    // A rate of 0 lets everything through.
+    void set_rate(double bytes_per_second, Clock::time_point now);
+
+    void consume(size_t bytes, Clock::time_point now);
+
+    // When the bucket will hold enough for bytes.
+    Clock::time_point ready_at(size_t bytes, Clock::time_point now) const;
+
+    // Bytes that can go out right now without overdrawing, SIZE_MAX if the rate is unlimited.
+    size_t available(Clock::time_point now) const;
+
+private:
+    void refill(Clock::time_point now);
+
+    size_t capacity;
+    double tokens;
+    double rate = 0;
+    Clock::time_point last_refill{};
+};
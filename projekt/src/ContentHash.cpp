@@ -0,0 +1,140 @@
+#include "ContentHash.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <openssl/evp.h>
+
+#include "Transfer.h"
+
+Sha256::Sha256() : context(EVP_MD_CTX_new())
+{
+    if (context == nullptr || EVP_DigestInit_ex(context, EVP_sha256(), nullptr) != 1)
+    {
+        EVP_MD_CTX_free(context);
+        throw std::runtime_error("Failed to set up SHA-256");
+    }
+}
+
+Sha256::~Sha256()
+{
+    EVP_MD_CTX_free(context);
+}
+
+void Sha256::update(const void *data, size_t length)
+{
+    EVP_DigestUpdate(context, data, length);
+}
+
+Digest Sha256::finish()
+{
+    Digest digest;
+    EVP_DigestFinal_ex(context, digest.data(), nullptr);
+    EVP_DigestInit_ex(context, nullptr, nullptr);
+    return digest;
+}
+
+std::string to_hex(const Digest &digest)
+{
+    static const char DIGITS[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(2 * digest.size());
+    for (uint8_t byte : digest)
+    {
+        hex += DIGITS[byte >> 4];
+        hex += DIGITS[byte & 0x0f];
+    }
+    return hex;
+}
+
+HashTreeLayout::HashTreeLayout(uint64_t total_length)
+{
+    // Built bottom-up, then flipped into stream order.
+    uint64_t digests = chunk_count_for(total_length);
+    while (digests > 1)
+    {
+        uint64_t chunks = (digests * CONTENT_HASH_SIZE + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE;
+        level_chunks.push_back(chunks);
+        digests = chunks;
+    }
+    std::reverse(level_chunks.begin(), level_chunks.end());
+    for (uint64_t chunks : level_chunks)
+    {
+        level_first_chunk.push_back(total_chunks);
+        total_chunks += chunks;
+    }
+}
+
+std::shared_ptr<const ChunkHashes> ChunkHashes::compute(const u_char *data, size_t length)
+{
+    uint64_t chunk_count = chunk_count_for(length);
+    std::vector<Digest> level(chunk_count);
+    for (uint64_t i = 0; i < chunk_count; ++i)
+    {
+        uint64_t offset = i * MAX_CHUNK_SIZE;
+        level[i] = chunk_hash(data + offset, std::min<uint64_t>(MAX_CHUNK_SIZE, length - offset));
+    }
+
+    HashTreeLayout layout(length);
+    std::vector<u_char> tree(layout.size());
+    for (size_t index = layout.level_count(); index-- > 0;)
+    {
+        u_char *serialized = tree.data() + layout.level_first_chunk[index] * MAX_CHUNK_SIZE;
+        std::memcpy(serialized, level.data(), level.size() * CONTENT_HASH_SIZE);
+
+        std::vector<Digest> above(layout.level_chunks[index]);
+        for (uint64_t i = 0; i < above.size(); ++i)
+        {
+            above[i] = chunk_hash(serialized + i * MAX_CHUNK_SIZE, MAX_CHUNK_SIZE);
+        }
+        level = std::move(above);
+    }
+    return std::shared_ptr<const ChunkHashes>(new ChunkHashes(chunk_count, level.front(), std::move(tree)));
+}
+
+std::shared_ptr<const ChunkHashes> ChunkHashes::from_tree(uint64_t total_length, const Digest &root,
+                                                          std::vector<u_char> tree)
+{
+    HashTreeLayout layout(total_length);
+    if (tree.size() != layout.size() ||
+        (layout.level_count() > 0 && chunk_hash(tree.data(), MAX_CHUNK_SIZE) != root))
+    {
+        throw std::invalid_argument("Hash tree does not match the resource");
+    }
+    return std::shared_ptr<const ChunkHashes>(new ChunkHashes(chunk_count_for(total_length), root, std::move(tree)));
+}
+
+Digest ChunkHashes::chunk_hash(const u_char *chunk, size_t length)
+{
+    // Called for every chunk received, so each thread keeps its context instead of setting one up per chunk.
+    thread_local Sha256 hash;
+    hash.update(chunk, length);
+    return hash.finish();
+}
+
+Digest ChunkHashes::chunk_digest(uint64_t index) const
+{
+    if (tree.empty())
+    {
+        return root_digest;
+    }
+    Digest digest;
+    std::memcpy(digest.data(), tree.data() + leaf_offset + index * CONTENT_HASH_SIZE, CONTENT_HASH_SIZE);
+    return digest;
+}
+
+bool ChunkHashes::verify_chunk(uint64_t index, const u_char *chunk, size_t length) const
+{
+    return index < chunks && chunk_hash(chunk, length) == chunk_digest(index);
+}
+
+ChunkHashes::ChunkHashes(uint64_t chunk_count, const Digest &root, std::vector<u_char> tree) :
+    chunks(chunk_count), root_digest(root), tree(std::move(tree)), leaf_offset(0)
+{
+    if (!this->tree.empty())
+    {
+        // The chunk digests are the last level in the stream.
+        uint64_t leaf_chunks = (chunk_count * CONTENT_HASH_SIZE + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE;
+        leaf_offset = this->tree.size() - leaf_chunks * MAX_CHUNK_SIZE;
+    }
+}
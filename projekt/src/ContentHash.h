@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <openssl/types.h>
+
+#include "Protocol.h"
+#include "ResourceData.h"
+
+using Digest = std::array<uint8_t, CONTENT_HASH_SIZE>;
+
+static_assert(sizeof(Digest) == CONTENT_HASH_SIZE);
+
+// Incremental SHA-256 on top of OpenSSL, which picks the SHA extensions or the widest vector unit the CPU has.
+// finish() leaves the object ready for the next message, so one context can hash any number of them.
+class Sha256
+{
+public:
+    Sha256();
+
+    ~Sha256();
+
+    Sha256(const Sha256 &) = delete;
+
+    Sha256 &operator=(const Sha256 &) = delete;
+
+    void update(const void *data, size_t length);
+
+    Digest finish();
+
+private:
+    EVP_MD_CTX *context;
+};
+
+std::string to_hex(const Digest &digest);
+
+// Shape of the hash tree of a resource of a given length. The bottom level holds one digest per chunk of the
+// resource; every level above holds one digest per chunk of the level below, padded with zeros to whole chunks, so
+// a chunk's worth of digests (the fan-out) is covered by a single digest one level up. The level that fits into one
+// chunk hashes to the root. On the wire the levels below the root are served as one stream, topmost level first.
+struct HashTreeLayout
+{
+    explicit HashTreeLayout(uint64_t total_length);
+
+    // Levels in stream order. A single-chunk resource has none, its chunk digest is the root.
+    size_t level_count() const { return level_chunks.size(); }
+
+    uint64_t size() const { return total_chunks * MAX_CHUNK_SIZE; }
+
+    std::vector<uint64_t> level_first_chunk;
+    std::vector<uint64_t> level_chunks;
+    uint64_t total_chunks = 0;
+};
+
+// Hash tree over the chunks of a resource, see HashTreeLayout; its root is the content hash of the resource. Every
+// digest is SHA-256 of the chunk it covers, so each chunk of the resource, and each chunk of the tree once the level
+// above it is known, can be checked on its own.
+//
+// The serialized levels below the root are the ResourceData served for a HASHES request.
+class ChunkHashes : public ResourceData
+{
+public:
+    static std::shared_ptr<const ChunkHashes> compute(const u_char *data, size_t length);
+
+    // Takes the serialized levels of a resource of total_length bytes, as received and verified against root.
+    // Throws std::invalid_argument if they do not fit the layout or do not hash to root.
+    static std::shared_ptr<const ChunkHashes> from_tree(uint64_t total_length, const Digest &root,
+                                                        std::vector<u_char> tree);
+
+    static Digest chunk_hash(const u_char *chunk, size_t length);
+
+    const Digest &root() const { return root_digest; }
+
+    uint64_t chunk_count() const { return chunks; }
+
+    bool verify_chunk(uint64_t index, const u_char *chunk, size_t length) const;
+
+    // Digest of chunk index of the resource.
+    Digest chunk_digest(uint64_t index) const;
+
+    const u_char *chunk(uint64_t index) const override { return tree.data() + index * MAX_CHUNK_SIZE; }
+
+    size_t size() const override { return tree.size(); }
+
+private:
+    ChunkHashes(uint64_t chunk_count, const Digest &root, std::vector<u_char> tree);
+
+    uint64_t chunks;
+    Digest root_digest;
+    std::vector<u_char> tree;
+    // Where the chunk digests start within tree.
+    size_t leaf_offset;
+};
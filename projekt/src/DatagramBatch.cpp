@@ -0,0 +1,254 @@
+#include "DatagramBatch.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <netinet/udp.h>
+
+SocketFeatures::SocketFeatures(int fd)
+{
+    // A segment size of 0 leaves plain sends unsegmented; setting it only tells whether the kernel knows the option.
+    int segment_size = 0;
+    segmentation_offload = setsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size)) == 0;
+    int enable = 1;
+    receive_offload = setsockopt(fd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0;
+}
+
+static std::runtime_error send_error()
+{
+    return std::runtime_error(std::string("Failed to send data: ") + strerror(errno));
+}
+
+static bool feature_unsupported(int error)
+{
+    return error == ENOSYS || error == EINVAL || error == EIO || error == ENOPROTOOPT || error == EOPNOTSUPP;
+}
+
+SendBatch::SendBatch(int fd, const sockaddr_in &destination, SocketFeatures &features) :
+    fd(fd), destination(destination), features(features)
+{
+}
+
+void SendBatch::push(size_t prefix_length, const u_char *payload, size_t payload_length)
+{
+    parts[2 * count] = {prefixes[count], prefix_length};
+    parts[2 * count + 1] = {const_cast<u_char *>(payload), payload_length};
+    ++count;
+}
+
+void SendBatch::flush()
+{
+    size_t queued = std::exchange(count, 0);
+    if (!features.segmentation_offload)
+    {
+        send_each(0, queued);
+        return;
+    }
+
+    size_t first = 0;
+    while (first < queued)
+    {
+        // Segments all have the size of the first one, only the last may be shorter.
+        size_t last = first + 1;
+        while (last < queued && datagram_length(last) == datagram_length(first))
+        {
+            ++last;
+        }
+        if (last < queued && datagram_length(last) < datagram_length(first))
+        {
+            ++last;
+        }
+
+        if (last - first == 1)
+        {
+            send_each(first, last);
+        }
+        else if (!send_segmented(first, last))
+        {
+            send_each(first, queued);
+            return;
+        }
+        first = last;
+    }
+}
+
+bool SendBatch::send_segmented(size_t first, size_t last)
+{
+    uint16_t segment_size = static_cast<uint16_t>(datagram_length(first));
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(segment_size))] = {};
+
+    msghdr message = {};
+    message.msg_name = &destination;
+    message.msg_namelen = sizeof(destination);
+    message.msg_iov = &parts[2 * first];
+    message.msg_iovlen = 2 * (last - first);
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_UDP;
+    header->cmsg_type = UDP_SEGMENT;
+    header->cmsg_len = CMSG_LEN(sizeof(segment_size));
+    std::memcpy(CMSG_DATA(header), &segment_size, sizeof(segment_size));
+
+    while (sendmsg(fd, &message, 0) < 0)
+    {
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (feature_unsupported(errno))
+        {
+            // Typically a route through a device that cannot segment; plain batches still work there.
+            features.segmentation_offload = false;
+            return false;
+        }
+        throw send_error();
+    }
+    return true;
+}
+
+void SendBatch::send_each(size_t first, size_t last)
+{
+    mmsghdr messages[SEND_BATCH_SIZE] = {};
+    for (size_t i = first; i < last; ++i)
+    {
+        msghdr &message = messages[i - first].msg_hdr;
+        message.msg_name = &destination;
+        message.msg_namelen = sizeof(destination);
+        message.msg_iov = &parts[2 * i];
+        message.msg_iovlen = 2;
+    }
+
+    size_t next = first;
+    while (next < last && features.send_multiple)
+    {
+        int sent = sendmmsg(fd, &messages[next - first], static_cast<unsigned int>(last - next), 0);
+        if (sent >= 0)
+        {
+            next += static_cast<size_t>(sent);
+        }
+        else if (errno == ENOSYS)
+        {
+            features.send_multiple = false;
+        }
+        else if (errno != EINTR)
+        {
+            throw send_error();
+        }
+    }
+
+    for (; next < last; ++next)
+    {
+        while (sendmsg(fd, &messages[next - first].msg_hdr, 0) < 0)
+        {
+            if (errno != EINTR)
+            {
+                throw send_error();
+            }
+        }
+    }
+}
+
+
+ReceiveRing::ReceiveRing(int fd, SocketFeatures &features) :
+    fd(fd), features(features), slot_size(features.receive_offload ? GRO_BUFFER_SIZE : MAX_DATAGRAM_SIZE),
+    buffers(RECEIVE_BATCH_SIZE * slot_size), senders(RECEIVE_BATCH_SIZE), slots(RECEIVE_BATCH_SIZE),
+    controls(RECEIVE_BATCH_SIZE * CONTROL_SPACE), headers(RECEIVE_BATCH_SIZE)
+{
+    for (size_t i = 0; i < RECEIVE_BATCH_SIZE; ++i)
+    {
+        slots[i] = {&buffers[i * slot_size], slot_size};
+        msghdr &header = headers[i].msg_hdr;
+        header.msg_name = &senders[i];
+        header.msg_iov = &slots[i];
+        header.msg_iovlen = 1;
+        header.msg_control = &controls[i * CONTROL_SPACE];
+    }
+}
+
+size_t ReceiveRing::receive(const DatagramHandler &on_datagram)
+{
+    // The kernel overwrites these on every call.
+    for (auto &message : headers)
+    {
+        message.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        message.msg_hdr.msg_controllen = CONTROL_SPACE;
+        message.msg_hdr.msg_flags = 0;
+    }
+
+    size_t delivered = 0;
+    if (features.receive_multiple)
+    {
+        int received = recvmmsg(fd, headers.data(), RECEIVE_BATCH_SIZE, MSG_DONTWAIT, nullptr);
+        if (received >= 0)
+        {
+            for (int i = 0; i < received; ++i)
+            {
+                deliver(i, headers[i].msg_len, on_datagram, delivered);
+            }
+            return delivered;
+        }
+        if (errno == ENOSYS)
+        {
+            features.receive_multiple = false;
+        }
+    }
+
+    if (!features.receive_multiple)
+    {
+        ssize_t received = recvmsg(fd, &headers[0].msg_hdr, MSG_DONTWAIT);
+        if (received >= 0)
+        {
+            deliver(0, static_cast<size_t>(received), on_datagram, delivered);
+            return delivered;
+        }
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        std::cerr << "Failed to receive data: " << strerror(errno) << std::endl;
+    }
+    return 0;
+}
+
+void ReceiveRing::deliver(size_t slot, size_t length, const DatagramHandler &on_datagram, size_t &delivered)
+{
+    msghdr &header = headers[slot].msg_hdr;
+    if (header.msg_flags & MSG_TRUNC)
+    {
+        // Larger than anything the protocol sends.
+        return;
+    }
+
+    size_t segment_size = length;
+    for (cmsghdr *control = CMSG_FIRSTHDR(&header); control != nullptr; control = CMSG_NXTHDR(&header, control))
+    {
+        if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO)
+        {
+            int coalesced_size;
+            std::memcpy(&coalesced_size, CMSG_DATA(control), sizeof(coalesced_size));
+            if (coalesced_size > 0)
+            {
+                segment_size = static_cast<size_t>(coalesced_size);
+            }
+        }
+    }
+
+    if (segment_size > MAX_DATAGRAM_SIZE)
+    {
+        // Larger than anything the protocol sends; a GRO-sized buffer does not truncate these.
+        return;
+    }
+
+    const uint8_t *data = &buffers[slot * slot_size];
+    for (size_t offset = 0; offset < length; offset += segment_size)
+    {
+        on_datagram(data + offset, std::min(segment_size, length - offset), senders[slot]);
+        ++delivered;
+    }
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "Protocol.h"
+
+// Datagrams gathered before they are handed to the kernel in one go. With UDP_SEGMENT a whole batch of full
+// chunks (32 * 1463 bytes) still fits into a single 64 KiB super-datagram.
+constexpr size_t SEND_BATCH_SIZE = 32;
+constexpr size_t RECEIVE_BATCH_SIZE = 32;
+// A GRO receive buffer has to hold a coalesced train of datagrams, not just one.
+constexpr size_t GRO_BUFFER_SIZE = 65535;
+
+// Which batching features the kernel offers for a socket. Probed once when the socket is set up; a feature that
+// fails at runtime anyway is switched off for good and the next slower path is used instead.
+struct SocketFeatures
+{
+    explicit SocketFeatures(int fd);
+
+    std::atomic<bool> segmentation_offload{false};
+    std::atomic<bool> receive_offload{false};
+    std::atomic<bool> send_multiple{true};
+    std::atomic<bool> receive_multiple{true};
+};
+
+// Collects datagrams for one destination and sends them with as few system calls as the socket allows: UDP GSO,
+// then sendmmsg, then one sendmsg per datagram. Each datagram is a serialized prefix written into the batch plus a
+// payload that is referenced, not copied, and has to stay valid until flush(). Not thread-safe; meant to live on
+// the stack of whoever is sending.
+class SendBatch
+{
+public:
+    SendBatch(int fd, const sockaddr_in &destination, SocketFeatures &features);
+
+    // Room for the serialized prefix of the next datagram.
+    uint8_t *next_prefix() { return prefixes[count]; }
+
+    void push(size_t prefix_length, const u_char *payload, size_t payload_length);
+
+    bool full() const { return count == SEND_BATCH_SIZE; }
+
+    bool empty() const { return count == 0; }
+
+    // Sends everything queued so far. Throws std::runtime_error if the kernel refused the datagrams; the batch is
+    // empty afterwards either way.
+    void flush();
+
+    static constexpr size_t PREFIX_CAPACITY = HEADER_WIRE_SIZE + DATA_FIELDS_WIRE_SIZE;
+
+private:
+    size_t datagram_length(size_t index) const { return parts[2 * index].iov_len + parts[2 * index + 1].iov_len; }
+
+    // Sends datagrams [first, last) as one segmented datagram; returns false if segmentation is unsupported.
+    bool send_segmented(size_t first, size_t last);
+
+    void send_each(size_t first, size_t last);
+
+    int fd;
+    sockaddr_in destination;
+    SocketFeatures &features;
+
+    uint8_t prefixes[SEND_BATCH_SIZE][PREFIX_CAPACITY];
+    iovec parts[2 * SEND_BATCH_SIZE];
+    size_t count = 0;
+};
+
+// Preallocated buffers the socket is drained into with recvmmsg. Coalesced GRO buffers are split back into the
+// individual datagrams before they are handed out. Only used by the thread reading the socket.
+class ReceiveRing
+{
+public:
+    using DatagramHandler = std::function<void(const uint8_t *datagram, size_t length, const sockaddr_in &sender)>;
+
+    ReceiveRing(int fd, SocketFeatures &features);
+
+    ReceiveRing(const ReceiveRing &) = delete;
+
+    ReceiveRing &operator=(const ReceiveRing &) = delete;
+
+    // Reads whatever is queued, up to one batch, and passes every datagram to on_datagram. Returns the number of
+    // datagrams handed out, 0 once the socket has nothing more to read.
+    size_t receive(const DatagramHandler &on_datagram);
+
+private:
+    static constexpr size_t CONTROL_SPACE = 64;
+
+    void deliver(size_t slot, size_t length, const DatagramHandler &on_datagram, size_t &delivered);
+
+    int fd;
+    SocketFeatures &features;
+    size_t slot_size;
+
+    std::vector<uint8_t> buffers;
+    std::vector<sockaddr_in> senders;
+    std::vector<iovec> slots;
+    std::vector<uint8_t> controls;
+    std::vector<mmsghdr> headers;
+};
@@ -0,0 +1,501 @@
+#include "DownloadManager.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+DownloadManager::DownloadManager(std::filesystem::path directory, RequestSender send_request,
+                                 CompletionHandler on_complete) :
+    directory(std::move(directory)), send_request(std::move(send_request)), on_complete(std::move(on_complete))
+{
+}
+
+bool DownloadManager::start(const std::string &resource_name, const std::vector<PeerEndpoint> &peers)
+{
+    Actions actions;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (peers.empty() || downloads.contains(resource_name))
+        {
+            return false;
+        }
+        Download &download = downloads[resource_name];
+        for (const auto &peer : peers)
+        {
+            if (!download.peers.emplace(peer, PeerState{}).second)
+            {
+                continue;
+            }
+            uint32_t transfer_id = new_transfer_id(peer);
+            queries[{peer, transfer_id}] = resource_name;
+            actions.requests.push_back({resource_name, peer, RequestType::INFO, transfer_id});
+        }
+    }
+    run(actions);
+    return true;
+}
+
+void DownloadManager::on_response(const PeerEndpoint &peer, const P2PResponseMessage &response)
+{
+    Actions actions;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        TransferKey key{peer, response.transfer_id};
+
+        auto query = queries.find(key);
+        if (query == queries.end())
+        {
+            // A peer refusing a range it had agreed to serve, e.g. because the resource was removed meanwhile.
+            auto range = ranges.find(key);
+            if (range != ranges.end() && !range->second.finished &&
+                response.status_code != static_cast<uint8_t>(ResponseStatus::OK))
+            {
+                std::string resource_name = range->second.resource_name;
+                std::cerr << peer.to_string() << " refused a range of '" << resource_name << "'" << std::endl;
+                drop_peer(resource_name, peer, actions);
+            }
+        }
+        else
+        {
+            std::string resource_name = query->second;
+            queries.erase(query);
+            auto download = downloads.find(resource_name);
+            if (download == downloads.end())
+            {
+                return;
+            }
+
+            Download &download_state = download->second;
+            Digest content_hash;
+            std::memcpy(content_hash.data(), response.content_hash, content_hash.size());
+            if (response.status_code != static_cast<uint8_t>(ResponseStatus::OK))
+            {
+                std::cerr << peer.to_string() << " does not have '" << resource_name << "'" << std::endl;
+                drop_peer(resource_name, peer, actions);
+            }
+            else if (download_state.described && (response.total_length != download_state.total_length ||
+                                                   content_hash != download_state.content_hash))
+            {
+                std::cerr << peer.to_string() << " has a different version of '" << resource_name << "'"
+                          << std::endl;
+                drop_peer(resource_name, peer, actions);
+            }
+            else
+            {
+                if (!download_state.described)
+                {
+                    download_state.described = true;
+                    download_state.total_length = response.total_length;
+                    download_state.content_hash = content_hash;
+                }
+                PeerState &state = download_state.peers[peer];
+                if (state.phase == PeerPhase::QUERYING)
+                {
+                    state.phase = PeerPhase::ACTIVE;
+                    if (download_state.file)
+                    {
+                        assign_ranges(resource_name, download_state, peer, state, actions);
+                    }
+                    else
+                    {
+                        fetch_hash_tree(resource_name, download_state, actions);
+                    }
+                }
+            }
+        }
+    }
+    run(actions);
+}
+
+std::shared_ptr<IncomingTransfer> DownloadManager::find_transfer(const TransferKey &key) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = ranges.find(key);
+    return it == ranges.end() ? nullptr : it->second.transfer;
+}
+
+void DownloadManager::on_range_complete(const TransferKey &key)
+{
+    Actions actions;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto range = ranges.find(key);
+        if (range == ranges.end() || range->second.finished)
+        {
+            return;
+        }
+        range->second.finished = true;
+
+        std::string resource_name = range->second.resource_name;
+        auto download = downloads.find(resource_name);
+        if (download == downloads.end())
+        {
+            return;
+        }
+        if (range->second.hash_tree)
+        {
+            download->second.fetching_tree = false;
+            ++download->second.tree_level;
+            fetch_hash_tree(resource_name, download->second, actions);
+        }
+        else
+        {
+            Piece &piece = download->second.pieces[range->second.piece];
+            piece.done = true;
+            piece.peers.erase(key.peer);
+
+            PeerState &state = download->second.peers[key.peer];
+            if (state.outstanding > 0)
+            {
+                --state.outstanding;
+            }
+
+            if (download->second.file->missing_chunks() == 0)
+            {
+                finish(resource_name, actions);
+            }
+            else if (state.phase == PeerPhase::ACTIVE)
+            {
+                assign_ranges(resource_name, download->second, key.peer, state, actions);
+            }
+        }
+    }
+    run(actions);
+}
+
+void DownloadManager::on_request_failed(const TransferKey &key)
+{
+    Actions actions;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string resource_name;
+        if (auto query = queries.find(key); query != queries.end())
+        {
+            resource_name = query->second;
+        }
+        else if (auto range = ranges.find(key); range != ranges.end() && !range->second.finished)
+        {
+            resource_name = range->second.resource_name;
+        }
+        else
+        {
+            return;
+        }
+        std::cerr << "No answer from " << key.peer.to_string() << " for resource: " << resource_name << std::endl;
+        drop_peer(resource_name, key.peer, actions);
+    }
+    run(actions);
+}
+
+void DownloadManager::check_stalls(Clock::time_point now)
+{
+    Actions actions;
+    std::vector<std::shared_ptr<PartialFile>> unsaved;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (now - last_state_save >= STATE_SAVE_INTERVAL)
+        {
+            last_state_save = now;
+            for (const auto &[resource_name, download] : downloads)
+            {
+                if (download.file)
+                {
+                    unsaved.push_back(download.file);
+                }
+            }
+        }
+
+        std::set<std::pair<std::string, PeerEndpoint>> stalled;
+        for (auto it = ranges.begin(); it != ranges.end();)
+        {
+            Clock::time_point last_activity;
+            {
+                std::lock_guard<std::mutex> transfer_lock(it->second.transfer->mutex);
+                last_activity = it->second.transfer->last_activity;
+            }
+            if (it->second.finished && now - last_activity > INCOMING_TRANSFER_TIMEOUT)
+            {
+                it = ranges.erase(it);
+                continue;
+            }
+            if (!it->second.finished && now - last_activity > RANGE_STALL_TIMEOUT)
+            {
+                stalled.emplace(it->second.resource_name, it->first.peer);
+            }
+            ++it;
+        }
+        for (const auto &[resource_name, peer] : stalled)
+        {
+            std::cerr << peer.to_string() << " stalled on '" << resource_name << "'" << std::endl;
+            drop_peer(resource_name, peer, actions);
+        }
+    }
+    run(actions);
+
+    // Syncs the partial file first, so it is kept out from under the lock.
+    for (const auto &file : unsaved)
+    {
+        try
+        {
+            file->save_state();
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Failed to save progress of '" << file->resource_name << "': " << e.what() << std::endl;
+        }
+    }
+}
+
+void DownloadManager::fetch_hash_tree(const std::string &resource_name, Download &download, Actions &actions)
+{
+    if (download.file || download.fetching_tree)
+    {
+        return;
+    }
+    if (!download.tree)
+    {
+        download.tree = std::make_shared<PartialHashTree>(resource_name, download.total_length,
+                                                          download.content_hash);
+    }
+    const HashTreeLayout &layout = download.tree->layout;
+    if (download.tree_level == layout.level_count())
+    {
+        start_pieces(resource_name, download, actions);
+        return;
+    }
+
+    auto source = std::find_if(download.peers.begin(), download.peers.end(),
+                               [](const auto &peer) { return peer.second.phase == PeerPhase::ACTIVE; });
+    if (source == download.peers.end())
+    {
+        return;
+    }
+    const PeerEndpoint &peer = source->first;
+    uint64_t first_chunk = layout.level_first_chunk[download.tree_level];
+    uint64_t chunk_count = layout.level_chunks[download.tree_level];
+    uint32_t transfer_id = new_transfer_id(peer);
+
+    Range &range = ranges[{peer, transfer_id}];
+    range.resource_name = resource_name;
+    range.hash_tree = true;
+    range.transfer = std::make_shared<IncomingTransfer>(download.tree, first_chunk, static_cast<uint32_t>(chunk_count));
+    download.fetching_tree = true;
+    actions.requests.push_back({resource_name, peer, RequestType::HASHES, transfer_id, first_chunk * MAX_CHUNK_SIZE,
+                                chunk_count * MAX_CHUNK_SIZE});
+}
+
+void DownloadManager::start_pieces(const std::string &resource_name, Download &download, Actions &actions)
+{
+    try
+    {
+        download.file = std::make_shared<PartialFile>(resource_name, download.total_length, download.tree->finish(),
+                                                      directory);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Cannot receive '" << resource_name << "': " << e.what() << std::endl;
+        abandon(resource_name);
+        return;
+    }
+    download.tree.reset();
+
+    uint64_t chunk_count = download.file->chunk_count();
+    download.pieces.resize((chunk_count + PIECE_CHUNKS - 1) / PIECE_CHUNKS);
+    std::cout << "Receiving '" << resource_name << "' (" << download.total_length << " bytes, "
+              << to_hex(download.content_hash) << ") from " << download.peers.size() << " peer(s)" << std::endl;
+    if (download.file->resumed_chunks() > 0)
+    {
+        std::cout << "Resuming with " << download.file->resumed_chunks() << " of " << chunk_count
+                  << " chunks already received" << std::endl;
+    }
+    if (download.file->missing_chunks() == 0)
+    {
+        finish(resource_name, actions);
+        return;
+    }
+
+    for (auto &[peer, state] : download.peers)
+    {
+        if (state.phase == PeerPhase::ACTIVE)
+        {
+            assign_ranges(resource_name, download, peer, state, actions);
+        }
+    }
+}
+
+void DownloadManager::assign_ranges(const std::string &resource_name, Download &download, const PeerEndpoint &peer,
+                                    PeerState &state, Actions &actions)
+{
+    if (!download.file)
+    {
+        return;
+    }
+    uint64_t chunk_count = download.file->chunk_count();
+    while (state.outstanding < PIECES_PER_PEER)
+    {
+        // Untouched pieces first. Once there are none left, help with the piece that has the fewest peers on it.
+        size_t chosen = download.pieces.size();
+        for (size_t i = 0; i < download.pieces.size(); ++i)
+        {
+            const Piece &piece = download.pieces[i];
+            if (piece.done || piece.peers.contains(peer))
+            {
+                continue;
+            }
+            if (chosen == download.pieces.size() || piece.peers.size() < download.pieces[chosen].peers.size())
+            {
+                chosen = i;
+                if (piece.peers.empty())
+                {
+                    break;
+                }
+            }
+        }
+        if (chosen == download.pieces.size())
+        {
+            return;
+        }
+
+        // Just the span of the piece still missing, which is all of it unless the piece was started before.
+        uint64_t first_chunk = static_cast<uint64_t>(chosen) * PIECE_CHUNKS;
+        uint64_t end_chunk = std::min<uint64_t>(first_chunk + PIECE_CHUNKS, chunk_count);
+        while (first_chunk < end_chunk && download.file->has_chunk(first_chunk))
+        {
+            ++first_chunk;
+        }
+        while (end_chunk > first_chunk && download.file->has_chunk(end_chunk - 1))
+        {
+            --end_chunk;
+        }
+        if (first_chunk == end_chunk)
+        {
+            download.pieces[chosen].done = true;
+            continue;
+        }
+        uint32_t range_chunks = static_cast<uint32_t>(end_chunk - first_chunk);
+        uint32_t transfer_id = new_transfer_id(peer);
+
+        Range &range = ranges[{peer, transfer_id}];
+        range.resource_name = resource_name;
+        range.piece = chosen;
+        range.transfer = std::make_shared<IncomingTransfer>(download.file, first_chunk, range_chunks);
+        download.pieces[chosen].peers.insert(peer);
+        ++state.outstanding;
+
+        actions.requests.push_back({resource_name, peer, RequestType::RANGE, transfer_id,
+                                    first_chunk * MAX_CHUNK_SIZE, static_cast<uint64_t>(range_chunks) * MAX_CHUNK_SIZE});
+    }
+}
+
+void DownloadManager::drop_peer(const std::string &resource_name, const PeerEndpoint &peer, Actions &actions)
+{
+    auto download = downloads.find(resource_name);
+    if (download == downloads.end())
+    {
+        return;
+    }
+    PeerState &state = download->second.peers[peer];
+    if (state.phase == PeerPhase::FAILED)
+    {
+        return;
+    }
+    state.phase = PeerPhase::FAILED;
+    state.outstanding = 0;
+
+    for (auto it = ranges.begin(); it != ranges.end();)
+    {
+        if (it->first.peer == peer && it->second.resource_name == resource_name && !it->second.finished)
+        {
+            if (it->second.hash_tree)
+            {
+                download->second.fetching_tree = false;
+            }
+            else
+            {
+                download->second.pieces[it->second.piece].peers.erase(peer);
+            }
+            it = ranges.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    std::erase_if(queries, [&](const auto &query) {
+        return query.first.peer == peer && query.second == resource_name;
+    });
+
+    // Whatever the peer was working on goes to the others.
+    bool alive = false;
+    for (auto &[other, other_state] : download->second.peers)
+    {
+        if (other_state.phase == PeerPhase::ACTIVE)
+        {
+            assign_ranges(resource_name, download->second, other, other_state, actions);
+        }
+        alive = alive || other_state.phase != PeerPhase::FAILED;
+    }
+    if (!alive)
+    {
+        std::cerr << "No peer left to download '" << resource_name << "' from" << std::endl;
+        abandon(resource_name);
+    }
+    else
+    {
+        fetch_hash_tree(resource_name, download->second, actions);
+    }
+}
+
+void DownloadManager::abandon(const std::string &resource_name)
+{
+    std::erase_if(ranges, [&](const auto &range) { return range.second.resource_name == resource_name; });
+    std::erase_if(queries, [&](const auto &query) { return query.second == resource_name; });
+    // The partial file goes away with the last transfer referencing it.
+    downloads.erase(resource_name);
+}
+
+void DownloadManager::finish(const std::string &resource_name, Actions &actions)
+{
+    try
+    {
+        const auto &file = downloads.at(resource_name).file;
+        actions.completed.emplace_back(resource_name, file->finish(), file->hashes);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Failed to store received resource '" << resource_name << "': " << e.what() << std::endl;
+    }
+
+    // Peers still duplicating a piece learn from their next acknowledgement that they are done.
+    for (auto &[key, range] : ranges)
+    {
+        if (range.resource_name == resource_name)
+        {
+            range.finished = true;
+        }
+    }
+    std::erase_if(queries, [&](const auto &query) { return query.second == resource_name; });
+    downloads.erase(resource_name);
+}
+
+uint32_t DownloadManager::new_transfer_id(const PeerEndpoint &peer)
+{
+    uint32_t transfer_id;
+    do
+    {
+        transfer_id = generator();
+    } while (transfer_id == 0 || ranges.contains({peer, transfer_id}) || queries.contains({peer, transfer_id}));
+    return transfer_id;
+}
+
+void DownloadManager::run(Actions &actions)
+{
+    for (const auto &request : actions.requests)
+    {
+        send_request(request);
+    }
+    for (const auto &[resource_name, path, hashes] : actions.completed)
+    {
+        on_complete(resource_name, path, hashes);
+    }
+}
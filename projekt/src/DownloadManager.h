@@ -0,0 +1,164 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "ContentHash.h"
+#include "PeerEndpoint.h"
+#include "Protocol.h"
+#include "Transfer.h"
+
+// Resources are handed out to peers in pieces of this many chunks: big enough to keep a peer's window busy, small
+// enough that faster peers end up serving more of them.
+constexpr uint32_t PIECE_CHUNKS = 512;
+// Ranges requested from one peer at a time, so it does not sit idle while the next request is on its way.
+constexpr size_t PIECES_PER_PEER = 2;
+// A peer that has not delivered a single chunk of a range for this long is dropped from the download.
+constexpr std::chrono::seconds RANGE_STALL_TIMEOUT{10};
+// How often the chunk bitmaps of unfinished downloads are written next to their partial files.
+constexpr std::chrono::seconds STATE_SAVE_INTERVAL{5};
+
+// A request a download wants put on the wire, and retried until the peer answers.
+struct DownloadRequest
+{
+    std::string resource_name;
+    PeerEndpoint peer;
+    RequestType type = RequestType::INFO;
+    uint32_t transfer_id = 0;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+};
+
+// Downloads a resource from every peer that has it. All peers are asked for the resource size and content hash
+// first, and then one of them for the hash tree, one level at a time. Once the chunk digests are known the
+// resource is split into pieces and every peer that answered gets PIECES_PER_PEER of them, plus the next free piece
+// whenever one of its ranges completes, so faster peers automatically take on more of the work. Once nothing is
+// left to hand out, idle peers duplicate pieces still in progress elsewhere, so a slow peer cannot hold up the end
+// of the download. Every chunk is verified on arrival, so a corrupt chunk is simply not acknowledged and sent again.
+// Only the chunks still missing from a piece are requested, so a piece taken over from a dropped peer, or one of a
+// download resumed from an earlier partial file, picks up where it left off.
+//
+// The manager does no I/O itself: it asks for requests to be sent through send_request and reports finished files
+// through on_complete, both called without its lock held. Safe for concurrent use.
+class DownloadManager
+{
+public:
+    using RequestSender = std::function<void(const DownloadRequest &request)>;
+    using CompletionHandler = std::function<void(const std::string &resource_name, const std::filesystem::path &path,
+                                                 const std::shared_ptr<const ChunkHashes> &hashes)>;
+
+    DownloadManager(std::filesystem::path directory, RequestSender send_request, CompletionHandler on_complete);
+
+    // Returns false if the resource is already being downloaded.
+    bool start(const std::string &resource_name, const std::vector<PeerEndpoint> &peers);
+
+    void on_response(const PeerEndpoint &peer, const P2PResponseMessage &response);
+
+    // The receiving side of a range requested from key.peer, or nullptr for data nobody asked for.
+    std::shared_ptr<IncomingTransfer> find_transfer(const TransferKey &key) const;
+
+    // Called whenever a range transfer has all of its chunks; repeated calls are ignored.
+    void on_range_complete(const TransferKey &key);
+
+    // The peer never answered the request with this key.
+    void on_request_failed(const TransferKey &key);
+
+    // Drops peers whose ranges stalled, forgets ranges that completed long ago and saves the progress of unfinished
+    // downloads every STATE_SAVE_INTERVAL.
+    void check_stalls(Clock::time_point now);
+
+private:
+    enum class PeerPhase
+    {
+        QUERYING,
+        ACTIVE,
+        FAILED,
+    };
+
+    struct PeerState
+    {
+        PeerPhase phase = PeerPhase::QUERYING;
+        size_t outstanding = 0;
+    };
+
+    struct Piece
+    {
+        bool done = false;
+        std::set<PeerEndpoint> peers;
+    };
+
+    struct Download
+    {
+        std::map<PeerEndpoint, PeerState> peers;
+        // Told by the first peer that answers; every other peer has to agree on both.
+        bool described = false;
+        uint64_t total_length = 0;
+        Digest content_hash{};
+        std::shared_ptr<PartialHashTree> tree;
+        // Level of the tree to fetch next, and whether a peer is on it already.
+        size_t tree_level = 0;
+        bool fetching_tree = false;
+        // Created once the hash tree has been fetched.
+        std::shared_ptr<PartialFile> file;
+        std::vector<Piece> pieces;
+    };
+
+    struct Range
+    {
+        std::string resource_name;
+        size_t piece = 0;
+        // Fetches a level of the hash tree rather than a piece of the resource.
+        bool hash_tree = false;
+        std::shared_ptr<IncomingTransfer> transfer;
+        // Completed ranges are kept around for a while, so late retransmissions still get acknowledged.
+        bool finished = false;
+    };
+
+    // Collected under the lock and acted on after it is released.
+    struct Actions
+    {
+        std::vector<DownloadRequest> requests;
+        std::vector<std::tuple<std::string, std::filesystem::path, std::shared_ptr<const ChunkHashes>>> completed;
+    };
+
+    // Requests the next level of the hash tree, or starts on the pieces once the whole tree is there. May abandon
+    // the download, so nothing may use it afterwards.
+    void fetch_hash_tree(const std::string &resource_name, Download &download, Actions &actions);
+
+    void start_pieces(const std::string &resource_name, Download &download, Actions &actions);
+
+    void assign_ranges(const std::string &resource_name, Download &download, const PeerEndpoint &peer,
+                       PeerState &state, Actions &actions);
+
+    void drop_peer(const std::string &resource_name, const PeerEndpoint &peer, Actions &actions);
+
+    void abandon(const std::string &resource_name);
+
+    void finish(const std::string &resource_name, Actions &actions);
+
+    uint32_t new_transfer_id(const PeerEndpoint &peer);
+
+    void run(Actions &actions);
+
+    std::filesystem::path directory;
+    RequestSender send_request;
+    CompletionHandler on_complete;
+
+    mutable std::mutex mutex;
+    std::map<std::string, Download> downloads;
+    std::map<TransferKey, Range> ranges;
+    // INFO requests that have not been answered yet, mapped to the resource they ask about.
+    std::map<TransferKey, std::string> queries;
+    std::mt19937 generator{std::random_device{}()};
+    Clock::time_point last_state_save{};
+};
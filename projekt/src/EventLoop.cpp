@@ -0,0 +1,190 @@
+#include "EventLoop.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+constexpr int MAX_EVENTS = 64;
+
+static std::runtime_error system_error(const std::string &what)
+{
+    return std::runtime_error(what + ": " + strerror(errno));
+}
+
+static timespec to_timespec(std::chrono::nanoseconds duration)
+{
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(duration);
+    return {static_cast<time_t>(seconds.count()), static_cast<long>((duration - seconds).count())};
+}
+
+EventLoop::EventLoop()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        throw system_error("Failed to create epoll instance");
+    }
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0)
+    {
+        close(epoll_fd);
+        throw system_error("Failed to create eventfd");
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = wakeup_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event);
+}
+
+EventLoop::~EventLoop()
+{
+    // Timers are owned by the loop, plain descriptors by whoever registered them.
+    for (int timer_fd : timers)
+    {
+        close(timer_fd);
+    }
+    close(wakeup_fd);
+    close(epoll_fd);
+}
+
+void EventLoop::register_fd(int fd, Callback callback)
+{
+    {
+        std::lock_guard<std::mutex> lock(handlers_mutex);
+        handlers[fd] = std::make_shared<Callback>(std::move(callback));
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        std::lock_guard<std::mutex> lock(handlers_mutex);
+        handlers.erase(fd);
+        throw system_error("Failed to watch file descriptor");
+    }
+}
+
+void EventLoop::add_fd(int fd, Callback on_readable)
+{
+    register_fd(fd, std::move(on_readable));
+}
+
+void EventLoop::remove_fd(int fd)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    std::lock_guard<std::mutex> lock(handlers_mutex);
+    handlers.erase(fd);
+}
+
+int EventLoop::add_timer(Callback on_expired)
+{
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0)
+    {
+        throw system_error("Failed to create timer");
+    }
+    register_fd(timer_fd, [timer_fd, callback = std::move(on_expired)]() {
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        {
+            callback();
+        }
+    });
+    std::lock_guard<std::mutex> lock(handlers_mutex);
+    timers.insert(timer_fd);
+    return timer_fd;
+}
+
+void EventLoop::remove_timer(int timer_id)
+{
+    remove_fd(timer_id);
+    {
+        std::lock_guard<std::mutex> lock(handlers_mutex);
+        timers.erase(timer_id);
+    }
+    close(timer_id);
+}
+
+void EventLoop::arm_timer_at(int timer_id, std::chrono::steady_clock::time_point deadline)
+{
+    // steady_clock is CLOCK_MONOTONIC on Linux, so its time points can be handed to the timer as they are. A zero
+    // expiry would disarm the timer instead, hence the one nanosecond floor.
+    itimerspec spec = {};
+    spec.it_value = to_timespec(std::max(deadline.time_since_epoch(), std::chrono::nanoseconds(1)));
+    timerfd_settime(timer_id, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+void EventLoop::arm_periodic_timer(int timer_id, std::chrono::nanoseconds interval)
+{
+    itimerspec spec = {};
+    spec.it_value = to_timespec(interval);
+    spec.it_interval = to_timespec(interval);
+    timerfd_settime(timer_id, 0, &spec, nullptr);
+}
+
+void EventLoop::disarm_timer(int timer_id)
+{
+    itimerspec spec = {};
+    timerfd_settime(timer_id, 0, &spec, nullptr);
+}
+
+void EventLoop::run()
+{
+    epoll_event events[MAX_EVENTS];
+    while (!stop_requested)
+    {
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw system_error("epoll_wait failed");
+        }
+        for (int i = 0; i < count && !stop_requested; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == wakeup_fd)
+            {
+                uint64_t value;
+                read(wakeup_fd, &value, sizeof(value));
+                continue;
+            }
+
+            std::shared_ptr<Callback> handler;
+            {
+                std::lock_guard<std::mutex> lock(handlers_mutex);
+                auto it = handlers.find(fd);
+                if (it == handlers.end())
+                {
+                    continue;
+                }
+                handler = it->second;
+            }
+            // One failing handler must not take the whole loop down with it.
+            try
+            {
+                (*handler)();
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error handling event: " << e.what() << std::endl;
+            }
+        }
+    }
+}
+
+void EventLoop::stop()
+{
+    stop_requested = true;
+    uint64_t value = 1;
+    write(wakeup_fd, &value, sizeof(value));
+}
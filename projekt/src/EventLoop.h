@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+
+// Single-threaded epoll reactor. File descriptors and timers (each one a timerfd) are registered with a callback
+// that run() invokes on its own thread whenever they become readable or expire. stop() may be called from any
+// thread and wakes run() through an eventfd. Registration is thread-safe as well.
+class EventLoop
+{
+public:
+    using Callback = std::function<void()>;
+
+    EventLoop();
+
+    ~EventLoop();
+
+    EventLoop(const EventLoop &) = delete;
+
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    // The callback runs while fd is readable (level-triggered), so it has to drain or read what is there.
+    void add_fd(int fd, Callback on_readable);
+
+    void remove_fd(int fd);
+
+    // Creates a disarmed timer and returns its id.
+    int add_timer(Callback on_expired);
+
+    void remove_timer(int timer_id);
+
+    // Fires once at the given point in time; an already armed timer is moved.
+    void arm_timer_at(int timer_id, std::chrono::steady_clock::time_point deadline);
+
+    // Fires every interval, the first time one interval from now.
+    void arm_periodic_timer(int timer_id, std::chrono::nanoseconds interval);
+
+    void disarm_timer(int timer_id);
+
+    // Dispatches events until stop() is called; a loop cannot be restarted once stopped.
+    void run();
+
+    void stop();
+
+private:
+    void register_fd(int fd, Callback callback);
+
+    int epoll_fd = -1;
+    int wakeup_fd = -1;
+    std::atomic<bool> stop_requested{false};
+
+    std::mutex handlers_mutex;
+    std::map<int, std::shared_ptr<Callback>> handlers;
+    std::set<int> timers;
+};
@@ -0,0 +1,260 @@
+#include "NameIndex.h"
+
+#include <algorithm>
+#include <fnmatch.h>
+
+// Grams checked per candidate before the pattern itself is matched against the name.
+constexpr size_t MAX_PROBED_POSTINGS = 4;
+
+static uint32_t trigram_at(const std::string &text, size_t position)
+{
+    return static_cast<uint32_t>(static_cast<unsigned char>(text[position])) << 16 |
+           static_cast<uint32_t>(static_cast<unsigned char>(text[position + 1])) << 8 |
+           static_cast<uint32_t>(static_cast<unsigned char>(text[position + 2]));
+}
+
+// Bigrams live in the same table as trigrams, above all 24-bit trigram keys.
+static uint32_t bigram_at(const std::string &text, size_t position)
+{
+    return 1u << 24 | static_cast<uint32_t>(static_cast<unsigned char>(text[position])) << 8 |
+           static_cast<uint32_t>(static_cast<unsigned char>(text[position + 1]));
+}
+
+static std::vector<uint32_t> grams_of(const std::string &text)
+{
+    std::vector<uint32_t> grams;
+    for (size_t i = 0; i + 2 <= text.size(); ++i)
+    {
+        grams.push_back(bigram_at(text, i));
+        if (i + 3 <= text.size())
+        {
+            grams.push_back(trigram_at(text, i));
+        }
+    }
+    std::sort(grams.begin(), grams.end());
+    grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+    return grams;
+}
+
+// The grams every name containing fragment has: its trigrams, or its bigram if it is that short.
+static void add_required_grams(const std::string &fragment, std::vector<uint32_t> &grams)
+{
+    if (fragment.size() == 2)
+    {
+        grams.push_back(bigram_at(fragment, 0));
+    }
+    for (size_t i = 0; i + 3 <= fragment.size(); ++i)
+    {
+        grams.push_back(trigram_at(fragment, i));
+    }
+}
+
+static bool matches(SearchMode mode, const std::string &pattern, const std::string &name)
+{
+    switch (mode)
+    {
+        case SearchMode::PREFIX:
+            return name.starts_with(pattern);
+        case SearchMode::SUBSTRING:
+            return name.find(pattern) != std::string::npos;
+        case SearchMode::GLOB:
+            return fnmatch(pattern.c_str(), name.c_str(), 0) == 0;
+    }
+    return false;
+}
+
+// The runs of literal characters in the glob; every match contains each of them, and starts with the first one if
+// the glob does.
+static std::vector<std::string> glob_literals(const std::string &pattern, std::string &prefix)
+{
+    std::vector<std::string> literals(1);
+    bool leading = true;
+    for (size_t i = 0; i < pattern.size(); ++i)
+    {
+        char c = pattern[i];
+        if (c == '*' || c == '?' || c == '[' || c == '\\')
+        {
+            if (leading)
+            {
+                prefix = literals.back();
+                leading = false;
+            }
+            literals.emplace_back();
+            if (c == '[')
+            {
+                // Skip the bracket expression; a ']' right after the opening one is part of it.
+                size_t close = pattern.find(']', i + 2);
+                i = close == std::string::npos ? pattern.size() : close;
+            }
+            else if (c == '\\')
+            {
+                ++i;
+            }
+            continue;
+        }
+        literals.back() += c;
+    }
+    if (leading)
+    {
+        prefix = literals.back();
+    }
+    return literals;
+}
+
+void NameIndex::add(const std::string &name)
+{
+    auto [it, inserted] = names.try_emplace(name, Entry{0, 0});
+    if (it->second.references++ > 0)
+    {
+        return;
+    }
+    uint32_t id;
+    if (free_ids.empty())
+    {
+        id = static_cast<uint32_t>(by_id.size());
+        by_id.emplace_back();
+    }
+    else
+    {
+        id = free_ids.back();
+        free_ids.pop_back();
+    }
+    it->second.id = id;
+
+    IndexedName &indexed = by_id[id];
+    indexed.name = &it->first;
+    indexed.slots.clear();
+    for (uint32_t gram : grams_of(name))
+    {
+        std::vector<uint32_t> &posting = postings[gram];
+        indexed.slots.emplace_back(gram, static_cast<uint32_t>(posting.size()));
+        posting.push_back(id);
+    }
+}
+
+void NameIndex::remove(const std::string &name)
+{
+    auto it = names.find(name);
+    if (it == names.end() || --it->second.references > 0)
+    {
+        return;
+    }
+    uint32_t id = it->second.id;
+    IndexedName &indexed = by_id[id];
+    for (const auto &[gram, position] : indexed.slots)
+    {
+        // The last id of the posting takes the place of this one.
+        auto posting = postings.find(gram);
+        uint32_t moved = posting->second.back();
+        posting->second[position] = moved;
+        posting->second.pop_back();
+        if (moved != id)
+        {
+            auto &slots = by_id[moved].slots;
+            std::lower_bound(slots.begin(), slots.end(), std::make_pair(gram, 0u))->second = position;
+        }
+        if (posting->second.empty())
+        {
+            postings.erase(posting);
+        }
+    }
+    indexed.name = nullptr;
+    indexed.slots.clear();
+    indexed.slots.shrink_to_fit();
+    free_ids.push_back(id);
+    names.erase(it);
+}
+
+bool NameIndex::has_gram(uint32_t id, uint32_t gram) const
+{
+    const auto &slots = by_id[id].slots;
+    auto slot = std::lower_bound(slots.begin(), slots.end(), std::make_pair(gram, 0u));
+    return slot != slots.end() && slot->first == gram;
+}
+
+std::vector<std::string> NameIndex::walk(SearchMode mode, const std::string &pattern, const std::string &prefix,
+                                         size_t limit) const
+{
+    std::vector<std::string> results;
+    for (auto it = names.lower_bound(prefix); it != names.end() && results.size() < limit; ++it)
+    {
+        if (!it->first.starts_with(prefix))
+        {
+            break;
+        }
+        if (matches(mode, pattern, it->first))
+        {
+            results.push_back(it->first);
+        }
+    }
+    return results;
+}
+
+std::vector<std::string> NameIndex::search(SearchMode mode, const std::string &pattern, size_t limit) const
+{
+    // Matches all start with prefix and contain every one of the required grams.
+    std::string prefix;
+    std::vector<uint32_t> grams;
+    switch (mode)
+    {
+        case SearchMode::PREFIX:
+            prefix = pattern;
+            break;
+        case SearchMode::SUBSTRING:
+            add_required_grams(pattern, grams);
+            break;
+        case SearchMode::GLOB:
+            for (const auto &literal : glob_literals(pattern, prefix))
+            {
+                add_required_grams(literal, grams);
+            }
+            break;
+    }
+
+    std::sort(grams.begin(), grams.end());
+    grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+    std::vector<std::pair<size_t, uint32_t>> required;
+    for (uint32_t gram : grams)
+    {
+        auto posting = postings.find(gram);
+        if (posting == postings.end())
+        {
+            return {};
+        }
+        required.emplace_back(posting->second.size(), gram);
+    }
+    std::sort(required.begin(), required.end());
+
+    // Walking the names in order stops at the limit-th match, which beats sorting the candidates when even the
+    // rarest gram is common or a prefix already narrows the names down.
+    if (required.empty() || !prefix.empty() || required.front().first * 16 > names.size())
+    {
+        return walk(mode, pattern, prefix, limit);
+    }
+
+    std::vector<const std::string *> found;
+    size_t probed = std::min(required.size(), MAX_PROBED_POSTINGS);
+    for (uint32_t id : postings.at(required.front().second))
+    {
+        bool candidate = true;
+        for (size_t i = 1; i < probed && candidate; ++i)
+        {
+            candidate = has_gram(id, required[i].second);
+        }
+        if (candidate && matches(mode, pattern, *by_id[id].name))
+        {
+            found.push_back(by_id[id].name);
+        }
+    }
+    size_t count = std::min(limit, found.size());
+    std::partial_sort(found.begin(), found.begin() + count, found.end(),
+                      [](const std::string *a, const std::string *b) { return *a < *b; });
+
+    std::vector<std::string> results;
+    results.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        results.push_back(*found[i]);
+    }
+    return results;
+}
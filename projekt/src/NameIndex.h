@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Matches returned by a search unless the caller asks for a different number.
+constexpr size_t DEFAULT_SEARCH_LIMIT = 50;
+
+enum class SearchMode
+{
+    // Names starting with the pattern.
+    PREFIX,
+    // Names containing the pattern anywhere.
+    SUBSTRING,
+    // Names matching the pattern as a shell glob, with *, ? and [...].
+    GLOB,
+};
+
+// Searchable set of resource names. A name stays in the index until it has been removed as many times as it was
+// added, so local resources and the catalogs of several peers can share one index. Every name is filed under each
+// of its bigrams and trigrams; a search only looks at names that have all the grams its pattern requires, or walks
+// the sorted names from the pattern's literal prefix when that is cheaper. Not thread-safe.
+class NameIndex
+{
+public:
+    void add(const std::string &name);
+
+    void remove(const std::string &name);
+
+    // Up to limit matching names, in order.
+    std::vector<std::string> search(SearchMode mode, const std::string &pattern, size_t limit) const;
+
+    size_t size() const { return names.size(); }
+
+private:
+    struct Entry
+    {
+        uint32_t id;
+        uint32_t references;
+    };
+
+    struct IndexedName
+    {
+        const std::string *name = nullptr;
+        // Each gram of the name with the position of the name's id in its posting, sorted by gram.
+        std::vector<std::pair<uint32_t, uint32_t>> slots;
+    };
+
+    bool has_gram(uint32_t id, uint32_t gram) const;
+
+    // Matches among the names starting with prefix, in order, stopping at the limit-th.
+    std::vector<std::string> walk(SearchMode mode, const std::string &pattern, const std::string &prefix,
+                                  size_t limit) const;
+
+    std::map<std::string, Entry> names;
+    // Ids of removed names are handed out again.
+    std::vector<IndexedName> by_id;
+    std::vector<uint32_t> free_ids;
+    // Ids of the names containing each gram, in no particular order.
+    std::unordered_map<uint32_t, std::vector<uint32_t>> postings;
+};
@@ -0,0 +1,117 @@
+#include "PacketPool.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+PacketBuffer::PacketBuffer(PacketBuffer &&other) noexcept :
+    pool(std::exchange(other.pool, nullptr)), bytes(std::exchange(other.bytes, nullptr)),
+    length(std::exchange(other.length, 0)), slot(std::exchange(other.slot, NO_SLOT))
+{
+}
+
+PacketBuffer &PacketBuffer::operator=(PacketBuffer &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        pool = std::exchange(other.pool, nullptr);
+        bytes = std::exchange(other.bytes, nullptr);
+        length = std::exchange(other.length, 0);
+        slot = std::exchange(other.slot, NO_SLOT);
+    }
+    return *this;
+}
+
+void PacketBuffer::assign(const uint8_t *datagram, size_t datagram_length)
+{
+    if (datagram_length > PacketPool::BUFFER_SIZE)
+    {
+        throw std::length_error("Datagram does not fit into a packet buffer");
+    }
+    std::memcpy(bytes, datagram, datagram_length);
+    length = datagram_length;
+}
+
+void PacketBuffer::release()
+{
+    if (bytes == nullptr)
+    {
+        return;
+    }
+    if (slot == NO_SLOT)
+    {
+        delete[] bytes;
+    }
+    else
+    {
+        pool->release(slot);
+    }
+    pool = nullptr;
+    bytes = nullptr;
+    length = 0;
+    slot = NO_SLOT;
+}
+
+
+PacketPool::PacketPool(size_t capacity) :
+    capacity(capacity), slab(std::make_unique_for_overwrite<uint8_t[]>(capacity * STRIDE + 63))
+{
+    // Pages are only touched once a buffer is first used.
+    uintptr_t address = reinterpret_cast<uintptr_t>(slab.get());
+    first_buffer = slab.get() + ((64 - address % 64) % 64);
+
+    free_slots.reserve(capacity);
+    for (size_t i = capacity; i > 0; --i)
+    {
+        free_slots.push_back(static_cast<uint32_t>(i - 1));
+    }
+}
+
+PacketBuffer PacketPool::acquire()
+{
+    PacketBuffer buffer;
+    acquired.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(free_mutex);
+        if (!free_slots.empty())
+        {
+            buffer.slot = free_slots.back();
+            free_slots.pop_back();
+        }
+    }
+
+    if (buffer.slot == PacketBuffer::NO_SLOT)
+    {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        buffer.bytes = new uint8_t[BUFFER_SIZE];
+        return buffer;
+    }
+
+    buffer.pool = this;
+    buffer.bytes = first_buffer + static_cast<size_t>(buffer.slot) * STRIDE;
+    size_t used = in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+    size_t peak = peak_in_use.load(std::memory_order_relaxed);
+    while (used > peak && !peak_in_use.compare_exchange_weak(peak, used, std::memory_order_relaxed))
+    {
+    }
+    return buffer;
+}
+
+void PacketPool::release(uint32_t slot)
+{
+    in_use.fetch_sub(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(free_mutex);
+    free_slots.push_back(slot);
+}
+
+PacketPoolStats PacketPool::stats() const
+{
+    PacketPoolStats stats;
+    stats.capacity = capacity;
+    stats.in_use = in_use.load(std::memory_order_relaxed);
+    stats.peak_in_use = peak_in_use.load(std::memory_order_relaxed);
+    stats.acquired = acquired.load(std::memory_order_relaxed);
+    stats.misses = misses.load(std::memory_order_relaxed);
+    return stats;
+}
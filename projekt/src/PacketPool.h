@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Protocol.h"
+
+struct PacketPoolStats
+{
+    size_t capacity = 0;
+    size_t in_use = 0;
+    size_t peak_in_use = 0;
+    uint64_t acquired = 0;
+    // Buffers that had to come from the heap because the pool was exhausted.
+    uint64_t misses = 0;
+};
+
+class PacketPool;
+
+// Owns one datagram-sized buffer and gives it back to its pool when destroyed. Move-only, so a received datagram
+// has exactly one owner on its way from the socket through a worker.
+class PacketBuffer
+{
+public:
+    PacketBuffer() = default;
+
+    PacketBuffer(PacketBuffer &&other) noexcept;
+
+    PacketBuffer &operator=(PacketBuffer &&other) noexcept;
+
+    ~PacketBuffer() { release(); }
+
+    const uint8_t *data() const { return bytes; }
+
+    size_t size() const { return length; }
+
+    // Copies a datagram of at most PacketPool::BUFFER_SIZE bytes into the buffer.
+    void assign(const uint8_t *datagram, size_t datagram_length);
+
+    explicit operator bool() const { return bytes != nullptr; }
+
+private:
+    friend class PacketPool;
+
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+    void release();
+
+    PacketPool *pool = nullptr;
+    uint8_t *bytes = nullptr;
+    size_t length = 0;
+    uint32_t slot = NO_SLOT;
+};
+
+// Fixed slab of datagram buffers. Free buffers are handed out most recently released first, so a lightly loaded
+// node keeps reusing the same few cache-warm buffers. Safe for concurrent use; the pool has to outlive every
+// buffer it hands out.
+class PacketPool
+{
+public:
+    static constexpr size_t BUFFER_SIZE = MAX_DATAGRAM_SIZE;
+
+    explicit PacketPool(size_t capacity);
+
+    PacketPool(const PacketPool &) = delete;
+
+    PacketPool &operator=(const PacketPool &) = delete;
+
+    // Never fails: once the pool is exhausted the buffer is allocated on the heap and counted as a miss.
+    PacketBuffer acquire();
+
+    PacketPoolStats stats() const;
+
+private:
+    friend class PacketBuffer;
+
+    // Buffers start on cache line boundaries.
+    static constexpr size_t STRIDE = (BUFFER_SIZE + 63) / 64 * 64;
+
+    void release(uint32_t slot);
+
+    const size_t capacity;
+    std::unique_ptr<uint8_t[]> slab;
+    uint8_t *first_buffer;
+
+    std::mutex free_mutex;
+    std::vector<uint32_t> free_slots;
+
+    std::atomic<size_t> in_use{0};
+    std::atomic<size_t> peak_in_use{0};
+    std::atomic<uint64_t> acquired{0};
+    std::atomic<uint64_t> misses{0};
+};
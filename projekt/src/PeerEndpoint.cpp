@@ -0,0 +1,41 @@
+#include "PeerEndpoint.h"
+
+#include <stdexcept>
+#include <arpa/inet.h>
+
+PeerEndpoint PeerEndpoint::from_sockaddr(const sockaddr_in &socket_address)
+{
+    return {ntohl(socket_address.sin_addr.s_addr), ntohs(socket_address.sin_port)};
+}
+
+PeerEndpoint PeerEndpoint::parse(const std::string &ip, uint16_t port)
+{
+    in_addr parsed = {};
+    if (inet_pton(AF_INET, ip.c_str(), &parsed) <= 0)
+    {
+        throw std::invalid_argument("Invalid IPv4 address: " + ip);
+    }
+    return {ntohl(parsed.s_addr), port};
+}
+
+sockaddr_in PeerEndpoint::to_sockaddr() const
+{
+    sockaddr_in socket_address = {};
+    socket_address.sin_family = AF_INET;
+    socket_address.sin_addr.s_addr = htonl(address);
+    socket_address.sin_port = htons(port);
+    return socket_address;
+}
+
+std::string PeerEndpoint::ip() const
+{
+    in_addr network_address = {htonl(address)};
+    char text[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &network_address, text, sizeof(text));
+    return text;
+}
+
+std::string PeerEndpoint::to_string() const
+{
+    return ip() + ":" + std::to_string(port);
+}
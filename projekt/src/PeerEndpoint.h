@@ -0,0 +1,36 @@
+#pragma once
+
+#include <compare>
+#include <cstdint>
+#include <string>
+#include <netinet/in.h>
+
+// Address and port of a peer's communication socket, both in host byte order so they order naturally as map keys.
+struct PeerEndpoint
+{
+    uint32_t address = 0;
+    uint16_t port = 0;
+
+    static PeerEndpoint from_sockaddr(const sockaddr_in &socket_address);
+
+    // Throws std::invalid_argument for anything that is not a dotted IPv4 address.
+    static PeerEndpoint parse(const std::string &ip, uint16_t port);
+
+    sockaddr_in to_sockaddr() const;
+
+    std::string ip() const;
+
+    // "ip:port", for log output.
+    std::string to_string() const;
+
+    auto operator<=>(const PeerEndpoint &) const = default;
+};
+
+// Transfer ids are picked by the requester, so they are only unique together with the requesting peer.
+struct TransferKey
+{
+    PeerEndpoint peer;
+    uint32_t transfer_id = 0;
+
+    auto operator<=>(const TransferKey &) const = default;
+};
@@ -0,0 +1,90 @@
+#include "PeerTracker.h"
+
+#include <algorithm>
+#include <tuple>
+
+// Enough slots that the default ttl fits into a single turn of the wheel.
+constexpr size_t EXPIRY_WHEEL_SLOTS = 128;
+
+PeerTracker::PeerTracker(Clock::duration ttl, Clock::time_point now) :
+    time_to_live(ttl), expiry(PEER_EXPIRY_TICK, EXPIRY_WHEEL_SLOTS, now)
+{
+}
+
+void PeerTracker::seen(const std::string &ip, Clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    PeerStats &peer = peers[ip];
+    // Within one tick the expiry would not move, so the wheel is left alone.
+    if (now - peer.last_seen >= PEER_EXPIRY_TICK)
+    {
+        peer.last_seen = now;
+        expiry.schedule(ip, now + time_to_live);
+    }
+}
+
+void PeerTracker::record_answer(const std::string &ip, Clock::time_point now, std::chrono::microseconds rtt)
+{
+    seen(ip, now);
+    std::lock_guard<std::mutex> lock(mutex);
+    PeerStats &peer = peers[ip];
+    ++peer.answered;
+    peer.consecutive_failures = 0;
+    if (rtt > std::chrono::microseconds::zero())
+    {
+        peer.smoothed_rtt = peer.smoothed_rtt == std::chrono::microseconds::zero()
+                                ? rtt
+                                : (peer.smoothed_rtt * 7 + rtt) / 8;
+    }
+}
+
+void PeerTracker::record_failure(const std::string &ip)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto peer = peers.find(ip);
+    if (peer != peers.end())
+    {
+        ++peer->second.unanswered;
+        ++peer->second.consecutive_failures;
+    }
+}
+
+std::vector<std::string> PeerTracker::expire(Clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::string> expired = expiry.advance(now);
+    for (const auto &ip : expired)
+    {
+        peers.erase(ip);
+    }
+    return expired;
+}
+
+std::map<std::string, PeerStats> PeerTracker::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return peers;
+}
+
+std::vector<PeerEndpoint> PeerTracker::select(std::vector<PeerEndpoint> endpoints) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto order = [this](const PeerEndpoint &endpoint) {
+        auto peer = peers.find(endpoint.ip());
+        PeerStats stats = peer == peers.end() ? PeerStats{} : peer->second;
+        // Peers without an RTT sample yet go after the measured ones of the same health.
+        auto rtt = stats.smoothed_rtt == std::chrono::microseconds::zero() ? std::chrono::microseconds::max()
+                                                                            : stats.smoothed_rtt;
+        return std::make_tuple(!stats.healthy(), -stats.success_rate(), rtt);
+    };
+    std::stable_sort(endpoints.begin(), endpoints.end(),
+                     [&](const PeerEndpoint &a, const PeerEndpoint &b) { return order(a) < order(b); });
+
+    auto unhealthy = std::find_if(endpoints.begin(), endpoints.end(),
+                                  [&](const PeerEndpoint &endpoint) { return std::get<0>(order(endpoint)); });
+    if (unhealthy != endpoints.begin())
+    {
+        endpoints.erase(unhealthy, endpoints.end());
+    }
+    return endpoints;
+}
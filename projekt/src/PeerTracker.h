@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "PeerEndpoint.h"
+#include "TimerWheel.h"
+#include "Transfer.h"
+
+// Peers not heard from for this long are forgotten, unless configured otherwise.
+constexpr std::chrono::seconds DEFAULT_PEER_TTL{90};
+// Granularity of peer expiry; also how often the event loop checks for expired peers.
+constexpr std::chrono::seconds PEER_EXPIRY_TICK{1};
+// A peer whose last this many requests all went unanswered is only used when nobody else can be.
+constexpr uint32_t UNHEALTHY_PEER_FAILURES = 3;
+
+struct PeerStats
+{
+    Clock::time_point last_seen{};
+    // Smoothed round trip time of requests, zero until the first sample.
+    std::chrono::microseconds smoothed_rtt{0};
+    uint32_t answered = 0;
+    uint32_t unanswered = 0;
+    // Unanswered requests since the last answered one.
+    uint32_t consecutive_failures = 0;
+
+    // Answered requests out of all, 1 for a peer not asked anything yet.
+    double success_rate() const
+    {
+        uint32_t total = answered + unanswered;
+        return total == 0 ? 1.0 : static_cast<double>(answered) / total;
+    }
+
+    bool healthy() const { return consecutive_failures < UNHEALTHY_PEER_FAILURES; }
+};
+
+// Liveness and request statistics of the peers we hear from, by IP address. A peer expires ttl after it was last
+// heard from; expiry runs on a TimerWheel, so checking for it does not touch peers that are not due. Safe for
+// concurrent use.
+class PeerTracker
+{
+public:
+    explicit PeerTracker(Clock::duration ttl, Clock::time_point now = Clock::now());
+
+    // Anything received from the peer shows it is alive.
+    void seen(const std::string &ip, Clock::time_point now);
+
+    // A request to the peer was answered; rtt is only given when it was not retransmitted.
+    void record_answer(const std::string &ip, Clock::time_point now,
+                       std::chrono::microseconds rtt = std::chrono::microseconds::zero());
+
+    void record_failure(const std::string &ip);
+
+    // Forgets and returns the peers whose ttl ran out by now.
+    std::vector<std::string> expire(Clock::time_point now);
+
+    std::map<std::string, PeerStats> stats() const;
+
+    // Orders peers by success rate and then round trip time, leaving out unhealthy ones unless there is nobody else.
+    std::vector<PeerEndpoint> select(std::vector<PeerEndpoint> endpoints) const;
+
+    Clock::duration ttl() const { return time_to_live; }
+
+private:
+    Clock::duration time_to_live;
+    mutable std::mutex mutex;
+    std::map<std::string, PeerStats> peers;
+    TimerWheel<std::string> expiry;
+};
@@ -0,0 +1,477 @@
+#include "Protocol.h"
+
+#include <cstring>
+
+// Bounds-checked big-endian cursor over an output buffer. Once a write does not fit, every later one is ignored
+// and size() reports 0.
+class WireWriter
+{
+public:
+    WireWriter(uint8_t *buffer, size_t capacity) : buffer(buffer), capacity(capacity) {}
+
+    void put_u8(uint8_t value) { put_uint(value, 1); }
+
+    void put_u16(uint16_t value) { put_uint(value, 2); }
+
+    void put_u32(uint32_t value) { put_uint(value, 4); }
+
+    void put_u64(uint64_t value) { put_uint(value, 8); }
+
+    void put_bytes(const void *data, size_t length)
+    {
+        if (!reserve(length))
+        {
+            return;
+        }
+        if (length > 0)
+        {
+            std::memcpy(buffer + position, data, length);
+        }
+        position += length;
+    }
+
+    // A string prefixed by its length in a single byte.
+    void put_string(const char *text, size_t max_length)
+    {
+        size_t length = strnlen(text, max_length);
+        put_u8(static_cast<uint8_t>(length));
+        put_bytes(text, length);
+    }
+
+    size_t size() const { return overflow ? 0 : position; }
+
+private:
+    bool reserve(size_t length)
+    {
+        if (overflow || length > capacity - position)
+        {
+            overflow = true;
+            return false;
+        }
+        return true;
+    }
+
+    void put_uint(uint64_t value, size_t width)
+    {
+        if (!reserve(width))
+        {
+            return;
+        }
+        for (size_t i = 0; i < width; ++i)
+        {
+            buffer[position + i] = static_cast<uint8_t>(value >> (8 * (width - 1 - i)));
+        }
+        position += width;
+    }
+
+    uint8_t *buffer;
+    size_t capacity;
+    size_t position = 0;
+    bool overflow = false;
+};
+
+// Bounds-checked big-endian cursor over a received datagram. Reads past the end yield zeros and clear ok().
+class WireReader
+{
+public:
+    WireReader(const uint8_t *buffer, size_t length) : buffer(buffer), length(length) {}
+
+    uint8_t get_u8() { return static_cast<uint8_t>(get_uint(1)); }
+
+    uint16_t get_u16() { return static_cast<uint16_t>(get_uint(2)); }
+
+    uint32_t get_u32() { return static_cast<uint32_t>(get_uint(4)); }
+
+    uint64_t get_u64() { return get_uint(8); }
+
+    const uint8_t *get_bytes(size_t count)
+    {
+        if (!valid || count > length - position)
+        {
+            valid = false;
+            return nullptr;
+        }
+        const uint8_t *bytes = buffer + position;
+        position += count;
+        return bytes;
+    }
+
+    void get_bytes(void *out, size_t count)
+    {
+        const uint8_t *bytes = get_bytes(count);
+        if (bytes != nullptr && count > 0)
+        {
+            std::memcpy(out, bytes, count);
+        }
+    }
+
+    // Reads a length-prefixed string into a NUL-terminated array of the given capacity.
+    void get_string(char *out, size_t capacity)
+    {
+        size_t string_length = get_u8();
+        const uint8_t *bytes = get_bytes(string_length);
+        if (bytes == nullptr || string_length >= capacity)
+        {
+            valid = false;
+            return;
+        }
+        std::memcpy(out, bytes, string_length);
+        out[string_length] = '\0';
+    }
+
+    bool ok() const { return valid; }
+
+    // True when the whole datagram was consumed without running past its end.
+    bool done() const { return valid && position == length; }
+
+private:
+    uint64_t get_uint(size_t width)
+    {
+        const uint8_t *bytes = get_bytes(width);
+        if (bytes == nullptr)
+        {
+            return 0;
+        }
+        uint64_t value = 0;
+        for (size_t i = 0; i < width; ++i)
+        {
+            value = (value << 8) | bytes[i];
+        }
+        return value;
+    }
+
+    const uint8_t *buffer;
+    size_t length;
+    size_t position = 0;
+    bool valid = true;
+};
+
+static void write_header(WireWriter &writer, const P2PHeader &header)
+{
+    writer.put_u16(PROTOCOL_MAGIC);
+    writer.put_u8(PROTOCOL_VERSION);
+    writer.put_u8(header.message_type);
+    writer.put_bytes(header.message_id, sizeof(header.message_id));
+    writer.put_bytes(header.sender_ip, sizeof(header.sender_ip));
+    writer.put_u16(header.sender_port);
+    writer.put_bytes(header.receiver_ip, sizeof(header.receiver_ip));
+    writer.put_u16(header.receiver_port);
+}
+
+static bool read_header(WireReader &reader, P2PHeader &header)
+{
+    if (reader.get_u16() != PROTOCOL_MAGIC || reader.get_u8() != PROTOCOL_VERSION)
+    {
+        return false;
+    }
+    header.message_type = reader.get_u8();
+    reader.get_bytes(header.message_id, sizeof(header.message_id));
+    reader.get_bytes(header.sender_ip, sizeof(header.sender_ip));
+    header.sender_port = reader.get_u16();
+    reader.get_bytes(header.receiver_ip, sizeof(header.receiver_ip));
+    header.receiver_port = reader.get_u16();
+    return reader.ok();
+}
+
+size_t serialize_header(const P2PHeader &header, uint8_t *buffer, size_t capacity)
+{
+    WireWriter writer(buffer, capacity);
+    write_header(writer, header);
+    return writer.size();
+}
+
+bool parse_header(const uint8_t *buffer, size_t length, P2PHeader &header)
+{
+    WireReader reader(buffer, length);
+    return read_header(reader, header);
+}
+
+// The fields of a request after the header, up to and including the resource name.
+static void write_request_fields(WireWriter &writer, const P2PRequestMessage &message)
+{
+    writer.put_u8(message.request_type);
+    writer.put_u32(message.transfer_id);
+    writer.put_u64(message.offset);
+    writer.put_u64(message.length);
+    writer.put_u8(message.fec_repair);
+    writer.put_u8(message.compression);
+    writer.put_string(message.resource_name, sizeof(message.resource_name) - 1);
+}
+
+static void read_request_fields(WireReader &reader, P2PRequestMessage &message)
+{
+    message.request_type = reader.get_u8();
+    message.transfer_id = reader.get_u32();
+    message.offset = reader.get_u64();
+    message.length = reader.get_u64();
+    message.fec_repair = reader.get_u8();
+    message.compression = reader.get_u8();
+    reader.get_string(message.resource_name, sizeof(message.resource_name));
+}
+
+size_t serialize(const P2PRequestMessage &message, uint8_t *buffer, size_t capacity)
+{
+    WireWriter writer(buffer, capacity);
+    write_header(writer, message.header);
+    write_request_fields(writer, message);
+    writer.put_string(message.additional_info, sizeof(message.additional_info) - 1);
+    return writer.size();
+}
+
+bool parse(const uint8_t *buffer, size_t length, P2PRequestMessage &message)
+{
+    WireReader reader(buffer, length);
+    message = {};
+    if (!read_header(reader, message.header))
+    {
+        return false;
+    }
+    read_request_fields(reader, message);
+    reader.get_string(message.additional_info, sizeof(message.additional_info));
+    return reader.done();
+}
+
+size_t serialize(const P2PRequestBatch &message, uint8_t *buffer, size_t capacity)
+{
+    if (message.request_count > MAX_BATCHED_REQUESTS)
+    {
+        return 0;
+    }
+    WireWriter writer(buffer, capacity);
+    write_header(writer, message.header);
+    writer.put_u8(message.request_count);
+    for (size_t i = 0; i < message.request_count; ++i)
+    {
+        write_request_fields(writer, message.requests[i]);
+    }
+    return writer.size();
+}
+
+bool parse(const uint8_t *buffer, size_t length, P2PRequestBatch &message)
+{
+    WireReader reader(buffer, length);
+    if (!read_header(reader, message.header))
+    {
+        return false;
+    }
+    message.request_count = reader.get_u8();
+    if (message.request_count > MAX_BATCHED_REQUESTS)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < message.request_count; ++i)
+    {
+        P2PRequestMessage &request = message.requests[i];
+        request = {};
+        request.header = message.header;
+        read_request_fields(reader, request);
+    }
+    return reader.done();
+}
+
+size_t serialize(const P2PResponseMessage &message, uint8_t *buffer, size_t capacity)
+{
+    WireWriter writer(buffer, capacity);
+    write_header(writer, message.header);
+    writer.put_u32(message.transfer_id);
+    writer.put_u8(message.status_code);
+    writer.put_u64(message.total_length);
+    writer.put_bytes(message.content_hash, sizeof(message.content_hash));
+    writer.put_string(message.resource_name, sizeof(message.resource_name) - 1);
+    writer.put_string(message.response_data, sizeof(message.response_data) - 1);
+    return writer.size();
+}
+
+bool parse(const uint8_t *buffer, size_t length, P2PResponseMessage &message)
+{
+    WireReader reader(buffer, length);
+    message = {};
+    if (!read_header(reader, message.header))
+    {
+        return false;
+    }
+    message.transfer_id = reader.get_u32();
+    message.status_code = reader.get_u8();
+    message.total_length = reader.get_u64();
+    reader.get_bytes(message.content_hash, sizeof(message.content_hash));
+    reader.get_string(message.resource_name, sizeof(message.resource_name));
+    reader.get_string(message.response_data, sizeof(message.response_data));
+    return reader.done();
+}
+
+static void write_data_prefix(WireWriter &writer, const P2PDataMessage &message)
+{
+    write_header(writer, message.header);
+    writer.put_u32(message.transfer_id);
+    writer.put_u64(message.total_length);
+    writer.put_u64(message.offset);
+    writer.put_u32(message.sequence);
+    writer.put_u64(message.timestamp);
+    writer.put_u8(message.flags);
+    writer.put_u16(message.data_length);
+}
+
+size_t serialize(const P2PDataMessage &message, uint8_t *buffer, size_t capacity)
+{
+    WireWriter writer(buffer, capacity);
+    write_data_prefix(writer, message);
+    writer.put_bytes(message.data, message.data_length);
+    return writer.size();
+}
+
+size_t serialize_prefix(const P2PDataMessage &message, uint8_t *buffer, size_t capacity)
+{
+    WireWriter writer(buffer, capacity);
+    write_data_prefix(writer, message);
+    return writer.size();
+}
+
+bool parse(const uint8_t *buffer, size_t length, P2PDataMessage &message)
+{
+    WireReader reader(buffer, length);
+    if (!read_header(reader, message.header))
+    {
+        return false;
+    }
+    message.transfer_id = reader.get_u32();
+    message.total_length = reader.get_u64();
+    message.offset = reader.get_u64();
+    message.sequence = reader.get_u32();
+    message.timestamp = reader.get_u64();
+    message.flags = reader.get_u8();
+    message.data_length = reader.get_u16();
+    if (message.data_length > MAX_CHUNK_SIZE)
+    {
+        return false;
+    }
+    message.data = reader.get_bytes(message.data_length);
+    return reader.done();
+}
+
+size_t serialize(const P2PAckMessage &message, uint8_t *buffer, size_t capacity)
+{
+    WireWriter writer(buffer, capacity);
+    write_header(writer, message.header);
+    writer.put_u32(message.transfer_id);
+    writer.put_u64(message.echo_timestamp);
+    writer.put_u32(message.ack.cumulative_ack);
+    for (uint64_t word : message.ack.sack_bitmap)
+    {
+        writer.put_u64(word);
+    }
+    return writer.size();
+}
+
+bool parse(const uint8_t *buffer, size_t length, P2PAckMessage &message)
+{
+    WireReader reader(buffer, length);
+    if (!read_header(reader, message.header))
+    {
+        return false;
+    }
+    message.transfer_id = reader.get_u32();
+    message.echo_timestamp = reader.get_u64();
+    message.ack.cumulative_ack = reader.get_u32();
+    for (uint64_t &word : message.ack.sack_bitmap)
+    {
+        word = reader.get_u64();
+    }
+    return reader.done();
+}
+
+size_t serialize(const P2PBroadcastMessage &message, uint8_t *buffer, size_t capacity)
+{
+    if (message.resource_count > MAX_ADVERT_ENTRIES)
+    {
+        return 0;
+    }
+    WireWriter writer(buffer, capacity);
+    write_header(writer, message.header);
+    writer.put_u8(message.kind);
+    writer.put_u32(message.epoch);
+    writer.put_u32(message.base_version);
+    writer.put_u32(message.version);
+    writer.put_u16(message.part);
+    writer.put_u16(message.part_count);
+    writer.put_u8(message.resource_count);
+    for (size_t i = 0; i < message.resource_count; ++i)
+    {
+        const AdvertisedResource &resource = message.resources[i];
+        writer.put_u8(resource.removed ? 1 : 0);
+        writer.put_string(resource.name, sizeof(resource.name) - 1);
+        if (!resource.removed)
+        {
+            writer.put_u64(resource.size);
+            writer.put_bytes(resource.content_hash, sizeof(resource.content_hash));
+        }
+    }
+    if (message.kind == static_cast<uint8_t>(AdvertKind::SUMMARY))
+    {
+        if (message.summary_length > MAX_SUMMARY_BYTES)
+        {
+            return 0;
+        }
+        writer.put_u32(message.filter_bits);
+        writer.put_u8(message.filter_hashes);
+        writer.put_u16(message.summary_length);
+        writer.put_bytes(message.summary, message.summary_length);
+    }
+    return writer.size();
+}
+
+bool parse(const uint8_t *buffer, size_t length, P2PBroadcastMessage &message)
+{
+    WireReader reader(buffer, length);
+    if (!read_header(reader, message.header))
+    {
+        return false;
+    }
+    message.kind = reader.get_u8();
+    message.epoch = reader.get_u32();
+    message.base_version = reader.get_u32();
+    message.version = reader.get_u32();
+    message.part = reader.get_u16();
+    message.part_count = reader.get_u16();
+    message.resource_count = reader.get_u8();
+    if (message.kind > static_cast<uint8_t>(AdvertKind::SUMMARY) || message.resource_count > MAX_ADVERT_ENTRIES ||
+        message.part >= message.part_count)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < message.resource_count; ++i)
+    {
+        AdvertisedResource &resource = message.resources[i];
+        uint8_t flags = reader.get_u8();
+        if (flags > 1)
+        {
+            return false;
+        }
+        resource.removed = flags == 1;
+        reader.get_string(resource.name, sizeof(resource.name));
+        if (resource.removed)
+        {
+            resource.size = 0;
+            std::memset(resource.content_hash, 0, sizeof(resource.content_hash));
+        }
+        else
+        {
+            resource.size = reader.get_u64();
+            reader.get_bytes(resource.content_hash, sizeof(resource.content_hash));
+        }
+    }
+    message.filter_bits = 0;
+    message.filter_hashes = 0;
+    message.summary_length = 0;
+    if (message.kind == static_cast<uint8_t>(AdvertKind::SUMMARY))
+    {
+        message.filter_bits = reader.get_u32();
+        message.filter_hashes = reader.get_u8();
+        message.summary_length = reader.get_u16();
+        if (message.summary_length > MAX_SUMMARY_BYTES)
+        {
+            return false;
+        }
+        reader.get_bytes(message.summary, message.summary_length);
+    }
+    return reader.done();
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+
+// Every datagram starts with the magic and the protocol version; peers drop anything they do not understand.
+// All integers are big-endian and fields are packed back to back without padding.
+constexpr uint16_t PROTOCOL_MAGIC = 0x5032;
+constexpr uint8_t PROTOCOL_VERSION = 9;
+
+// Payload carried by a single data datagram, small enough to keep the datagram below a 1500 byte Ethernet MTU.
+constexpr size_t MAX_CHUNK_SIZE = 1380;
+// Number of chunks after the cumulative acknowledgement that one selective ACK can describe.
+constexpr uint32_t SACK_WINDOW_CHUNKS = 256;
+// SHA-256 digests identify resource contents and chunks.
+constexpr size_t CONTENT_HASH_SIZE = 32;
+
+enum class MessageType {
+    REQUEST,
+    DATA,
+    BROADCAST,
+    ACK,
+    RESPONSE,
+    // Several requests in one datagram, see P2PRequestBatch.
+    REQUEST_BATCH,
+};
+
+enum class RequestType : uint8_t {
+    // Asks whether the peer has the resource and how large it is; answered by a RESPONSE.
+    INFO,
+    // Asks the peer to send a chunk-aligned range of the resource as DATA.
+    RANGE,
+    // Like RANGE, but for the list of per-chunk digests of the resource, CONTENT_HASH_SIZE bytes per chunk.
+    HASHES,
+    // Asks the peer for a snapshot or summary of its whole catalog, sent back as BROADCAST messages to the requester
+    // alone.
+    CATALOG,
+};
+
+enum class AdvertKind : uint8_t {
+    // The whole catalog as of version.
+    SNAPSHOT,
+    // Only the resources added or removed between base_version and version.
+    DELTA,
+    // A BloomFilter of the names in the catalog as of version, standing in for a snapshot of a large catalog.
+    SUMMARY,
+};
+
+enum class ResponseStatus : uint8_t {
+    OK,
+    NOT_FOUND,
+    BAD_RANGE,
+};
+
+struct P2PHeader {
+    uint8_t message_type;
+    char message_id[32];
+    uint8_t sender_ip[4];
+    uint16_t sender_port;
+    uint8_t receiver_ip[4];
+    uint16_t receiver_port;
+};
+
+struct AdvertisedResource
+{
+    // Removed entries carry just the name.
+    bool removed;
+    char name[64];
+    uint64_t size;
+    uint8_t content_hash[CONTENT_HASH_SIZE];
+};
+
+// Entries in one advertisement datagram; fewer if long names do not leave room for this many.
+constexpr size_t MAX_ADVERT_ENTRIES = 32;
+// Datagrams a single catalog may span, which bounds what a receiver holds on to while reassembling one.
+constexpr uint16_t MAX_ADVERT_PARTS = 1024;
+// Filter bytes in one summary datagram; part i carries the bytes from i * MAX_SUMMARY_BYTES on.
+constexpr size_t MAX_SUMMARY_BYTES = 1024;
+
+// Each peer numbers the versions of its catalog, starting over under a new random epoch whenever it restarts. An
+// advertisement spans part_count datagrams sharing kind, epoch and version, each listing some of its entries; a
+// receiver only takes it once it has every part.
+struct P2PBroadcastMessage
+{
+    P2PHeader header;
+    uint8_t kind;
+    uint32_t epoch;
+    uint32_t base_version;
+    uint32_t version;
+    uint16_t part;
+    uint16_t part_count;
+    uint8_t resource_count;
+    AdvertisedResource resources[MAX_ADVERT_ENTRIES];
+    // Only in summaries, which carry no resources.
+    uint32_t filter_bits;
+    uint8_t filter_hashes;
+    uint16_t summary_length;
+    uint8_t summary[MAX_SUMMARY_BYTES];
+};
+
+// The requester picks the transfer id; DATA, ACK and RESPONSE messages for the request carry it back. A RANGE
+// request starts at a multiple of MAX_CHUNK_SIZE and a length of 0 reaches to the end of the resource. RANGE and
+// HASHES requests may ask for fec_repair repair symbols after every FEC_BLOCK_CHUNKS chunks, see ReedSolomon.h, and
+// RANGE requests for chunks compressed with a Compression codec, see Compression.h.
+struct P2PRequestMessage
+{
+    P2PHeader header;
+    uint8_t request_type;
+    uint32_t transfer_id;
+    uint64_t offset;
+    uint64_t length;
+    uint8_t fec_repair;
+    uint8_t compression;
+    char resource_name[64];
+    char additional_info[128];
+};
+
+// Requests in one batch datagram; fewer if long names do not leave room for this many.
+constexpr size_t MAX_BATCHED_REQUESTS = 32;
+
+// Requests to one peer that went out at the same time, for many resources or many ranges of one, share a datagram
+// instead of costing one each; the peer serves every one of them as if it had come on its own, and answers each
+// separately. Only the batch's header goes on the wire, the requests' own headers and additional_info are left out.
+struct P2PRequestBatch
+{
+    P2PHeader header;
+    uint8_t request_count;
+    P2PRequestMessage requests[MAX_BATCHED_REQUESTS];
+};
+
+struct P2PResponseMessage
+{
+    P2PHeader header;
+    uint32_t transfer_id;
+    uint8_t status_code;
+    uint64_t total_length;
+    // Merkle root of the resource, see ChunkHashes.
+    uint8_t content_hash[CONTENT_HASH_SIZE];
+    char resource_name[64];
+    char response_data[128];
+};
+
+// Set on DATA that carries repair symbol number offset of the FEC block starting at chunk sequence instead of a chunk.
+constexpr uint8_t DATA_FLAG_REPAIR = 0x01;
+// Set on DATA whose chunk has been compressed with the codec the request asked for; data_length is then the
+// compressed length. Repair symbols are computed over and rebuild the chunks as they are, never compressed.
+constexpr uint8_t DATA_FLAG_COMPRESSED = 0x02;
+
+// The payload is not copied by the codec: when serializing it is read from wherever data points to, when
+// parsing data points into the received datagram.
+struct P2PDataMessage
+{
+    P2PHeader header;
+    uint32_t transfer_id;
+    uint64_t total_length;
+    uint64_t offset;
+    uint32_t sequence;
+    uint64_t timestamp;
+    uint8_t flags;
+    uint16_t data_length;
+    const u_char *data;
+};
+
+struct SelectiveAck
+{
+    // Every chunk with a sequence number below this one has been received.
+    uint32_t cumulative_ack = 0;
+    // Bit i is set when chunk cumulative_ack + 1 + i has been received.
+    uint64_t sack_bitmap[SACK_WINDOW_CHUNKS / 64] = {};
+};
+
+struct P2PAckMessage
+{
+    P2PHeader header;
+    uint32_t transfer_id;
+    uint64_t echo_timestamp;
+    SelectiveAck ack;
+};
+
+constexpr size_t HEADER_WIRE_SIZE = 2 + 1 + 1 + 32 + 4 + 2 + 4 + 2;
+constexpr size_t DATA_FIELDS_WIRE_SIZE = 4 + 8 + 8 + 4 + 8 + 1 + 2;
+constexpr size_t ACK_WIRE_SIZE = HEADER_WIRE_SIZE + 4 + 8 + 4 + sizeof(SelectiveAck::sack_bitmap);
+constexpr size_t ADVERT_FIELDS_WIRE_SIZE = 1 + 4 + 4 + 4 + 2 + 2 + 1;
+// An advertised resource takes this plus the length of its name, a removed one only REMOVED_ENTRY_WIRE_SIZE.
+constexpr size_t ADVERT_ENTRY_WIRE_SIZE = 1 + 1 + 8 + CONTENT_HASH_SIZE;
+constexpr size_t REMOVED_ENTRY_WIRE_SIZE = 1 + 1;
+constexpr size_t SUMMARY_FIELDS_WIRE_SIZE = 4 + 1 + 2;
+constexpr size_t BATCH_FIELDS_WIRE_SIZE = 1;
+// A batched request takes this plus the length of its resource name.
+constexpr size_t BATCHED_REQUEST_WIRE_SIZE = 1 + 4 + 8 + 8 + 1 + 1 + 1;
+constexpr size_t MAX_DATAGRAM_SIZE = HEADER_WIRE_SIZE + DATA_FIELDS_WIRE_SIZE + MAX_CHUNK_SIZE;
+// 1500 byte MTU minus the IPv4 and UDP headers.
+static_assert(MAX_DATAGRAM_SIZE <= 1472);
+static_assert(HEADER_WIRE_SIZE + ADVERT_FIELDS_WIRE_SIZE + SUMMARY_FIELDS_WIRE_SIZE + MAX_SUMMARY_BYTES <=
+              MAX_DATAGRAM_SIZE);
+
+// Each serialize function writes one complete datagram and returns its length, or 0 if it does not fit into
+// capacity. Each parse function validates the datagram length against the encoded size and returns false for
+// anything malformed.
+size_t serialize_header(const P2PHeader &header, uint8_t *buffer, size_t capacity);
+
+// Reads just the fixed-size header, so a datagram can be dispatched before any message body is decoded.
+bool parse_header(const uint8_t *buffer, size_t length, P2PHeader &header);
+
+size_t serialize(const P2PRequestMessage &message, uint8_t *buffer, size_t capacity);
+
+bool parse(const uint8_t *buffer, size_t length, P2PRequestMessage &message);
+
+size_t serialize(const P2PRequestBatch &message, uint8_t *buffer, size_t capacity);
+
+// Every request of the batch gets the batch's header.
+bool parse(const uint8_t *buffer, size_t length, P2PRequestBatch &message);
+
+size_t serialize(const P2PResponseMessage &message, uint8_t *buffer, size_t capacity);
+
+bool parse(const uint8_t *buffer, size_t length, P2PResponseMessage &message);
+
+size_t serialize(const P2PDataMessage &message, uint8_t *buffer, size_t capacity);
+
+// Writes everything up to, but not including, the payload, for scatter-gather sends.
+size_t serialize_prefix(const P2PDataMessage &message, uint8_t *buffer, size_t capacity);
+
+bool parse(const uint8_t *buffer, size_t length, P2PDataMessage &message);
+
+size_t serialize(const P2PAckMessage &message, uint8_t *buffer, size_t capacity);
+
+bool parse(const uint8_t *buffer, size_t length, P2PAckMessage &message);
+
+size_t serialize(const P2PBroadcastMessage &message, uint8_t *buffer, size_t capacity);
+
+bool parse(const uint8_t *buffer, size_t length, P2PBroadcastMessage &message);
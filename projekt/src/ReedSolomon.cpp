@@ -0,0 +1,262 @@
+#include "ReedSolomon.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// x^8 + x^4 + x^3 + x^2 + 1, the usual Reed-Solomon field polynomial.
+static constexpr unsigned FIELD_POLYNOMIAL = 0x11d;
+
+struct FieldTables
+{
+    std::array<uint8_t, 512> exp{};
+    std::array<uint8_t, 256> log{};
+    // Full product table, 64 KiB, for the scalar kernel and the nibble tables of the vector ones.
+    std::array<std::array<uint8_t, 256>, 256> multiply{};
+
+    FieldTables()
+    {
+        unsigned value = 1;
+        for (unsigned i = 0; i < 255; ++i)
+        {
+            exp[i] = exp[i + 255] = static_cast<uint8_t>(value);
+            log[value] = static_cast<uint8_t>(i);
+            value <<= 1;
+            if (value & 0x100)
+            {
+                value ^= FIELD_POLYNOMIAL;
+            }
+        }
+        for (unsigned a = 1; a < 256; ++a)
+        {
+            for (unsigned b = 1; b < 256; ++b)
+            {
+                multiply[a][b] = exp[log[a] + log[b]];
+            }
+        }
+    }
+};
+
+static const FieldTables tables;
+
+static uint8_t gf_multiply(uint8_t a, uint8_t b)
+{
+    return tables.multiply[a][b];
+}
+
+static uint8_t gf_inverse(uint8_t a)
+{
+    return tables.exp[255 - tables.log[a]];
+}
+
+// Row repair, column source of the Cauchy matrix, 1 / (x_repair + y_source) with the x and y all distinct.
+static uint8_t coefficient(size_t repair, size_t source)
+{
+    return gf_inverse(static_cast<uint8_t>((FEC_BLOCK_CHUNKS + repair) ^ source));
+}
+
+static void multiply_add_scalar(uint8_t *destination, const uint8_t *source, uint8_t coefficient, size_t length)
+{
+    const std::array<uint8_t, 256> &row = tables.multiply[coefficient];
+    for (size_t i = 0; i < length; ++i)
+    {
+        destination[i] ^= row[source[i]];
+    }
+}
+
+#if defined(__x86_64__)
+// A product splits into the products with the low and the high nibble, each looked up in a 16 entry table with one
+// byte shuffle.
+
+__attribute__((target("ssse3"))) static void multiply_add_ssse3(uint8_t *destination, const uint8_t *source,
+                                                                uint8_t coefficient, size_t length)
+{
+    const std::array<uint8_t, 256> &row = tables.multiply[coefficient];
+    alignas(16) uint8_t low[16];
+    alignas(16) uint8_t high[16];
+    for (unsigned i = 0; i < 16; ++i)
+    {
+        low[i] = row[i];
+        high[i] = row[i << 4];
+    }
+    __m128i low_table = _mm_load_si128(reinterpret_cast<const __m128i *>(low));
+    __m128i high_table = _mm_load_si128(reinterpret_cast<const __m128i *>(high));
+    __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low_table, _mm_and_si128(input, mask)),
+                                        _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi64(input, 4), mask)));
+        __m128i output = _mm_loadu_si128(reinterpret_cast<const __m128i *>(destination + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(destination + i), _mm_xor_si128(output, product));
+    }
+    multiply_add_scalar(destination + i, source + i, coefficient, length - i);
+}
+
+__attribute__((target("avx2"))) static void multiply_add_avx2(uint8_t *destination, const uint8_t *source,
+                                                              uint8_t coefficient, size_t length)
+{
+    const std::array<uint8_t, 256> &row = tables.multiply[coefficient];
+    alignas(16) uint8_t low[16];
+    alignas(16) uint8_t high[16];
+    for (unsigned i = 0; i < 16; ++i)
+    {
+        low[i] = row[i];
+        high[i] = row[i << 4];
+    }
+    __m256i low_table = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(low)));
+    __m256i high_table = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(high)));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(source + i));
+        __m256i product =
+            _mm256_xor_si256(_mm256_shuffle_epi8(low_table, _mm256_and_si256(input, mask)),
+                             _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi64(input, 4), mask)));
+        __m256i output = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(destination + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(destination + i), _mm256_xor_si256(output, product));
+    }
+    multiply_add_scalar(destination + i, source + i, coefficient, length - i);
+}
+#endif
+
+using MultiplyAdd = void (*)(uint8_t *, const uint8_t *, uint8_t, size_t);
+
+static MultiplyAdd select_kernel()
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return multiply_add_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        return multiply_add_ssse3;
+    }
+#endif
+    return multiply_add_scalar;
+}
+
+static const MultiplyAdd multiply_add_kernel = select_kernel();
+
+void gf_multiply_add(uint8_t *destination, const uint8_t *source, uint8_t coefficient, size_t length)
+{
+    if (coefficient == 0)
+    {
+        return;
+    }
+    if (coefficient == 1)
+    {
+        for (size_t i = 0; i < length; ++i)
+        {
+            destination[i] ^= source[i];
+        }
+        return;
+    }
+    multiply_add_kernel(destination, source, coefficient, length);
+}
+
+void encode_repair_symbol(const std::vector<std::pair<const uint8_t *, size_t>> &sources, size_t repair,
+                          uint8_t *symbol, size_t symbol_length)
+{
+    std::memset(symbol, 0, symbol_length);
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        gf_multiply_add(symbol, sources[i].first, coefficient(repair, i), std::min(sources[i].second, symbol_length));
+    }
+}
+
+bool decode_block(const std::vector<const uint8_t *> &sources,
+                  const std::vector<std::pair<size_t, const uint8_t *>> &repairs, size_t symbol_length,
+                  std::vector<std::vector<uint8_t>> &recovered)
+{
+    std::vector<size_t> missing;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        if (!sources[i])
+        {
+            missing.push_back(i);
+        }
+    }
+    size_t count = missing.size();
+    if (repairs.size() < count)
+    {
+        return false;
+    }
+
+    // What each repair symbol owes to the missing sources alone, with the known ones taken out.
+    std::vector<std::vector<uint8_t>> remainders(count);
+    for (size_t row = 0; row < count; ++row)
+    {
+        remainders[row].assign(repairs[row].second, repairs[row].second + symbol_length);
+        for (size_t i = 0; i < sources.size(); ++i)
+        {
+            if (sources[i])
+            {
+                gf_multiply_add(remainders[row].data(), sources[i], coefficient(repairs[row].first, i), symbol_length);
+            }
+        }
+    }
+
+    // Invert the square Cauchy submatrix of the repair rows used and the missing columns by Gauss-Jordan
+    // elimination; no pivot can be zero, but swapping keeps this correct regardless.
+    std::vector<std::vector<uint8_t>> matrix(count, std::vector<uint8_t>(count));
+    std::vector<std::vector<uint8_t>> inverse(count, std::vector<uint8_t>(count));
+    for (size_t row = 0; row < count; ++row)
+    {
+        for (size_t column = 0; column < count; ++column)
+        {
+            matrix[row][column] = coefficient(repairs[row].first, missing[column]);
+        }
+        inverse[row][row] = 1;
+    }
+    for (size_t column = 0; column < count; ++column)
+    {
+        size_t pivot = column;
+        while (pivot < count && matrix[pivot][column] == 0)
+        {
+            ++pivot;
+        }
+        if (pivot == count)
+        {
+            return false;
+        }
+        std::swap(matrix[pivot], matrix[column]);
+        std::swap(inverse[pivot], inverse[column]);
+        uint8_t scale = gf_inverse(matrix[column][column]);
+        for (size_t k = 0; k < count; ++k)
+        {
+            matrix[column][k] = gf_multiply(matrix[column][k], scale);
+            inverse[column][k] = gf_multiply(inverse[column][k], scale);
+        }
+        for (size_t row = 0; row < count; ++row)
+        {
+            uint8_t factor = matrix[row][column];
+            if (row == column || factor == 0)
+            {
+                continue;
+            }
+            for (size_t k = 0; k < count; ++k)
+            {
+                matrix[row][k] ^= gf_multiply(matrix[column][k], factor);
+                inverse[row][k] ^= gf_multiply(inverse[column][k], factor);
+            }
+        }
+    }
+
+    recovered.assign(count, std::vector<uint8_t>(symbol_length));
+    for (size_t l = 0; l < count; ++l)
+    {
+        for (size_t row = 0; row < count; ++row)
+        {
+            gf_multiply_add(recovered[l].data(), remainders[row].data(), inverse[l][row], symbol_length);
+        }
+    }
+    return true;
+}
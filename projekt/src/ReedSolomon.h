@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Chunks of a range are protected in blocks of this many, the last block of a range possibly being shorter.
+constexpr size_t FEC_BLOCK_CHUNKS = 16;
+// Most repair symbols a block can have.
+constexpr size_t MAX_FEC_REPAIR_SYMBOLS = 64;
+
+static_assert(FEC_BLOCK_CHUNKS + MAX_FEC_REPAIR_SYMBOLS <= 256, "Cauchy matrix must fit GF(2^8)");
+
+// Systematic Reed-Solomon erasure code over GF(2^8) with a Cauchy generator matrix: a block's source symbols are
+// sent as they are, followed by repair symbols that are each a different linear combination of all of them. Any
+// source_count of the source and repair symbols rebuild the rest, every square submatrix of a Cauchy matrix being
+// invertible. Symbols shorter than the block's symbol length count as padded with zeros.
+
+// destination ^= coefficient * source, byte by byte in GF(2^8). Uses PSHUFB nibble lookups where the CPU has them.
+void gf_multiply_add(uint8_t *destination, const uint8_t *source, uint8_t coefficient, size_t length);
+
+// Computes repair symbol `repair` of a block from its source symbols, given as data and length.
+void encode_repair_symbol(const std::vector<std::pair<const uint8_t *, size_t>> &sources, size_t repair,
+                          uint8_t *symbol, size_t symbol_length);
+
+// Rebuilds the missing source symbols of a block. sources holds every source symbol, padded to symbol_length, with
+// the missing ones null; repairs holds repair symbols as index and data. The missing symbols are returned in order.
+// Returns false if there are fewer repair symbols than missing source symbols.
+bool decode_block(const std::vector<const uint8_t *> &sources,
+                  const std::vector<std::pair<size_t, const uint8_t *>> &repairs, size_t symbol_length,
+                  std::vector<std::vector<uint8_t>> &recovered);
@@ -1,15 +1,50 @@
-#pragma once
-
-#include <chrono>
-#include <string>
-#include <vector>
-
-struct Resource {
-    Resource() = default;
-    Resource(std::string name, std::vector<u_char> data) : name(name), data(data) {};
-
-    std::string name;
-    std::vector<u_char> data;
-    size_t size = 0;
-    std::chrono::time_point<std::chrono::system_clock> time_of_addition = std::chrono::system_clock::now();
-};
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "BloomFilter.h"
+#include "ContentHash.h"
+#include "ResourceData.h"
+
+struct Resource {
+    Resource() = default;
+    Resource(std::string name, std::shared_ptr<const ResourceData> data, std::shared_ptr<const ChunkHashes> hashes) :
+        name(name), data(data), hashes(hashes), size(data ? data->size() : 0) {};
+
+    std::string name;
+    std::shared_ptr<const ResourceData> data;
+    std::shared_ptr<const ChunkHashes> hashes;
+    size_t size = 0;
+    std::chrono::time_point<std::chrono::system_clock> time_of_addition = std::chrono::system_clock::now();
+};
+
+// A resource as another peer advertises it.
+struct RemoteResource
+{
+    std::string name;
+    uint64_t size = 0;
+    Digest content_hash{};
+};
+
+// The resources of one peer by name.
+using RemoteCatalog = std::map<std::string, RemoteResource>;
+
+// What we know of the catalog of another peer.
+struct RemotePeer
+{
+    // The whole catalog, unless the peer only sent a summary; then just what its deltas told us about since.
+    RemoteCatalog resources;
+    // Set while the catalog is known from a summary.
+    std::optional<BloomFilter> summary;
+};
+
+// A resource added to, or replaced or removed in, a catalog. Removals only carry the name.
+struct CatalogChange
+{
+    RemoteResource resource;
+    bool removed = false;
+};
@@ -0,0 +1,54 @@
+#include "ResourceData.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ios>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "exceptions/FileNotFoundException.h"
+
+std::shared_ptr<MappedResourceData> MappedResourceData::map_file(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw FileNotFoundException();
+    }
+
+    struct stat file_stat = {};
+    if (fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode))
+    {
+        close(fd);
+        throw std::ios_base::failure(path + " is not a regular file");
+    }
+
+    size_t length = static_cast<size_t>(file_stat.st_size);
+    void *mapping = nullptr;
+    if (length > 0)
+    {
+        mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            int error = errno;
+            close(fd);
+            throw std::ios_base::failure("Failed to map " + path + ": " + strerror(error));
+        }
+        // Chunks are served front to back, let the kernel read ahead.
+        madvise(mapping, length, MADV_SEQUENTIAL);
+    }
+    // The mapping keeps the file contents reachable on its own.
+    close(fd);
+
+    return std::shared_ptr<MappedResourceData>(new MappedResourceData(static_cast<const u_char *>(mapping), length));
+}
+
+MappedResourceData::~MappedResourceData()
+{
+    if (mapping != nullptr)
+    {
+        munmap(const_cast<u_char *>(mapping), length);
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+#include "Protocol.h"
+
+// Read-only bytes of a resource, accessed chunk by chunk: the chunks need not be contiguous. Shared between the
+// resource table and any transfer still reading from it.
+class ResourceData
+{
+public:
+    virtual ~ResourceData() = default;
+
+    // Chunk index covers bytes [index * MAX_CHUNK_SIZE, index * MAX_CHUNK_SIZE + MAX_CHUNK_SIZE) of the resource,
+    // the last chunk being shorter.
+    virtual const u_char *chunk(uint64_t index) const = 0;
+
+    virtual size_t size() const = 0;
+};
+
+// A read-only private mapping of a file, so the page cache is the only copy of its contents. Registering a file
+// costs nothing beyond setting up the mapping; pages are faulted in as chunks are read.
+class MappedResourceData : public ResourceData
+{
+public:
+    // Throws FileNotFoundException if the file cannot be opened and std::ios_base::failure if it is not a
+    // regular file or cannot be mapped.
+    static std::shared_ptr<MappedResourceData> map_file(const std::string &path);
+
+    ~MappedResourceData() override;
+
+    MappedResourceData(const MappedResourceData &) = delete;
+
+    MappedResourceData &operator=(const MappedResourceData &) = delete;
+
+    const u_char *bytes() const { return mapping; }
+
+    const u_char *chunk(uint64_t index) const override { return mapping + index * MAX_CHUNK_SIZE; }
+
+    size_t size() const override { return length; }
+
+private:
+    MappedResourceData(const u_char *mapping, size_t length) : mapping(mapping), length(length) {}
+
+    const u_char *mapping;
+    size_t length;
+};
@@ -1,55 +1,102 @@
-#include <fstream>
-
 #include "ResourceManager.h"
+
 #include "exceptions/FileNotFoundException.h"
 
+#include <algorithm>
 #include <iostream>
+#include <set>
 
 ResourceManager::ResourceManager() {}
 
-void ResourceManager::add_local_resource(const std::string &name, const std::string &path, bool replace)
+static RemoteResource advertised(const Resource &resource)
 {
-    if (local_resources.find(name) != local_resources.end() && !replace)
+    RemoteResource entry;
+    entry.name = resource.name;
+    entry.size = resource.size;
+    if (resource.hashes)
     {
-        throw std::invalid_argument("Resource with name " + name + " already exists.");
+        entry.content_hash = resource.hashes->root();
     }
-    std::ifstream file(path, std::ios::binary);
-    if (!file.is_open())
-    {
-        throw FileNotFoundException();
-    }
-    std::vector<u_char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-    Resource resource = Resource(name, data);
-    resource.size = data.size();
-    local_resources[name] = resource;
-    file.close();
+    return entry;
 }
 
+void ResourceManager::add_local_resource(const std::string &name, const std::string &path, bool replace)
+{
+    if (!replace && has_resource(name))
+    {
+        throw std::invalid_argument("Resource with name " + name + " already exists.");
+    }
+    // Mapped and hashed outside the lock, the table is only held for the insertion itself.
+    std::shared_ptr<const MappedResourceData> file = MappedResourceData::map_file(path);
+    std::shared_ptr<const ChunkHashes> hashes = ChunkHashes::compute(file->bytes(), file->size());
+    Resource resource(name, chunk_store->add(file, hashes), hashes);
 
-void ResourceManager::add_received_resource(const std::string &name, const std::vector<u_char> &data, bool replace) {
-    if (local_resources.find(name) != local_resources.end() && !replace)
+    std::unique_lock lock(local_mutex);
+    if (!replace && local_resources.contains(name))
     {
         throw std::invalid_argument("Resource with name " + name + " already exists.");
     }
+    bool existed = local_resources.contains(name);
+    // A replaced resource ends up in `resource` and returns its chunks to the store once the table is unlocked.
+    std::swap(local_resources[name], resource);
+    record_change(name, existed);
+}
 
-    Resource resource = Resource(name, data);
-    resource.size = data.size();
-    local_resources[name] = resource;
+void ResourceManager::add_received_resource(const std::string &name, const std::string &path,
+                                            std::shared_ptr<const ChunkHashes> hashes)
+{
+    Resource resource(name, chunk_store->add(MappedResourceData::map_file(path), hashes), hashes);
+
+    std::unique_lock lock(local_mutex);
+    bool existed = local_resources.contains(name);
+    std::swap(local_resources[name], resource);
+    record_change(name, existed);
 }
 
 
 void ResourceManager::remove_resource(const std::string &name)
 {
-    if (local_resources.find(name) == local_resources.end())
+    // Handing the chunks back to the store walks the whole resource; that happens after the table is unlocked.
+    Resource removed;
+    std::unique_lock lock(local_mutex);
+    auto it = local_resources.find(name);
+    if (it == local_resources.end())
     {
         throw std::invalid_argument("Resource with name " + name + " does not exist.");
     }
-    local_resources.erase(name);
+    removed = std::move(it->second);
+    local_resources.erase(it);
+    record_change(name, true);
+}
+
+void ResourceManager::record_change(const std::string &name, bool existed)
+{
+    catalog_changes.emplace_back(++catalog_version, name);
+    if (catalog_changes.size() > MAX_CATALOG_HISTORY)
+    {
+        catalog_changes.pop_front();
+    }
+
+    bool exists = local_resources.contains(name);
+    if (exists != existed)
+    {
+        std::unique_lock index_lock(index_mutex);
+        if (exists)
+        {
+            name_index.add(name);
+        }
+        else
+        {
+            name_index.remove(name);
+        }
+    }
 }
 
 const std::vector<std::string> ResourceManager::get_resource_names() const
 {
+    std::shared_lock lock(local_mutex);
     std::vector<std::string> names;
+    names.reserve(local_resources.size());
     for (const auto &resource : local_resources)
     {
         names.push_back(resource.first);
@@ -59,11 +106,19 @@ const std::vector<std::string> ResourceManager::get_resource_names() const
 
 bool ResourceManager::has_resource(const std::string &name) const
 {
+    std::shared_lock lock(local_mutex);
     return local_resources.contains(name);
 }
 
-const std::vector<u_char> &ResourceManager::get_resource_data(const std::string &resource_name) const
+std::map<std::string, Resource> ResourceManager::get_local_resources() const
 {
+    std::shared_lock lock(local_mutex);
+    return local_resources;
+}
+
+std::shared_ptr<const ResourceData> ResourceManager::get_resource_data(const std::string &resource_name) const
+{
+    std::shared_lock lock(local_mutex);
     auto it = local_resources.find(resource_name);
     if (it == local_resources.end())
     {
@@ -72,7 +127,213 @@ const std::vector<u_char> &ResourceManager::get_resource_data(const std::string
     return it->second.data;
 }
 
-void ResourceManager::add_remote_resource(const std::string &ip, const std::vector<std::string> &resources)
+Resource ResourceManager::get_resource(const std::string &resource_name) const
+{
+    std::shared_lock lock(local_mutex);
+    auto it = local_resources.find(resource_name);
+    if (it == local_resources.end())
+    {
+        throw std::invalid_argument("Resource with name " + resource_name + " does not exist.");
+    }
+    return it->second;
+}
+
+uint32_t ResourceManager::get_catalog_version() const
+{
+    std::shared_lock lock(local_mutex);
+    return catalog_version;
+}
+
+uint32_t ResourceManager::get_catalog(std::vector<RemoteResource> &catalog) const
 {
-    remote_resources[ip] = resources;
-}
\ No newline at end of file
+    std::shared_lock lock(local_mutex);
+    catalog.clear();
+    catalog.reserve(local_resources.size());
+    for (const auto &[name, resource] : local_resources)
+    {
+        catalog.push_back(advertised(resource));
+    }
+    return catalog_version;
+}
+
+bool ResourceManager::get_catalog_changes(uint32_t since, std::vector<CatalogChange> &changes,
+                                          uint32_t &version) const
+{
+    std::shared_lock lock(local_mutex);
+    version = catalog_version;
+    changes.clear();
+    if (since == catalog_version)
+    {
+        return true;
+    }
+    // The change that produced version since + 1 has to be among the remembered ones.
+    if (since > catalog_version || catalog_changes.empty() || catalog_changes.front().first > since + 1)
+    {
+        return false;
+    }
+
+    // A resource changed several times is described once, as it is now.
+    std::set<std::string> names;
+    for (auto it = catalog_changes.rbegin(); it != catalog_changes.rend() && it->first > since; ++it)
+    {
+        names.insert(it->second);
+    }
+    for (const auto &name : names)
+    {
+        CatalogChange &change = changes.emplace_back();
+        auto it = local_resources.find(name);
+        if (it == local_resources.end())
+        {
+            change.resource.name = name;
+            change.removed = true;
+        }
+        else
+        {
+            change.resource = advertised(it->second);
+        }
+    }
+    return true;
+}
+
+void ResourceManager::add_remote_resource(const std::string &ip, const std::vector<RemoteResource> &resources)
+{
+    RemoteCatalog catalog;
+    for (const auto &resource : resources)
+    {
+        catalog[resource.name] = resource;
+    }
+    std::unique_lock lock(remote_mutex);
+    RemotePeer &peer = remote_resources[ip];
+    {
+        std::unique_lock index_lock(index_mutex);
+        for (const auto &[name, resource] : catalog)
+        {
+            name_index.add(name);
+        }
+        for (const auto &[name, resource] : peer.resources)
+        {
+            name_index.remove(name);
+        }
+    }
+    peer.resources = std::move(catalog);
+    peer.summary.reset();
+}
+
+void ResourceManager::add_remote_summary(const std::string &ip, BloomFilter summary)
+{
+    std::unique_lock lock(remote_mutex);
+    RemotePeer &peer = remote_resources[ip];
+    {
+        std::unique_lock index_lock(index_mutex);
+        for (const auto &[name, resource] : peer.resources)
+        {
+            name_index.remove(name);
+        }
+    }
+    peer.resources.clear();
+    peer.summary = std::move(summary);
+}
+
+void ResourceManager::apply_remote_changes(const std::string &ip, const std::vector<CatalogChange> &changes)
+{
+    std::unique_lock lock(remote_mutex);
+    std::unique_lock index_lock(index_mutex);
+    RemotePeer &peer = remote_resources[ip];
+    for (const auto &change : changes)
+    {
+        if (change.removed)
+        {
+            // A summary cannot forget a name; a download finds out from the peer itself.
+            if (peer.resources.erase(change.resource.name) > 0)
+            {
+                name_index.remove(change.resource.name);
+            }
+        }
+        else
+        {
+            auto [it, inserted] = peer.resources.insert_or_assign(change.resource.name, change.resource);
+            if (inserted)
+            {
+                name_index.add(change.resource.name);
+            }
+            if (peer.summary)
+            {
+                peer.summary->insert(change.resource.name);
+            }
+        }
+    }
+}
+
+void ResourceManager::remove_remote_peer(const std::string &ip)
+{
+    std::unique_lock lock(remote_mutex);
+    auto peer = remote_resources.find(ip);
+    if (peer == remote_resources.end())
+    {
+        return;
+    }
+    {
+        std::unique_lock index_lock(index_mutex);
+        for (const auto &[name, resource] : peer->second.resources)
+        {
+            name_index.remove(name);
+        }
+    }
+    remote_resources.erase(peer);
+}
+
+std::map<std::string, RemotePeer> ResourceManager::get_remote_resources() const
+{
+    std::shared_lock lock(remote_mutex);
+    return remote_resources;
+}
+
+std::vector<std::string> ResourceManager::get_peers_with_resource(const std::string &resource_name) const
+{
+    // Hashed once, probing each summary then costs BLOOM_HASH_COUNT bit tests.
+    BloomFilter::Key key = BloomFilter::key(resource_name);
+    std::shared_lock lock(remote_mutex);
+    std::vector<std::string> peers;
+    for (const auto &[ip, peer] : remote_resources)
+    {
+        if (peer.resources.contains(resource_name) || (peer.summary && peer.summary->may_contain(key)))
+        {
+            peers.push_back(ip);
+        }
+    }
+    return peers;
+}
+
+std::vector<SearchResult> ResourceManager::search(SearchMode mode, const std::string &pattern, size_t limit) const
+{
+    std::vector<std::string> names;
+    {
+        std::shared_lock index_lock(index_mutex);
+        names = name_index.search(mode, pattern, limit);
+    }
+
+    std::vector<SearchResult> results(names.size());
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        results[i].name = std::move(names[i]);
+    }
+    {
+        std::shared_lock lock(local_mutex);
+        for (auto &result : results)
+        {
+            result.local = local_resources.contains(result.name);
+        }
+    }
+    std::shared_lock lock(remote_mutex);
+    for (const auto &[ip, peer] : remote_resources)
+    {
+        for (auto &result : results)
+        {
+            if (peer.resources.contains(result.name))
+            {
+                result.peers.push_back(ip);
+            }
+        }
+    }
+    return results;
+}
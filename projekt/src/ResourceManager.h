@@ -1,10 +1,29 @@
 #pragma once
 
+#include <deque>
 #include <map>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <vector>
 
+#include "ChunkStore.h"
+#include "NameIndex.h"
 #include "Resource.h"
 
+struct SearchResult
+{
+    std::string name;
+    bool local = false;
+    // Peers whose catalog lists the resource; those known only from a summary are not searched.
+    std::vector<std::string> peers;
+};
+
+// Local catalog changes remembered for delta advertisements; peers further behind than this get a snapshot.
+constexpr size_t MAX_CATALOG_HISTORY = 4096;
+
+// Safe for concurrent use. Lookups take a shared lock only, so serving threads never wait on each other; data
+// handed out by get_resource_data stays valid even if the resource is removed concurrently.
 class ResourceManager
 {
 public:
@@ -12,7 +31,10 @@ public:
 
     void add_local_resource(const std::string &name, const std::string &path, bool replace = false);
 
-    void add_received_resource(const std::string &name, const std::vector<u_char> &data, bool replace = false);
+    // Registers a downloaded file under hashes that were already verified chunk by chunk, replacing any resource
+    // of the same name.
+    void add_received_resource(const std::string &name, const std::string &path,
+                               std::shared_ptr<const ChunkHashes> hashes);
 
     void remove_resource(const std::string& name);
 
@@ -20,15 +42,66 @@ public:
 
     bool has_resource(const std::string &name) const;
 
-    const std::map<std::string, Resource> &get_local_resources() const { return local_resources; }
+    std::map<std::string, Resource> get_local_resources() const;
+
+    std::shared_ptr<const ResourceData> get_resource_data(const std::string &resource_name) const;
+
+    // Data and hashes of one resource, taken together so they always describe the same contents.
+    Resource get_resource(const std::string &resource_name) const;
+
+    // Every change to the local resources bumps the catalog version by one.
+    uint32_t get_catalog_version() const;
+
+    // Fills catalog with every local resource as advertised to other peers and returns the version it is as of.
+    uint32_t get_catalog(std::vector<RemoteResource> &catalog) const;
+
+    // Fills changes with the current state of every local resource added, replaced or removed after version since
+    // and sets version to the one that brings a peer to. Returns false when those changes are no longer
+    // remembered.
+    bool get_catalog_changes(uint32_t since, std::vector<CatalogChange> &changes, uint32_t &version) const;
 
-    const std::vector<u_char> &get_resource_data(const std::string &resource_name) const;
+    // Replaces everything known about the resources of the peer at ip.
+    void add_remote_resource(const std::string &ip, const std::vector<RemoteResource> &resources);
 
-    void add_remote_resource(const std::string &ip, const std::vector<std::string> &resources);
+    // Replaces everything known about the resources of the peer at ip with a summary of them.
+    void add_remote_summary(const std::string &ip, BloomFilter summary);
 
-    const std::map<std::string, std::vector<std::string>> &get_remote_resources() const { return remote_resources; }
+    void apply_remote_changes(const std::string &ip, const std::vector<CatalogChange> &changes);
+
+    // Forgets everything about the resources of the peer at ip.
+    void remove_remote_peer(const std::string &ip);
+
+    std::map<std::string, RemotePeer> get_remote_resources() const;
+
+    // Peers that have the resource, or whose summary says they may have it; downloads confirm with each of them
+    // before fetching anything.
+    std::vector<std::string> get_peers_with_resource(const std::string &resource_name) const;
+
+    // Names of local and remote resources matching pattern, in order, with where each of them can be found.
+    std::vector<SearchResult> search(SearchMode mode, const std::string &pattern,
+                                     size_t limit = DEFAULT_SEARCH_LIMIT) const;
+
+    ChunkStoreStats get_chunk_store_stats() const { return chunk_store->stats(); }
 
 private:
+    // Called with local_mutex held exclusively once the resource called name was added, replaced or removed;
+    // existed tells whether there was one before.
+    void record_change(const std::string &name, bool existed);
+
+    // Local resources share their common chunks through the store.
+    std::shared_ptr<ChunkStore> chunk_store = std::make_shared<ChunkStore>();
+
+    mutable std::shared_mutex local_mutex;
     std::map<std::string, Resource> local_resources;
-    std::map<std::string, std::vector<std::string>> remote_resources;
+    uint32_t catalog_version = 0;
+    // Names of the changed resources, oldest first, each with the version its change produced.
+    std::deque<std::pair<uint32_t, std::string>> catalog_changes;
+
+    mutable std::shared_mutex remote_mutex;
+    std::map<std::string, RemotePeer> remote_resources;
+
+    // Holds every local name once and every remote one once per peer listing it. Only locked after local_mutex or
+    // remote_mutex, never before.
+    mutable std::shared_mutex index_mutex;
+    NameIndex name_index;
 };
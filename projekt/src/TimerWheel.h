@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "Transfer.h"
+
+// Hashed timer wheel: deadlines are rounded up to whole ticks and filed into one of a fixed number of slots, so
+// advancing the clock only looks at the slots of the ticks that passed, however many timers are pending. A timer
+// further out than one turn of the wheel stays in its slot until the turn it is due. Moving or cancelling a timer
+// leaves its old entry behind to be skipped when its slot comes up. Not thread-safe.
+template<typename Key>
+class TimerWheel
+{
+public:
+    TimerWheel(Clock::duration tick, size_t slot_count, Clock::time_point start) :
+        tick(tick), start(start), slots(slot_count)
+    {
+    }
+
+    // Sets the deadline of key, replacing any earlier one.
+    void schedule(const Key &key, Clock::time_point deadline)
+    {
+        // Never in a tick that has been processed already, or the timer would wait a whole turn.
+        uint64_t due = std::max(tick_of(deadline), processed + 1);
+        deadlines[key] = due;
+        slots[due % slots.size()].push_back({key, due});
+    }
+
+    void cancel(const Key &key) { deadlines.erase(key); }
+
+    // Returns every key whose deadline has passed by now, once, and forgets about it.
+    std::vector<Key> advance(Clock::time_point now)
+    {
+        std::vector<Key> expired;
+        uint64_t current = now < start ? 0 : static_cast<uint64_t>((now - start) / tick);
+        // Past a whole turn, each slot only needs looking at once.
+        uint64_t first = std::max(processed + 1, current >= slots.size() ? current - slots.size() + 1 : 0);
+        for (uint64_t t = first; t <= current; ++t)
+        {
+            std::vector<Entry> &slot = slots[t % slots.size()];
+            for (size_t i = 0; i < slot.size();)
+            {
+                auto deadline = deadlines.find(slot[i].key);
+                bool stale = deadline == deadlines.end() || deadline->second != slot[i].due;
+                if (!stale && slot[i].due > current)
+                {
+                    ++i;
+                    continue;
+                }
+                if (!stale)
+                {
+                    expired.push_back(slot[i].key);
+                    deadlines.erase(deadline);
+                }
+                slot[i] = std::move(slot.back());
+                slot.pop_back();
+            }
+        }
+        processed = std::max(processed, current);
+        return expired;
+    }
+
+private:
+    struct Entry
+    {
+        Key key;
+        uint64_t due;
+    };
+
+    uint64_t tick_of(Clock::time_point time_point) const
+    {
+        if (time_point <= start)
+        {
+            return 0;
+        }
+        return static_cast<uint64_t>((time_point - start + tick - Clock::duration(1)) / tick);
+    }
+
+    Clock::duration tick;
+    Clock::time_point start;
+    std::vector<std::vector<Entry>> slots;
+    // The tick each pending key is due in.
+    std::map<Key, uint64_t> deadlines;
+    uint64_t processed = 0;
+};
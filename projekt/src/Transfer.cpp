@@ -0,0 +1,856 @@
+#include "Transfer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+uint64_t chunk_count_for(uint64_t total_length)
+{
+    // An empty resource is still announced by a single empty chunk.
+    return std::max<uint64_t>(1, (total_length + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE);
+}
+
+uint64_t timestamp_us(Clock::time_point time_point)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(time_point.time_since_epoch()).count();
+}
+
+
+std::string safe_file_name(const std::string &resource_name)
+{
+    std::string file_name = resource_name;
+    std::replace(file_name.begin(), file_name.end(), '/', '_');
+    if (file_name.empty() || file_name.front() == '.')
+    {
+        file_name.insert(file_name.begin(), '_');
+    }
+    return file_name;
+}
+
+uint64_t range_chunk_count(uint64_t total_length, uint64_t offset, uint64_t length)
+{
+    if (offset % MAX_CHUNK_SIZE != 0 || offset > total_length || (offset == total_length && total_length > 0))
+    {
+        return 0;
+    }
+    uint64_t end = length == 0 || length > total_length - offset ? total_length : offset + length;
+    // The empty resource is the one empty chunk again.
+    return end == offset ? 1 : (end - offset + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE;
+}
+
+static std::runtime_error io_error(const std::string &what, const std::filesystem::path &path)
+{
+    return std::runtime_error(what + " " + path.string() + ": " + strerror(errno));
+}
+
+ChunkAssembly::ChunkAssembly(std::string resource_name, uint64_t total_length) :
+    resource_name(std::move(resource_name)), total_length(total_length), received_chunks(chunk_count_for(total_length))
+{
+}
+
+ChunkResult ChunkAssembly::store_chunk(uint64_t index, const u_char *data, size_t length)
+{
+    if (!verify_chunk(index, data, length))
+    {
+        return ChunkResult::CORRUPT;
+    }
+
+    // Held across the write as well, so a file cannot be finished under a duplicate still being written.
+    std::lock_guard<std::mutex> lock(mutex);
+    if (index >= received_chunks.size() || received_chunks[index] || !write_chunk(index, data, length))
+    {
+        return ChunkResult::DUPLICATE;
+    }
+    received_chunks[index] = true;
+    ++received_count;
+    return ChunkResult::STORED;
+}
+
+bool ChunkAssembly::has_chunk(uint64_t index) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return index < received_chunks.size() && received_chunks[index];
+}
+
+SelectiveAck ChunkAssembly::range_ack(uint64_t first_chunk, uint32_t chunk_count, uint32_t known_cumulative) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto has = [&](uint64_t sequence) { return received_chunks[first_chunk + sequence]; };
+
+    SelectiveAck ack;
+    ack.cumulative_ack = known_cumulative;
+    while (ack.cumulative_ack < chunk_count && has(ack.cumulative_ack))
+    {
+        ++ack.cumulative_ack;
+    }
+    for (uint32_t i = 0; i < SACK_WINDOW_CHUNKS; ++i)
+    {
+        uint64_t sequence = static_cast<uint64_t>(ack.cumulative_ack) + 1 + i;
+        if (sequence >= chunk_count)
+        {
+            break;
+        }
+        if (has(sequence))
+        {
+            ack.sack_bitmap[i / 64] |= 1ull << (i % 64);
+        }
+    }
+    return ack;
+}
+
+bool ChunkAssembly::read_chunk(uint64_t index, u_char *data, size_t length) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return index < received_chunks.size() && received_chunks[index] && load_chunk(index, data, length);
+}
+
+uint64_t ChunkAssembly::missing_chunks() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return received_chunks.size() - received_count;
+}
+
+std::vector<bool> ChunkAssembly::received() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return received_chunks;
+}
+
+void ChunkAssembly::restore(const std::vector<bool> &chunks)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    received_chunks = chunks;
+    received_count = static_cast<uint64_t>(std::count(chunks.begin(), chunks.end(), true));
+}
+
+
+// The state file never leaves the machine, so integers are in host byte order. It is the magic, the format
+// version, the resource length, its content hash, the chunk count and the bitmap, one bit per chunk, followed by
+// the SHA-256 of all of that.
+static const char STATE_MAGIC[8] = {'P', '2', 'P', 'S', 'T', 'A', 'T', 'E'};
+static const uint32_t STATE_VERSION = 1;
+static const size_t STATE_HEADER_SIZE = sizeof(STATE_MAGIC) + 4 + 8 + CONTENT_HASH_SIZE + 8;
+
+static std::vector<u_char> encode_state(uint64_t total_length, const Digest &content_hash,
+                                        const std::vector<bool> &chunks)
+{
+    std::vector<u_char> state(STATE_HEADER_SIZE + (chunks.size() + 7) / 8 + CONTENT_HASH_SIZE);
+    u_char *position = state.data();
+    auto put = [&](const void *value, size_t length) {
+        std::memcpy(position, value, length);
+        position += length;
+    };
+    uint64_t chunk_count = chunks.size();
+    put(STATE_MAGIC, sizeof(STATE_MAGIC));
+    put(&STATE_VERSION, sizeof(STATE_VERSION));
+    put(&total_length, sizeof(total_length));
+    put(content_hash.data(), content_hash.size());
+    put(&chunk_count, sizeof(chunk_count));
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        position[i / 8] |= static_cast<u_char>(chunks[i]) << (i % 8);
+    }
+    position += (chunks.size() + 7) / 8;
+
+    Sha256 checksum;
+    checksum.update(state.data(), position - state.data());
+    Digest digest = checksum.finish();
+    put(digest.data(), digest.size());
+    return state;
+}
+
+// Leaves chunks alone unless the state is intact and describes exactly this resource.
+static bool decode_state(const std::vector<u_char> &state, uint64_t total_length, const Digest &content_hash,
+                         std::vector<bool> &chunks)
+{
+    size_t bitmap_size = (chunks.size() + 7) / 8;
+    if (state.size() != STATE_HEADER_SIZE + bitmap_size + CONTENT_HASH_SIZE)
+    {
+        return false;
+    }
+    Sha256 checksum;
+    checksum.update(state.data(), state.size() - CONTENT_HASH_SIZE);
+    Digest digest = checksum.finish();
+    if (std::memcmp(digest.data(), state.data() + state.size() - CONTENT_HASH_SIZE, CONTENT_HASH_SIZE) != 0)
+    {
+        return false;
+    }
+
+    std::vector<u_char> expected = encode_state(total_length, content_hash, std::vector<bool>(chunks.size()));
+    if (std::memcmp(state.data(), expected.data(), STATE_HEADER_SIZE) != 0)
+    {
+        return false;
+    }
+    const u_char *bitmap = state.data() + STATE_HEADER_SIZE;
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        chunks[i] = (bitmap[i / 8] >> (i % 8)) & 1;
+    }
+    return true;
+}
+
+static bool read_file(const std::filesystem::path &path, std::vector<u_char> &contents)
+{
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0)
+    {
+        return false;
+    }
+    struct stat file_stat = {};
+    bool ok = fstat(file, &file_stat) == 0;
+    if (ok)
+    {
+        contents.resize(static_cast<size_t>(file_stat.st_size));
+        size_t done = 0;
+        while (ok && done < contents.size())
+        {
+            ssize_t result = read(file, contents.data() + done, contents.size() - done);
+            ok = result > 0 || (result < 0 && errno == EINTR);
+            done += result > 0 ? static_cast<size_t>(result) : 0;
+        }
+    }
+    close(file);
+    return ok;
+}
+
+// Replaces path in one step, so a crash leaves either the old or the new contents behind.
+static void write_file_atomically(const std::filesystem::path &path, const std::vector<u_char> &contents)
+{
+    std::filesystem::path temporary_path = path.string() + ".tmp";
+    int file = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file < 0)
+    {
+        throw io_error("Failed to create", temporary_path);
+    }
+    size_t done = 0;
+    while (done < contents.size())
+    {
+        ssize_t result = write(file, contents.data() + done, contents.size() - done);
+        if (result < 0 && errno != EINTR)
+        {
+            std::runtime_error exception = io_error("Failed to write", temporary_path);
+            close(file);
+            throw exception;
+        }
+        done += result > 0 ? static_cast<size_t>(result) : 0;
+    }
+    if (fsync(file) < 0 || close(file) < 0 || rename(temporary_path.c_str(), path.c_str()) < 0)
+    {
+        throw io_error("Failed to save", path);
+    }
+}
+
+PartialFile::PartialFile(std::string resource_name, uint64_t total_length, std::shared_ptr<const ChunkHashes> hashes,
+                         const std::filesystem::path &directory) :
+    ChunkAssembly(std::move(resource_name), total_length), hashes(std::move(hashes)), directory(directory)
+{
+    std::filesystem::create_directories(directory);
+
+    // Named after the contents, so only a download of the very same contents resumes from it.
+    std::string base_name = "." + safe_file_name(this->resource_name) + "." + to_hex(this->hashes->root());
+    partial_path = directory / (base_name + ".part");
+    state_path = directory / (base_name + ".state");
+
+    fd = open(partial_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        throw io_error("Failed to create", partial_path);
+    }
+
+    std::vector<u_char> state;
+    std::vector<bool> chunks(chunk_count());
+    if (read_file(state_path, state) && decode_state(state, total_length, this->hashes->root(), chunks))
+    {
+        restore(chunks);
+        resumed = chunk_count() - missing_chunks();
+    }
+    saved_missing = missing_chunks();
+
+    // Reserve the space up front, so running out of disk shows up now rather than halfway through.
+    if (total_length > 0)
+    {
+        int error = posix_fallocate(fd, 0, static_cast<off_t>(total_length));
+        if (error != 0)
+        {
+            errno = error;
+            std::runtime_error exception = io_error("Failed to allocate", partial_path);
+            close(fd);
+            if (resumed == 0)
+            {
+                unlink(partial_path.c_str());
+            }
+            throw exception;
+        }
+    }
+}
+
+PartialFile::~PartialFile()
+{
+    if (fd < 0)
+    {
+        return;
+    }
+    if (missing_chunks() == chunk_count())
+    {
+        // Nothing worth keeping.
+        close(fd);
+        unlink(partial_path.c_str());
+        unlink(state_path.c_str());
+        return;
+    }
+    try
+    {
+        save_state();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+    close(fd);
+}
+
+bool PartialFile::verify_chunk(uint64_t index, const u_char *data, size_t length) const
+{
+    return hashes->verify_chunk(index, data, length);
+}
+
+bool PartialFile::write_chunk(uint64_t index, const u_char *data, size_t length)
+{
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    off_t offset = static_cast<off_t>(index * MAX_CHUNK_SIZE);
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t result = pwrite(fd, data + written, length - written, offset + static_cast<off_t>(written));
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw io_error("Failed to write", partial_path);
+        }
+        written += static_cast<size_t>(result);
+    }
+    return true;
+}
+
+bool PartialFile::load_chunk(uint64_t index, u_char *data, size_t length) const
+{
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    off_t offset = static_cast<off_t>(index * MAX_CHUNK_SIZE);
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t result = pread(fd, data + done, length - done, offset + static_cast<off_t>(done));
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            return false;
+        }
+        done += static_cast<size_t>(result);
+    }
+    return true;
+}
+
+std::filesystem::path PartialFile::finish()
+{
+    std::lock_guard<std::mutex> file_lock(file_mutex);
+    std::lock_guard<std::mutex> lock(mutex);
+    std::filesystem::path final_path = directory / safe_file_name(resource_name);
+    if (fdatasync(fd) < 0)
+    {
+        throw io_error("Failed to flush", partial_path);
+    }
+    close(fd);
+    fd = -1;
+    unlink(state_path.c_str());
+    if (rename(partial_path.c_str(), final_path.c_str()) < 0)
+    {
+        std::runtime_error exception = io_error("Failed to rename", partial_path);
+        unlink(partial_path.c_str());
+        throw exception;
+    }
+    return final_path;
+}
+
+void PartialFile::save_state()
+{
+    std::lock_guard<std::mutex> file_lock(file_mutex);
+    if (fd < 0)
+    {
+        return;
+    }
+    // Chunks arriving from here on are simply not part of this save.
+    std::vector<bool> chunks = received();
+    uint64_t missing = static_cast<uint64_t>(std::count(chunks.begin(), chunks.end(), false));
+    if (missing == saved_missing)
+    {
+        return;
+    }
+    // The data goes to disk before the bitmap claiming it does.
+    if (fdatasync(fd) < 0)
+    {
+        throw io_error("Failed to flush", partial_path);
+    }
+    write_file_atomically(state_path, encode_state(total_length, hashes->root(), chunks));
+    saved_missing = missing;
+}
+
+
+PartialHashTree::PartialHashTree(std::string resource_name, uint64_t resource_length, const Digest &content_hash) :
+    ChunkAssembly(std::move(resource_name), HashTreeLayout(resource_length).size()), resource_length(resource_length),
+    content_hash(content_hash), layout(resource_length), buffer(total_length)
+{
+}
+
+std::shared_ptr<const ChunkHashes> PartialHashTree::finish() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return ChunkHashes::from_tree(resource_length, content_hash, buffer);
+}
+
+bool PartialHashTree::verify_chunk(uint64_t index, const u_char *data, size_t length) const
+{
+    size_t level = 0;
+    while (level + 1 < layout.level_count() && index >= layout.level_first_chunk[level + 1])
+    {
+        ++level;
+    }
+    if (level == 0)
+    {
+        return ChunkHashes::chunk_hash(data, length) == content_hash;
+    }
+
+    // The digest of this chunk sits in the level above, which must have arrived already. Stored chunks never
+    // change, so once has_chunk says so the digest can be read without the lock.
+    uint64_t digest_offset = layout.level_first_chunk[level - 1] * MAX_CHUNK_SIZE +
+                             (index - layout.level_first_chunk[level]) * CONTENT_HASH_SIZE;
+    if (!has_chunk(digest_offset / MAX_CHUNK_SIZE))
+    {
+        return false;
+    }
+    Digest digest = ChunkHashes::chunk_hash(data, length);
+    return std::memcmp(digest.data(), buffer.data() + digest_offset, CONTENT_HASH_SIZE) == 0;
+}
+
+bool PartialHashTree::write_chunk(uint64_t index, const u_char *data, size_t length)
+{
+    std::memcpy(buffer.data() + index * MAX_CHUNK_SIZE, data, length);
+    return true;
+}
+
+bool PartialHashTree::load_chunk(uint64_t index, u_char *data, size_t length) const
+{
+    std::memcpy(data, buffer.data() + index * MAX_CHUNK_SIZE, length);
+    return true;
+}
+
+
+IncomingTransfer::IncomingTransfer(std::shared_ptr<ChunkAssembly> assembly, uint64_t first_chunk,
+                                   uint32_t chunk_count) :
+    assembly(std::move(assembly)), first_chunk(first_chunk), chunk_count(chunk_count)
+{
+}
+
+bool IncomingTransfer::matches(const P2PDataMessage &message) const
+{
+    if (message.sequence >= chunk_count || message.total_length != assembly->total_length)
+    {
+        return false;
+    }
+    uint64_t offset = (first_chunk + message.sequence) * MAX_CHUNK_SIZE;
+    return message.offset == offset && offset <= assembly->total_length &&
+           message.data_length == std::min<uint64_t>(MAX_CHUNK_SIZE, assembly->total_length - offset);
+}
+
+bool IncomingTransfer::matches_repair(const P2PDataMessage &message) const
+{
+    return message.total_length == assembly->total_length && message.sequence % FEC_BLOCK_CHUNKS == 0 &&
+           message.sequence < chunk_count && message.offset < MAX_FEC_REPAIR_SYMBOLS && message.data_length > 0 &&
+           message.data_length == chunk_length(message.sequence);
+}
+
+size_t IncomingTransfer::chunk_length(uint32_t sequence) const
+{
+    uint64_t offset = (first_chunk + sequence) * MAX_CHUNK_SIZE;
+    return offset < assembly->total_length ? std::min<uint64_t>(MAX_CHUNK_SIZE, assembly->total_length - offset) : 0;
+}
+
+ChunkResult IncomingTransfer::store_chunk(uint32_t sequence, const u_char *data, size_t length)
+{
+    ChunkResult result = assembly->store_chunk(first_chunk + sequence, data, length);
+    // A peer sending nothing but garbage counts as stalled.
+    if (result != ChunkResult::CORRUPT)
+    {
+        last_activity = Clock::now();
+    }
+    // The chunk may be what the repair symbols of its block were waiting for.
+    if (result == ChunkResult::STORED && !repairs.empty())
+    {
+        rebuild_block(sequence - sequence % FEC_BLOCK_CHUNKS);
+    }
+    return result;
+}
+
+void IncomingTransfer::store_repair(uint32_t sequence, uint32_t index, const u_char *data, size_t length)
+{
+    // Nothing beyond what the sender's window could have reached yet is kept.
+    if (sequence >= cumulative_ack + SACK_WINDOW_CHUNKS)
+    {
+        return;
+    }
+    last_activity = Clock::now();
+    repairs[sequence].try_emplace(index, data, data + length);
+    rebuild_block(sequence);
+}
+
+void IncomingTransfer::rebuild_block(uint32_t block)
+{
+    auto symbols = repairs.find(block);
+    if (symbols == repairs.end())
+    {
+        return;
+    }
+    uint32_t count = std::min<uint32_t>(FEC_BLOCK_CHUNKS, chunk_count - block);
+    size_t missing = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        missing += !assembly->has_chunk(first_chunk + block + i);
+    }
+    if (missing == 0)
+    {
+        repairs.erase(symbols);
+        return;
+    }
+    if (missing > symbols->second.size())
+    {
+        return;
+    }
+
+    size_t symbol_length = chunk_length(block);
+    std::vector<std::vector<u_char>> known(count);
+    std::vector<const uint8_t *> sources(count, nullptr);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        known[i].resize(symbol_length);
+        if (assembly->read_chunk(first_chunk + block + i, known[i].data(), chunk_length(block + i)))
+        {
+            sources[i] = known[i].data();
+        }
+    }
+    std::vector<std::pair<size_t, const uint8_t *>> repair_symbols;
+    for (const auto &[index, symbol] : symbols->second)
+    {
+        repair_symbols.emplace_back(index, symbol.data());
+    }
+    std::vector<std::vector<u_char>> recovered;
+    if (!decode_block(sources, repair_symbols, symbol_length, recovered))
+    {
+        return;
+    }
+    repairs.erase(symbols);
+
+    // Stored like any received chunk, so a block rebuilt from bad symbols fails verification and is sent again.
+    size_t next = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (!sources[i])
+        {
+            store_chunk(block + i, recovered[next++].data(), chunk_length(block + i));
+        }
+    }
+}
+
+bool IncomingTransfer::complete()
+{
+    return selective_ack().cumulative_ack == chunk_count;
+}
+
+SelectiveAck IncomingTransfer::selective_ack()
+{
+    SelectiveAck ack = assembly->range_ack(first_chunk, chunk_count, cumulative_ack);
+    cumulative_ack = ack.cumulative_ack;
+    // Blocks completed through other transfers into the same assembly never get decoded here.
+    while (!repairs.empty() && repairs.begin()->first + FEC_BLOCK_CHUNKS <= cumulative_ack)
+    {
+        repairs.erase(repairs.begin());
+    }
+    return ack;
+}
+
+
+OutgoingTransfer::OutgoingTransfer(uint32_t transfer_id, std::string resource_name,
+                                   std::shared_ptr<const ResourceData> data, PeerEndpoint target,
+                                   uint64_t first_chunk, uint32_t chunk_count,
+                                   std::unique_ptr<CongestionController> congestion, uint8_t fec_repair,
+                                   Compression compression) :
+    transfer_id(transfer_id), resource_name(std::move(resource_name)), target(target), first_chunk(first_chunk),
+    fec_repair(std::min<uint8_t>(fec_repair, MAX_FEC_REPAIR_SYMBOLS)), compression(compression),
+    data(std::move(data)), chunks(chunk_count), congestion(std::move(congestion))
+{
+}
+
+size_t OutgoingTransfer::chunk_length(uint32_t sequence) const
+{
+    uint64_t offset = chunk_offset(sequence);
+    return std::min<uint64_t>(MAX_CHUNK_SIZE, data->size() - offset);
+}
+
+bool OutgoingTransfer::next_chunk(uint32_t &sequence, Clock::time_point now) const
+{
+    return window_allows(sequence) && pacer.ready_at(chunk_length(sequence), now) <= now;
+}
+
+Clock::time_point OutgoingTransfer::next_send_time(Clock::time_point now) const
+{
+    uint32_t sequence;
+    return window_allows(sequence) ? pacer.ready_at(chunk_length(sequence), now) : Clock::time_point::max();
+}
+
+bool OutgoingTransfer::window_allows(uint32_t &sequence) const
+{
+    if (gave_up || in_flight_count >= window())
+    {
+        return false;
+    }
+    if (!lost_chunks.empty())
+    {
+        sequence = *lost_chunks.begin();
+        return true;
+    }
+    if (next_new_chunk < chunks.size() && next_new_chunk < cumulative_ack + MAX_WINDOW_CHUNKS)
+    {
+        sequence = next_new_chunk;
+        return true;
+    }
+    return false;
+}
+
+void OutgoingTransfer::on_chunk_sent(uint32_t sequence, size_t length, Clock::time_point now)
+{
+    ChunkState &chunk = chunks[sequence];
+    lost_chunks.erase(sequence);
+    if (sequence == next_new_chunk)
+    {
+        ++next_new_chunk;
+    }
+    if (!chunk.in_flight)
+    {
+        ++in_flight_count;
+    }
+    chunk.in_flight = true;
+    chunk.sent_at = now;
+    pacer.consume(length, now);
+}
+
+size_t OutgoingTransfer::compress_chunk(uint32_t sequence, ChunkCompressor &compressor, u_char *destination)
+{
+    if (compression == Compression::NONE)
+    {
+        return 0;
+    }
+    // Data that does not compress, media say, is only probed now and then in case that changes further on.
+    if (incompressible_run >= COMPRESSION_PROBE_INTERVAL && incompressible_run % COMPRESSION_PROBE_INTERVAL != 0)
+    {
+        ++incompressible_run;
+        return 0;
+    }
+    size_t length = compressor.compress(compression, chunk_data(sequence), chunk_length(sequence), destination);
+    incompressible_run = length > 0 ? 0 : incompressible_run + 1;
+    return length;
+}
+
+bool OutgoingTransfer::ends_fec_block(uint32_t sequence) const
+{
+    return fec_repair > 0 && sequence == next_new_chunk && sequence + 1 == fec_block_end(sequence) &&
+           chunk_length(sequence - sequence % FEC_BLOCK_CHUNKS) > 0;
+}
+
+uint32_t OutgoingTransfer::fec_block_end(uint32_t sequence) const
+{
+    return std::min<uint32_t>(sequence - sequence % FEC_BLOCK_CHUNKS + FEC_BLOCK_CHUNKS, chunk_count());
+}
+
+void OutgoingTransfer::encode_repair(uint32_t block, uint32_t repair, u_char *symbol) const
+{
+    std::vector<std::pair<const uint8_t *, size_t>> sources;
+    for (uint32_t sequence = block; sequence < fec_block_end(block); ++sequence)
+    {
+        sources.emplace_back(chunk_data(sequence), chunk_length(sequence));
+    }
+    encode_repair_symbol(sources, repair, symbol, chunk_length(block));
+}
+
+void OutgoingTransfer::on_ack(const SelectiveAck &ack, uint64_t echo_timestamp, Clock::time_point now)
+{
+    uint64_t now_us = timestamp_us(now);
+    if (echo_timestamp != 0 && echo_timestamp <= now_us)
+    {
+        update_rtt(std::chrono::microseconds(now_us - echo_timestamp));
+    }
+
+    Clock::time_point latest_delivered_sent_at{};
+    uint32_t highest_delivered = 0;
+    bool delivered = false;
+    uint64_t previously_acked = acked_count;
+
+    uint32_t cumulative = std::min<uint32_t>(ack.cumulative_ack, next_new_chunk);
+    for (uint32_t sequence = cumulative_ack; sequence < cumulative; ++sequence)
+    {
+        mark_acked(sequence, latest_delivered_sent_at, highest_delivered);
+        delivered = true;
+    }
+    cumulative_ack = std::max(cumulative_ack, cumulative);
+
+    for (uint32_t i = 0; i < SACK_WINDOW_CHUNKS; ++i)
+    {
+        if (ack.sack_bitmap[i / 64] & (1ull << (i % 64)))
+        {
+            uint64_t sequence = static_cast<uint64_t>(ack.cumulative_ack) + 1 + i;
+            if (sequence < chunks.size())
+            {
+                mark_acked(static_cast<uint32_t>(sequence), latest_delivered_sent_at, highest_delivered);
+                delivered = true;
+            }
+        }
+    }
+
+    if (!delivered)
+    {
+        return;
+    }
+    last_progress = now;
+
+    // Holes below the highest selectively acknowledged chunk act as negative acknowledgements: anything sent
+    // before a chunk that has since been delivered, and far enough behind it, is retransmitted right away. With FEC
+    // a hole is left to the repair symbols until a chunk sent after them has been delivered.
+    uint32_t end = std::min<uint32_t>(next_new_chunk, cumulative_ack + MAX_WINDOW_CHUNKS);
+    for (uint32_t sequence = cumulative_ack; sequence < end; ++sequence)
+    {
+        const ChunkState &chunk = chunks[sequence];
+        if (chunk.in_flight && chunk.sent_at < latest_delivered_sent_at &&
+            sequence + FAST_RETRANSMIT_THRESHOLD <= highest_delivered &&
+            (fec_repair == 0 || highest_delivered >= fec_block_end(sequence)))
+        {
+            congestion->on_loss(chunk.sent_at, now, false);
+            mark_lost(sequence);
+        }
+    }
+    congestion->on_delivered(static_cast<uint32_t>(acked_count - previously_acked), latest_delivered_sent_at, now,
+                             smoothed_rtt);
+    pacer.set_rate(congestion->pacing_rate(smoothed_rtt), now);
+}
+
+void OutgoingTransfer::on_timer(Clock::time_point now)
+{
+    if (now - last_progress > OUTGOING_TRANSFER_TIMEOUT)
+    {
+        gave_up = true;
+        return;
+    }
+
+    bool expired = false;
+    Clock::time_point earliest_sent_at = Clock::time_point::max();
+    uint32_t end = std::min<uint32_t>(next_new_chunk, cumulative_ack + MAX_WINDOW_CHUNKS);
+    for (uint32_t sequence = cumulative_ack; sequence < end; ++sequence)
+    {
+        const ChunkState &chunk = chunks[sequence];
+        if (chunk.in_flight && chunk.sent_at + retransmission_timeout <= now)
+        {
+            earliest_sent_at = std::min(earliest_sent_at, chunk.sent_at);
+            mark_lost(sequence);
+            expired = true;
+        }
+    }
+    if (expired)
+    {
+        retransmission_timeout = std::min<std::chrono::microseconds>(retransmission_timeout * 2, MAX_RTO);
+        congestion->on_loss(earliest_sent_at, now, true);
+        pacer.set_rate(congestion->pacing_rate(smoothed_rtt), now);
+    }
+}
+
+Clock::time_point OutgoingTransfer::next_timeout() const
+{
+    Clock::time_point earliest = Clock::time_point::max();
+    uint32_t end = std::min<uint32_t>(next_new_chunk, cumulative_ack + MAX_WINDOW_CHUNKS);
+    for (uint32_t sequence = cumulative_ack; sequence < end; ++sequence)
+    {
+        const ChunkState &chunk = chunks[sequence];
+        if (chunk.in_flight)
+        {
+            earliest = std::min(earliest, chunk.sent_at + retransmission_timeout);
+        }
+    }
+    return earliest;
+}
+
+void OutgoingTransfer::mark_acked(uint32_t sequence, Clock::time_point &latest_delivered_sent_at,
+                                  uint32_t &highest_delivered)
+{
+    ChunkState &chunk = chunks[sequence];
+    if (chunk.acked || sequence >= next_new_chunk)
+    {
+        return;
+    }
+    if (chunk.in_flight)
+    {
+        --in_flight_count;
+    }
+    chunk.acked = true;
+    chunk.in_flight = false;
+    lost_chunks.erase(sequence);
+    ++acked_count;
+
+    if (chunk.sent_at > latest_delivered_sent_at)
+    {
+        latest_delivered_sent_at = chunk.sent_at;
+    }
+    highest_delivered = std::max(highest_delivered, sequence);
+}
+
+void OutgoingTransfer::mark_lost(uint32_t sequence)
+{
+    ChunkState &chunk = chunks[sequence];
+    if (chunk.in_flight)
+    {
+        --in_flight_count;
+    }
+    chunk.in_flight = false;
+    lost_chunks.insert(sequence);
+}
+
+void OutgoingTransfer::update_rtt(std::chrono::microseconds sample)
+{
+    // RFC 6298 smoothing; a fresh sample also undoes any exponential backoff.
+    if (!has_rtt_sample)
+    {
+        smoothed_rtt = sample;
+        rtt_variance = sample / 2;
+        has_rtt_sample = true;
+    }
+    else
+    {
+        auto deviation = smoothed_rtt > sample ? smoothed_rtt - sample : sample - smoothed_rtt;
+        rtt_variance = (rtt_variance * 3 + deviation) / 4;
+        smoothed_rtt = (smoothed_rtt * 7 + sample) / 8;
+    }
+    auto timeout = smoothed_rtt + std::max<std::chrono::microseconds>(std::chrono::milliseconds(1), rtt_variance * 4);
+    retransmission_timeout = std::clamp<std::chrono::microseconds>(timeout, MIN_RTO, MAX_RTO);
+}
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+
+#include "Compression.h"
+#include "CongestionControl.h"
+#include "ContentHash.h"
+#include "PeerEndpoint.h"
+#include "Protocol.h"
+#include "ReedSolomon.h"
+#include "ResourceData.h"
+
+constexpr std::chrono::seconds INCOMING_TRANSFER_TIMEOUT{30};
+
+// A chunk is declared lost once this many later-sent chunks have been acknowledged.
+constexpr uint32_t FAST_RETRANSMIT_THRESHOLD = 3;
+// A transfer whose receiver has not acknowledged anything new for this long is abandoned.
+constexpr std::chrono::seconds OUTGOING_TRANSFER_TIMEOUT{30};
+constexpr std::chrono::milliseconds INITIAL_RTO{1000};
+constexpr std::chrono::milliseconds MIN_RTO{200};
+constexpr std::chrono::milliseconds MAX_RTO{10000};
+
+uint64_t chunk_count_for(uint64_t total_length);
+
+// Number of chunks a RANGE request for [offset, offset + length) covers, length 0 meaning up to the end. Returns 0
+// if the range is not chunk aligned or lies outside the resource.
+uint64_t range_chunk_count(uint64_t total_length, uint64_t offset, uint64_t length);
+
+uint64_t timestamp_us(Clock::time_point time_point);
+
+// Maps a resource name received from the network onto a plain file name inside the download directory.
+std::string safe_file_name(const std::string &resource_name);
+
+enum class ChunkResult
+{
+    STORED,
+    DUPLICATE,
+    // Failed verification against the chunk hashes; not stored, so the sender retransmits just this chunk.
+    CORRUPT,
+};
+
+// Something assembled chunk by chunk from range transfers: keeps the received-chunk bitmap and verifies every chunk
+// before it is stored. Safe for concurrent use, several range transfers store into the same assembly at once.
+// Throws std::runtime_error on I/O errors.
+class ChunkAssembly
+{
+public:
+    ChunkAssembly(std::string resource_name, uint64_t total_length);
+
+    virtual ~ChunkAssembly() = default;
+
+    ChunkAssembly(const ChunkAssembly &) = delete;
+
+    ChunkAssembly &operator=(const ChunkAssembly &) = delete;
+
+    ChunkResult store_chunk(uint64_t index, const u_char *data, size_t length);
+
+    bool has_chunk(uint64_t index) const;
+
+    // Copies a stored chunk into data; false if it is not stored or cannot be read back.
+    bool read_chunk(uint64_t index, u_char *data, size_t length) const;
+
+    // Acknowledgement for the range of chunk_count chunks starting at first_chunk. known_cumulative is a previous
+    // cumulative acknowledgement for the same range, so the scan does not start over every time.
+    SelectiveAck range_ack(uint64_t first_chunk, uint32_t chunk_count, uint32_t known_cumulative) const;
+
+    uint64_t chunk_count() const { return received_chunks.size(); }
+
+    uint64_t missing_chunks() const;
+
+    // Copy of the received-chunk bitmap.
+    std::vector<bool> received() const;
+
+    const std::string resource_name;
+    const uint64_t total_length;
+
+protected:
+    // Marks chunks as received whose data is in place already.
+    void restore(const std::vector<bool> &chunks);
+
+    // Called without the lock, so transfers into the same assembly verify their chunks in parallel.
+    virtual bool verify_chunk(uint64_t index, const u_char *data, size_t length) const = 0;
+
+    // Called with the lock held for every chunk not stored before; returns false once nothing is accepted anymore.
+    virtual bool write_chunk(uint64_t index, const u_char *data, size_t length) = 0;
+
+    // Called with the lock held for a chunk that has been stored.
+    virtual bool load_chunk(uint64_t index, u_char *data, size_t length) const = 0;
+
+    mutable std::mutex mutex;
+
+private:
+    std::vector<bool> received_chunks;
+    uint64_t received_count = 0;
+};
+
+// Streams a resource into a preallocated hidden file in the download directory, writing every chunk at its offset
+// as it arrives. Only the received-chunk bitmap is kept in memory.
+//
+// Unfinished files are kept, named after the content hash, with the bitmap saved next to them in a state file. A
+// later download of the same contents, after a restart or once other peers turn up, picks up the chunks received
+// so far and only fetches what is missing.
+class PartialFile : public ChunkAssembly
+{
+public:
+    PartialFile(std::string resource_name, uint64_t total_length, std::shared_ptr<const ChunkHashes> hashes,
+                const std::filesystem::path &directory);
+
+    // Saves the state of an unfinished file for a later resume.
+    ~PartialFile() override;
+
+    // Flushes the completed file and atomically renames it to its final name, which is returned.
+    std::filesystem::path finish();
+
+    // Makes the chunks received so far durable, then records them in the state file. Does nothing if no chunk
+    // arrived since the last save.
+    void save_state();
+
+    // Chunks picked up from a previous partial download.
+    uint64_t resumed_chunks() const { return resumed; }
+
+    const std::shared_ptr<const ChunkHashes> hashes;
+
+protected:
+    bool verify_chunk(uint64_t index, const u_char *data, size_t length) const override;
+
+    bool write_chunk(uint64_t index, const u_char *data, size_t length) override;
+
+    bool load_chunk(uint64_t index, u_char *data, size_t length) const override;
+
+private:
+    std::filesystem::path directory;
+    std::filesystem::path partial_path;
+    std::filesystem::path state_path;
+    int fd = -1;
+    // Serializes save_state and finish, which both work on the file outside the chunk lock.
+    std::mutex file_mutex;
+    uint64_t saved_missing = 0;
+    uint64_t resumed = 0;
+};
+
+// Collects the hash tree of a resource in memory. Each level is checked against the one above it, the topmost
+// against the content hash, so the levels have to be fetched from the top down; a chunk whose parent level has not
+// arrived yet cannot be verified and is refused.
+class PartialHashTree : public ChunkAssembly
+{
+public:
+    PartialHashTree(std::string resource_name, uint64_t resource_length, const Digest &content_hash);
+
+    // Once nothing is missing anymore. Throws std::invalid_argument if the tree is inconsistent after all.
+    std::shared_ptr<const ChunkHashes> finish() const;
+
+    const uint64_t resource_length;
+    const Digest content_hash;
+    const HashTreeLayout layout;
+
+protected:
+    bool verify_chunk(uint64_t index, const u_char *data, size_t length) const override;
+
+    bool write_chunk(uint64_t index, const u_char *data, size_t length) override;
+
+    bool load_chunk(uint64_t index, u_char *data, size_t length) const override;
+
+private:
+    std::vector<u_char> buffer;
+};
+
+// Receiving side of one range request, covering chunks [first_chunk, first_chunk + chunk_count) of an assembly.
+// Sequence numbers count from the start of the range. Acknowledgements report what the assembly holds, so chunks that
+// already arrived through another transfer are acknowledged without being sent again. Repair symbols are kept per
+// FEC block until the chunks they stand in for are rebuilt from them or arrive after all.
+class IncomingTransfer
+{
+public:
+    IncomingTransfer(std::shared_ptr<ChunkAssembly> assembly, uint64_t first_chunk, uint32_t chunk_count);
+
+    // True if the message carries chunk `sequence` of this range with the offset and length that chunk has.
+    bool matches(const P2PDataMessage &message) const;
+
+    // True if the message carries a repair symbol for an FEC block of this range, as long as the block's first chunk.
+    bool matches_repair(const P2PDataMessage &message) const;
+
+    ChunkResult store_chunk(uint32_t sequence, const u_char *data, size_t length);
+
+    // Takes repair symbol `index` of the FEC block starting at chunk `sequence`, and rebuilds the block's missing
+    // chunks as soon as there are as many repair symbols as chunks missing.
+    void store_repair(uint32_t sequence, uint32_t index, const u_char *data, size_t length);
+
+    bool complete();
+
+    SelectiveAck selective_ack();
+
+    const std::shared_ptr<ChunkAssembly> assembly;
+    const uint64_t first_chunk;
+    const uint32_t chunk_count;
+    Clock::time_point last_activity = Clock::now();
+    // Set by the first chunk; until then the range request is retried.
+    bool request_answered = false;
+
+    // Guards last_activity, request_answered and the acknowledgement state.
+    std::mutex mutex;
+
+private:
+    size_t chunk_length(uint32_t sequence) const;
+
+    void rebuild_block(uint32_t block);
+
+    uint32_t cumulative_ack = 0;
+    // Repair symbols, by index, of the FEC blocks still missing chunks, by the sequence number they start at.
+    std::map<uint32_t, std::map<uint32_t, std::vector<u_char>>> repairs;
+};
+
+class OutgoingTransfer
+{
+public:
+    // Sends chunks [first_chunk, first_chunk + chunk_count) of the resource; sequence numbers count from first_chunk.
+    // The congestion controller sizes the in-flight window and paces the chunks out.
+    OutgoingTransfer(uint32_t transfer_id, std::string resource_name, std::shared_ptr<const ResourceData> data,
+                     PeerEndpoint target, uint64_t first_chunk, uint32_t chunk_count,
+                     std::unique_ptr<CongestionController> congestion, uint8_t fec_repair = 0,
+                     Compression compression = Compression::NONE);
+
+    // Picks the next chunk to put on the wire (retransmissions first), respecting the in-flight window and pacing.
+    bool next_chunk(uint32_t &sequence, Clock::time_point now) const;
+
+    // When pacing lets the next chunk out, or Clock::time_point::max() if the window does not.
+    Clock::time_point next_send_time(Clock::time_point now) const;
+
+    // length is what went on the wire for the chunk, which compression may have made shorter than the chunk.
+    void on_chunk_sent(uint32_t sequence, size_t length, Clock::time_point now);
+
+    // Compresses chunk `sequence` into destination, which holds chunk_length(sequence) bytes, and returns the
+    // compressed length, or 0 if the chunk is to be sent as it is: without compression, when it did not shrink, and
+    // for most chunks once a run of them did not.
+    size_t compress_chunk(uint32_t sequence, ChunkCompressor &compressor, u_char *destination);
+
+    // True if sending chunk `sequence` now is the first transmission of the last chunk of its FEC block, whose repair
+    // symbols go out right after it.
+    bool ends_fec_block(uint32_t sequence) const;
+
+    // Computes repair symbol `repair` of the FEC block starting at chunk `block`, chunk_length(block) bytes.
+    void encode_repair(uint32_t block, uint32_t repair, u_char *symbol) const;
+
+    // Repair symbols count against the pacing, not the window: they are neither acknowledged nor retransmitted.
+    void on_repair_sent(size_t length, Clock::time_point now) { pacer.consume(length, now); }
+
+    void on_ack(const SelectiveAck &ack, uint64_t echo_timestamp, Clock::time_point now);
+
+    // Marks chunks whose retransmission timer expired as lost and backs the timer off. Gives up on the whole
+    // transfer once the receiver has gone quiet for OUTGOING_TRANSFER_TIMEOUT.
+    void on_timer(Clock::time_point now);
+
+    Clock::time_point next_timeout() const;
+
+    // Whichever of next_timeout and next_send_time comes first.
+    Clock::time_point next_wakeup(Clock::time_point now) const { return std::min(next_timeout(), next_send_time(now)); }
+
+    bool complete() const { return acked_count == chunks.size(); }
+
+    bool failed() const { return gave_up; }
+
+    uint32_t chunk_count() const { return static_cast<uint32_t>(chunks.size()); }
+
+    uint64_t total_length() const { return data->size(); }
+
+    uint64_t chunk_offset(uint32_t sequence) const { return (first_chunk + sequence) * MAX_CHUNK_SIZE; }
+
+    size_t chunk_length(uint32_t sequence) const;
+
+    // Points straight into the resource storage, which stays alive for as long as the transfer does.
+    const u_char *chunk_data(uint32_t sequence) const { return data->chunk(first_chunk + sequence); }
+
+    std::chrono::microseconds rto() const { return retransmission_timeout; }
+
+    uint32_t window() const { return std::min(congestion->window(), MAX_WINDOW_CHUNKS); }
+
+    const uint32_t transfer_id;
+    const std::string resource_name;
+    const PeerEndpoint target;
+    const uint64_t first_chunk;
+    // Repair symbols sent after each FEC block, 0 without FEC.
+    const uint8_t fec_repair;
+    // Codec chunks are compressed with, NONE to send them as they are.
+    const Compression compression;
+
+    // Guards the window and timer state; held by whichever thread is currently driving the transfer.
+    std::mutex mutex;
+
+private:
+    struct ChunkState
+    {
+        Clock::time_point sent_at{};
+        bool in_flight = false;
+        bool acked = false;
+    };
+
+    void mark_acked(uint32_t sequence, Clock::time_point &latest_delivered_sent_at, uint32_t &highest_delivered);
+
+    void mark_lost(uint32_t sequence);
+
+    // The chunk the window allows next, whatever the pacing.
+    bool window_allows(uint32_t &sequence) const;
+
+    // One past the last chunk of the FEC block holding chunk `sequence`.
+    uint32_t fec_block_end(uint32_t sequence) const;
+
+    void update_rtt(std::chrono::microseconds sample);
+
+    std::shared_ptr<const ResourceData> data;
+    std::vector<ChunkState> chunks;
+    std::set<uint32_t> lost_chunks;
+    uint32_t next_new_chunk = 0;
+    uint32_t cumulative_ack = 0;
+    uint64_t acked_count = 0;
+    uint32_t in_flight_count = 0;
+    // Chunks in a row that did not shrink, counting those not tried.
+    uint32_t incompressible_run = 0;
+    bool gave_up = false;
+    Clock::time_point last_progress = Clock::now();
+
+    bool has_rtt_sample = false;
+    std::chrono::microseconds smoothed_rtt{0};
+    std::chrono::microseconds rtt_variance{0};
+    std::chrono::microseconds retransmission_timeout = INITIAL_RTO;
+
+    std::unique_ptr<CongestionController> congestion;
+    TokenBucket pacer{PACING_BURST_CHUNKS * MAX_CHUNK_SIZE};
+};
@@ -1,13 +1,27 @@
 #include "UDPCommunicator.h"
 
+#include <algorithm>
+#include <utility>
 #include <thread>
 #include <random>
 #include <fstream>
 
 #include "ResourceManager.h"
 
-UDP_Communicator::UDP_Communicator(int port, ResourceManager &manager)
-    : resource_manager(manager), port(port)
+UDP_Communicator::UDP_Communicator(int port, ResourceManager &manager, size_t worker_threads,
+                                   std::chrono::seconds peer_ttl, CongestionAlgorithm congestion_algorithm,
+                                   RateLimits rate_limits, uint8_t fec_repair, Compression compression,
+                                   std::filesystem::path download_directory)
+    : resource_manager(manager), peer_tracker(peer_ttl), port(port), congestion_algorithm(congestion_algorithm),
+      fec_repair(static_cast<uint8_t>(std::min<size_t>(fec_repair, MAX_FEC_REPAIR_SYMBOLS))),
+      compression(compression_supported(compression) ? compression : Compression::NONE),
+      download_directory(std::move(download_directory)),
+      downloads(
+          this->download_directory, [this](const DownloadRequest &request) { issue_request(request); },
+          [this](const std::string &name, const std::filesystem::path &path,
+                 const std::shared_ptr<const ChunkHashes> &hashes) { on_download_complete(name, path, hashes); }),
+      uploads(rate_limits), packet_pool(WORKER_QUEUE_CAPACITY + worker_threads),
+      workers(worker_threads, WORKER_QUEUE_CAPACITY, [this](InboundPacket &packet) { process_packet(packet); })
 {
 
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -26,43 +40,218 @@ UDP_Communicator::UDP_Communicator(int port, ResourceManager &manager)
         close(sockfd);
         throw std::runtime_error("Failed to bind socket");
     }
+
+    // Chunks are sent back to back, so give the kernel room to queue a burst on both ends.
+    int buffer_size = SOCKET_BUFFER_SIZE;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    socket_features = std::make_unique<SocketFeatures>(sockfd);
+    receive_ring = std::make_unique<ReceiveRing>(sockfd, *socket_features);
+
+    event_loop.add_fd(sockfd, [this]() { dispatch_message(); });
+    retransmit_timer = event_loop.add_timer([this]() { process_timers(); });
+    broadcast_timer = event_loop.add_timer([this]() { send_broadcast_message(); });
+    download_timer = event_loop.add_timer([this]() { downloads.check_stalls(Clock::now()); });
+    event_loop.arm_periodic_timer(download_timer, DOWNLOAD_CHECK_INTERVAL);
+    expiry_timer = event_loop.add_timer([this]() { expire_peers(); });
+    event_loop.arm_periodic_timer(expiry_timer, PEER_EXPIRY_TICK);
+
+    catalog_epoch = std::random_device{}();
 }
 
 
 UDP_Communicator::~UDP_Communicator() {
-    stop_broadcast_thread();
+    stop();
     if (sockfd >= 0) {
         close(sockfd);
     }
 }
 
+void UDP_Communicator::start()
+{
+    if (!event_thread.joinable())
+    {
+        event_thread = std::thread([this]() { event_loop.run(); });
+    }
+}
+
+void UDP_Communicator::stop()
+{
+    event_loop.stop();
+    if (event_thread.joinable())
+    {
+        event_thread.join();
+    }
+    workers.stop();
+    stop_broadcast();
+}
+
+void UDP_Communicator::schedule_timers(Clock::time_point deadline)
+{
+    std::lock_guard<std::mutex> lock(timer_mutex);
+    if (deadline < armed_deadline)
+    {
+        armed_deadline = deadline;
+        event_loop.arm_timer_at(retransmit_timer, deadline);
+    }
+}
+
 void UDP_Communicator::send_request(const std::string &resource_name,
                                     const std::string &target_ip,
                                     uint16_t target_port)
 {
-    P2PRequestMessage request_message = {};
-    request_message.header.message_type = static_cast<uint8_t>(MessageType::REQUEST);
+    download(resource_name, {PeerEndpoint::parse(target_ip, target_port)});
+}
+
+void UDP_Communicator::download(const std::string &resource_name)
+{
+    // Broadcasts do not carry a port, every peer is expected to listen on the same one as we do.
+    std::vector<PeerEndpoint> peers;
+    for (const auto &ip : resource_manager.get_peers_with_resource(resource_name))
+    {
+        peers.push_back(PeerEndpoint::parse(ip, static_cast<uint16_t>(port)));
+    }
+    if (peers.empty())
+    {
+        throw std::invalid_argument("No peer advertises resource " + resource_name + ".");
+    }
+    download(resource_name, peer_tracker.select(std::move(peers)));
+}
+
+void UDP_Communicator::download(const std::string &resource_name, const std::vector<PeerEndpoint> &peers)
+{
+    if (!downloads.start(resource_name, peers))
+    {
+        throw std::invalid_argument("Resource " + resource_name + " is already being downloaded.");
+    }
+}
+
+size_t UDP_Communicator::download(const std::vector<std::string> &resource_names)
+{
+    {
+        std::lock_guard<std::mutex> lock(outbox_mutex);
+        ++outbox_holds;
+    }
+    size_t started = 0;
+    for (const auto &resource_name : resource_names)
+    {
+        try
+        {
+            download(resource_name);
+            ++started;
+        }
+        catch (const std::invalid_argument &)
+        {
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(outbox_mutex);
+        --outbox_holds;
+    }
+    schedule_timers(Clock::now());
+    return started;
+}
+
+void UDP_Communicator::issue_request(const DownloadRequest &request)
+{
+    // Requests travel over plain UDP as well; keep retrying until the peer answers.
+    PendingRequest pending;
+    pending.request = request;
+    pending.attempts = 1;
+    pending.first_sent = Clock::now();
+    pending.next_attempt = pending.first_sent + REQUEST_RETRY_INTERVAL;
+    {
+        std::lock_guard<std::mutex> lock(requests_mutex);
+        pending_requests[{request.peer, request.transfer_id}] = pending;
+    }
+    queue_request(request);
+}
 
+void UDP_Communicator::queue_request(const DownloadRequest &request)
+{
+    bool first;
+    {
+        std::lock_guard<std::mutex> lock(outbox_mutex);
+        first = outbox.empty();
+        outbox[request.peer].push_back(request);
+    }
+    // Whatever is issued until the event loop gets around to it goes out with this one.
+    if (first)
+    {
+        schedule_timers(Clock::now());
+    }
+}
 
+void UDP_Communicator::flush_requests()
+{
+    std::map<PeerEndpoint, std::vector<DownloadRequest>> requests;
+    {
+        std::lock_guard<std::mutex> lock(outbox_mutex);
+        if (outbox_holds > 0)
+        {
+            return;
+        }
+        requests.swap(outbox);
+    }
+    for (const auto &[peer, peer_requests] : requests)
+    {
+        try
+        {
+            if (peer_requests.size() == 1)
+            {
+                transmit_request(peer_requests.front());
+            }
+            else
+            {
+                transmit_batch(peer, peer_requests);
+            }
+        }
+        catch (const std::exception &e)
+        {
+            // Left for the retry timer.
+            std::cerr << "Error sending request: " << e.what() << std::endl;
+        }
+    }
+}
+
+P2PRequestMessage UDP_Communicator::build_request(const DownloadRequest &request) const
+{
+    P2PRequestMessage request_message = {};
+    request_message.header.message_type = static_cast<uint8_t>(MessageType::REQUEST);
+    request_message.request_type = static_cast<uint8_t>(request.type);
+    request_message.transfer_id = request.transfer_id;
+    request_message.offset = request.offset;
+    request_message.length = request.length;
+    if (request.type == RequestType::RANGE || request.type == RequestType::HASHES)
+    {
+        request_message.fec_repair = fec_repair;
+    }
+    if (request.type == RequestType::RANGE)
+    {
+        // Hash lists do not compress.
+        request_message.compression = static_cast<uint8_t>(compression);
+    }
     std::strncpy(request_message.resource_name,
-                 resource_name.c_str(),
+                 request.resource_name.c_str(),
                  sizeof(request_message.resource_name) - 1);
+    return request_message;
+}
 
+void UDP_Communicator::transmit_request(const DownloadRequest &request)
+{
+    P2PRequestMessage request_message = build_request(request);
     std::strncpy(request_message.additional_info,
                  "Requesting resource",
                  sizeof(request_message.additional_info) - 1);
 
-    sockaddr_in target_addr = {};
-    target_addr.sin_family = AF_INET;
-    target_addr.sin_port = htons(target_port);
-    if (inet_pton(AF_INET, target_ip.c_str(), &target_addr.sin_addr) <= 0)
-    {
-        throw std::runtime_error("Invalid target IP in send_request");
-    }
+    sockaddr_in target_addr = request.peer.to_sockaddr();
+
+    uint8_t encoded[MAX_DATAGRAM_SIZE];
+    size_t encoded_length = serialize(request_message, encoded, sizeof(encoded));
 
     ssize_t sent_bytes = sendto(sockfd,
-                                &request_message,
-                                sizeof(request_message),
+                                encoded,
+                                encoded_length,
                                 0,
                                 (struct sockaddr *)&target_addr,
                                 sizeof(target_addr));
@@ -71,243 +260,773 @@ void UDP_Communicator::send_request(const std::string &resource_name,
         throw std::runtime_error(std::string("Failed to send request: ") + strerror(errno));
     }
 
-    std::cout << "Request sent to " << target_ip << ":" << target_port
-              << " for resource: " << resource_name << std::endl;
+    if (request.type == RequestType::INFO)
+    {
+        std::cout << "Request sent to " << request.peer.to_string() << " for resource: " << request.resource_name
+                  << std::endl;
+    }
+}
+
+void UDP_Communicator::transmit_batch(const PeerEndpoint &peer, const std::vector<DownloadRequest> &requests)
+{
+    sockaddr_in target_addr = peer.to_sockaddr();
+    P2PRequestBatch batch = {};
+    batch.header.message_type = static_cast<uint8_t>(MessageType::REQUEST_BATCH);
+    size_t datagram_size = HEADER_WIRE_SIZE + BATCH_FIELDS_WIRE_SIZE;
+    size_t queries = 0;
+    auto send_batch = [&]() {
+        uint8_t encoded[MAX_DATAGRAM_SIZE];
+        size_t encoded_length = serialize(batch, encoded, sizeof(encoded));
+        if (sendto(sockfd, encoded, encoded_length, 0, reinterpret_cast<const sockaddr *>(&target_addr),
+                   sizeof(target_addr)) < 0)
+        {
+            throw std::runtime_error(std::string("Failed to send request batch: ") + strerror(errno));
+        }
+        batch.request_count = 0;
+        datagram_size = HEADER_WIRE_SIZE + BATCH_FIELDS_WIRE_SIZE;
+    };
+
+    for (const auto &request : requests)
+    {
+        size_t name_length = std::min(request.resource_name.size(), sizeof(P2PRequestMessage::resource_name) - 1);
+        size_t entry_size = BATCHED_REQUEST_WIRE_SIZE + name_length;
+        if (batch.request_count == MAX_BATCHED_REQUESTS || datagram_size + entry_size > MAX_DATAGRAM_SIZE)
+        {
+            send_batch();
+        }
+        batch.requests[batch.request_count++] = build_request(request);
+        datagram_size += entry_size;
+        if (request.type == RequestType::INFO)
+        {
+            ++queries;
+        }
+    }
+    send_batch();
+
+    if (queries > 0)
+    {
+        std::cout << "Requests sent to " << peer.to_string() << " for " << queries << " resources" << std::endl;
+    }
 }
 
 void UDP_Communicator::handle_request(const P2PRequestMessage& request_message, const sockaddr_in& sender_addr)
 {
     std::string requested_resource = request_message.resource_name;
-    std::string sender_ip = inet_ntoa(sender_addr.sin_addr);
-    uint16_t sender_port = ntohs(sender_addr.sin_port);
+    PeerEndpoint sender = PeerEndpoint::from_sockaddr(sender_addr);
+
+    if (request_message.request_type == static_cast<uint8_t>(RequestType::CATALOG))
+    {
+        send_advertisement(snapshot_advertisement(), sockfd, sender_addr);
+        return;
+    }
+
+    if (request_message.request_type == static_cast<uint8_t>(RequestType::RANGE) ||
+        request_message.request_type == static_cast<uint8_t>(RequestType::HASHES))
+    {
+        // A codec we do not have means the chunks go out as they are; the flag on each one tells the receiver.
+        auto requested_compression = static_cast<Compression>(request_message.compression);
+        send_file_sync(requested_resource, sender, request_message.transfer_id, request_message.offset,
+                       request_message.length, static_cast<RequestType>(request_message.request_type),
+                       request_message.fec_repair,
+                       compression_supported(requested_compression) ? requested_compression : Compression::NONE);
+        return;
+    }
+    if (request_message.request_type != static_cast<uint8_t>(RequestType::INFO))
+    {
+        return;
+    }
 
     std::cout << "Request received for resource: " << requested_resource
-              << " from " << sender_ip << ":" << sender_port << std::endl;
+              << " from " << sender.to_string() << std::endl;
 
-    if (resource_manager.has_resource(requested_resource))
+    try
     {
-        std::cout << "Resource found. Sending..." << std::endl;
-        send_file_sync(requested_resource, sender_ip, sender_port);
+        Resource resource = resource_manager.get_resource(requested_resource);
+        send_response(sender_addr, request_message.transfer_id, ResponseStatus::OK, resource.size, requested_resource,
+                      resource.hashes->root());
     }
-    else
+    catch (const std::invalid_argument &)
     {
-        std::cout << "Resource not found 2: " << requested_resource << std::endl;
+        std::cout << "Resource not found: " << requested_resource << std::endl;
+        send_response(sender_addr, request_message.transfer_id, ResponseStatus::NOT_FOUND, 0, requested_resource);
     }
 }
 
-void UDP_Communicator::send_to_host(const P2PDataMessage &message, const std::string &target_address, int target_port)
+void UDP_Communicator::send_response(const sockaddr_in &target, uint32_t transfer_id, ResponseStatus status,
+                                     uint64_t total_length, const std::string &resource_name,
+                                     const Digest &content_hash)
 {
-    sockaddr_in target_addr = {};
-    target_addr.sin_family = AF_INET;
-    target_addr.sin_port = htons(target_port);
-    if (inet_pton(AF_INET, target_address.c_str(), &target_addr.sin_addr) <= 0)
+    P2PResponseMessage response_message = {};
+    response_message.header.message_type = static_cast<uint8_t>(MessageType::RESPONSE);
+    response_message.transfer_id = transfer_id;
+    response_message.status_code = static_cast<uint8_t>(status);
+    response_message.total_length = total_length;
+    std::memcpy(response_message.content_hash, content_hash.data(), content_hash.size());
+    std::strncpy(response_message.resource_name, resource_name.c_str(), sizeof(response_message.resource_name) - 1);
+
+    uint8_t packet[MAX_DATAGRAM_SIZE];
+    size_t packet_length = serialize(response_message, packet, sizeof(packet));
+    if (sendto(sockfd, packet, packet_length, 0, reinterpret_cast<const sockaddr *>(&target), sizeof(target)) < 0)
     {
-        throw std::runtime_error("Invalid target address");
+        std::cerr << "Failed to send response: " << strerror(errno) << std::endl;
     }
+}
 
-    ssize_t sent_bytes = sendto(
-        sockfd,
-        &message,
-        sizeof(message),
-        0,
-        reinterpret_cast<sockaddr *>(&target_addr),
-        sizeof(target_addr));
+void UDP_Communicator::handle_response(const P2PResponseMessage& response_message, const sockaddr_in& sender_addr)
+{
+    PeerEndpoint sender = PeerEndpoint::from_sockaddr(sender_addr);
+    on_request_answered({sender, response_message.transfer_id});
+    downloads.on_response(sender, response_message);
+}
 
-    if (sent_bytes == -1)
+void UDP_Communicator::on_request_answered(const TransferKey &key)
+{
+    Clock::time_point now = Clock::now();
+    std::chrono::microseconds rtt{0};
     {
-        throw std::runtime_error(std::string("Failed to send data: ") + strerror(errno));
+        std::lock_guard<std::mutex> lock(requests_mutex);
+        auto pending = pending_requests.find(key);
+        if (pending == pending_requests.end())
+        {
+            return;
+        }
+        // Only requests sent once tell how long an answer takes; for the others it is not clear which was answered.
+        if (pending->second.attempts == 1)
+        {
+            rtt = std::chrono::duration_cast<std::chrono::microseconds>(now - pending->second.first_sent);
+        }
+        pending_requests.erase(pending);
     }
-    std::cout << "Data sent to " << target_address << ":" << target_port << std::endl;
+    peer_tracker.record_answer(key.peer.ip(), now, rtt);
 }
 
-void UDP_Communicator::send_file_sync(const std::string &resource_name,
-                                      const std::string &target_address,
-                                      uint16_t target_port)
+void UDP_Communicator::send_file_sync(const std::string &resource_name, const PeerEndpoint &target,
+                                      uint32_t transfer_id, uint64_t offset, uint64_t length, RequestType type,
+                                      uint8_t fec_repair, Compression compression)
 {
-    if (!resource_manager.has_resource(resource_name)) {
-        std::cerr << "Resource not found 1: " << resource_name << std::endl;
+    sockaddr_in target_addr = target.to_sockaddr();
+
+    // Looked up once: the resource may be removed concurrently, the returned storage stays valid regardless.
+    std::shared_ptr<const ResourceData> resource_data;
+    try
+    {
+        Resource resource = resource_manager.get_resource(resource_name);
+        // The hash list is served like any other resource data.
+        resource_data = type == RequestType::HASHES ? resource.hashes : resource.data;
+    }
+    catch (const std::invalid_argument &)
+    {
+        std::cerr << "Resource not found: " << resource_name << std::endl;
+        send_response(target_addr, transfer_id, ResponseStatus::NOT_FOUND, 0, resource_name);
         return;
     }
+    uint64_t chunk_count = range_chunk_count(resource_data->size(), offset, length);
+    if (chunk_count == 0 || chunk_count > UINT32_MAX)
+    {
+        send_response(target_addr, transfer_id, ResponseStatus::BAD_RANGE, resource_data->size(), resource_name);
+        return;
+    }
+
+    TransferKey key{target, transfer_id};
+    std::shared_ptr<OutgoingTransfer> transfer;
+    {
+        std::lock_guard<std::mutex> lock(outgoing_mutex);
+        if (outgoing_transfers.contains(key))
+        {
+            // A retried request for a transfer that is already under way.
+            return;
+        }
+        transfer = std::make_shared<OutgoingTransfer>(transfer_id, resource_name, std::move(resource_data), target,
+                                                      offset / MAX_CHUNK_SIZE, static_cast<uint32_t>(chunk_count),
+                                                      make_congestion_controller(congestion_algorithm), fec_repair,
+                                                      compression);
+        outgoing_transfers[key] = transfer;
+    }
 
-    const auto& resource_data = resource_manager.get_resource_data(resource_name);
+    // Only the initial window goes out here; acknowledgements and timers keep the transfer moving.
+    std::unique_lock<std::mutex> lock(transfer->mutex);
+    send_ready_chunks(transfer, lock);
+}
+
+static bool flush_batch(SendBatch &batch)
+{
+    try
+    {
+        batch.flush();
+        return true;
+    }
+    catch (const std::exception &e)
+    {
+        // Chunks that did not make it are left for the retransmission timer to pick up again.
+        std::cerr << "[send_file_sync] Error sending chunks: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+size_t UDP_Communicator::pump_transfer(OutgoingTransfer &transfer, size_t budget)
+{
+    sockaddr_in target_addr = transfer.target.to_sockaddr();
 
     P2PDataMessage data_message = {};
     data_message.header.message_type = static_cast<uint8_t>(MessageType::DATA);
-    std::strcpy(data_message.header.message_id, resource_name.c_str());
-    size_t to_copy = std::min<size_t>(resource_data.size(), sizeof(data_message.data));
-    data_message.data_length = to_copy;
-    std::memcpy(data_message.data, resource_data.data(), to_copy);
+    std::strncpy(data_message.header.message_id, transfer.resource_name.c_str(),
+                 sizeof(data_message.header.message_id) - 1);
+    data_message.transfer_id = transfer.transfer_id;
+    data_message.total_length = transfer.total_length();
+
+    // Payloads go to the kernel straight from the resource storage, only the fields before them are serialized.
+    SendBatch batch(sockfd, target_addr, *socket_features);
+    // Compressed chunks and repair symbols are written in here and stay put until the batch holding them has been
+    // flushed.
+    std::vector<std::vector<u_char>> payloads;
+    auto flush = [&]() {
+        bool flushed = flush_batch(batch);
+        payloads.clear();
+        return flushed;
+    };
+    uint32_t sequence;
+    size_t sent = 0;
+    auto now = Clock::now();
+    while (transfer.next_chunk(sequence, now) &&
+           HEADER_WIRE_SIZE + DATA_FIELDS_WIRE_SIZE + transfer.chunk_length(sequence) <= budget - sent)
+    {
+        bool ends_fec_block = transfer.ends_fec_block(sequence);
+        data_message.sequence = sequence;
+        data_message.offset = transfer.chunk_offset(sequence);
+        data_message.timestamp = timestamp_us(now);
+        data_message.flags = 0;
+        data_message.data_length = transfer.chunk_length(sequence);
+        data_message.data = transfer.chunk_data(sequence);
+        if (transfer.compression != Compression::NONE)
+        {
+            std::vector<u_char> &compressed = payloads.emplace_back(data_message.data_length);
+            size_t compressed_length = transfer.compress_chunk(sequence, compressor, compressed.data());
+            if (compressed_length > 0)
+            {
+                data_message.flags = DATA_FLAG_COMPRESSED;
+                data_message.data_length = static_cast<uint16_t>(compressed_length);
+                data_message.data = compressed.data();
+            }
+        }
 
-    try
+        size_t prefix_length = serialize_prefix(data_message, batch.next_prefix(), SendBatch::PREFIX_CAPACITY);
+        batch.push(prefix_length, data_message.data, data_message.data_length);
+        transfer.on_chunk_sent(sequence, data_message.data_length, now);
+        sent += HEADER_WIRE_SIZE + DATA_FIELDS_WIRE_SIZE + data_message.data_length;
+        if (batch.full() && !flush())
+        {
+            return sent;
+        }
+
+        // The repair symbols of a block follow its last chunk even if that overdraws the budget a little; they are
+        // never sent again.
+        uint32_t block = sequence - sequence % FEC_BLOCK_CHUNKS;
+        for (uint32_t repair = 0; ends_fec_block && repair < transfer.fec_repair; ++repair)
+        {
+            std::vector<u_char> &symbol = payloads.emplace_back(transfer.chunk_length(block));
+            transfer.encode_repair(block, repair, symbol.data());
+            P2PDataMessage repair_message = data_message;
+            repair_message.flags = DATA_FLAG_REPAIR;
+            repair_message.sequence = block;
+            repair_message.offset = repair;
+            repair_message.data_length = static_cast<uint16_t>(symbol.size());
+            repair_message.data = symbol.data();
+
+            prefix_length = serialize_prefix(repair_message, batch.next_prefix(), SendBatch::PREFIX_CAPACITY);
+            batch.push(prefix_length, repair_message.data, repair_message.data_length);
+            transfer.on_repair_sent(symbol.size(), now);
+            sent += HEADER_WIRE_SIZE + DATA_FIELDS_WIRE_SIZE + symbol.size();
+            if (batch.full() && !flush())
+            {
+                return sent;
+            }
+        }
+        now = Clock::now();
+    }
+    flush();
+    return sent;
+}
+
+void UDP_Communicator::send_ready_chunks(const std::shared_ptr<OutgoingTransfer> &transfer,
+                                         std::unique_lock<std::mutex> &transfer_lock)
+{
+    if (!uploads.limited())
     {
-        send_to_host(data_message, target_address, target_port);
+        pump_transfer(*transfer);
+        schedule_timers(transfer->next_wakeup(Clock::now()));
+        return;
     }
-    catch (const std::exception &e)
+    // Chunks that are ready wait for the scheduler, which arms the timer for when the limits let them out.
+    auto now = Clock::now();
+    Clock::time_point send_time = transfer->next_send_time(now);
+    bool ready = send_time <= now;
+    schedule_timers(ready ? transfer->next_timeout() : std::min(transfer->next_timeout(), send_time));
+    transfer_lock.unlock();
+    if (ready)
+    {
+        uploads.activate(transfer);
+        run_uploads();
+    }
+}
+
+void UDP_Communicator::run_uploads()
+{
+    Clock::time_point wakeup = uploads.run(Clock::now(), [this](OutgoingTransfer &transfer, size_t budget, bool &more) {
+        std::lock_guard<std::mutex> lock(transfer.mutex);
+        size_t sent = pump_transfer(transfer, budget);
+        auto now = Clock::now();
+        Clock::time_point send_time = transfer.next_send_time(now);
+        more = send_time <= now;
+        schedule_timers(more ? transfer.next_timeout() : std::min(transfer.next_timeout(), send_time));
+        return sent;
+    });
+    if (wakeup != Clock::time_point::max())
+    {
+        schedule_timers(wakeup);
+    }
+}
+
+void UDP_Communicator::handle_ack(const P2PAckMessage &ack_message, const sockaddr_in &sender_addr)
+{
+    TransferKey key{PeerEndpoint::from_sockaddr(sender_addr), ack_message.transfer_id};
+    std::shared_ptr<OutgoingTransfer> transfer;
     {
-        std::cerr << "[send_file_sync] Error sending chunk " << e.what() << std::endl;
+        std::lock_guard<std::mutex> lock(outgoing_mutex);
+        auto it = outgoing_transfers.find(key);
+        if (it == outgoing_transfers.end())
+        {
+            return;
+        }
+        transfer = it->second;
+    }
+
+    std::unique_lock<std::mutex> transfer_lock(transfer->mutex);
+    transfer->on_ack(ack_message.ack, ack_message.echo_timestamp, Clock::now());
+    if (!transfer->complete())
+    {
+        // A fresh RTT sample may have shortened the retransmission timeout, and whatever pacing held back goes out
+        // from the timer.
+        send_ready_chunks(transfer, transfer_lock);
         return;
     }
+    transfer_lock.unlock();
+
+    std::lock_guard<std::mutex> lock(outgoing_mutex);
+    outgoing_transfers.erase(key);
+}
+
+void UDP_Communicator::process_timers()
+{
+    {
+        std::lock_guard<std::mutex> lock(timer_mutex);
+        armed_deadline = Clock::time_point::max();
+    }
+    auto now = Clock::now();
+    Clock::time_point next_deadline = Clock::time_point::max();
 
-    std::cout << "[send_file_sync] Finished sending resource '" << resource_name << "'\n";
+    std::vector<std::shared_ptr<OutgoingTransfer>> transfers;
+    {
+        std::lock_guard<std::mutex> lock(outgoing_mutex);
+        transfers.reserve(outgoing_transfers.size());
+        for (const auto &[id, transfer] : outgoing_transfers)
+        {
+            transfers.push_back(transfer);
+        }
+    }
+    for (const auto &transfer : transfers)
+    {
+        std::unique_lock<std::mutex> transfer_lock(transfer->mutex);
+        bool timed_out = transfer->next_timeout() <= now;
+        if (timed_out)
+        {
+            transfer->on_timer(now);
+        }
+        if (transfer->failed())
+        {
+            transfer_lock.unlock();
+            std::cerr << "[send_file_sync] Giving up on resource '" << transfer->resource_name << "' for "
+                      << transfer->target.to_string() << std::endl;
+            std::lock_guard<std::mutex> lock(outgoing_mutex);
+            outgoing_transfers.erase({transfer->target, transfer->transfer_id});
+            continue;
+        }
+        if (timed_out || transfer->next_send_time(now) <= now)
+        {
+            send_ready_chunks(transfer, transfer_lock);
+            continue;
+        }
+        next_deadline = std::min(next_deadline, transfer->next_wakeup(now));
+    }
+
+    std::vector<PendingRequest> retries;
+    std::vector<TransferKey> unanswered;
+    {
+        std::lock_guard<std::mutex> lock(requests_mutex);
+        for (auto it = pending_requests.begin(); it != pending_requests.end();)
+        {
+            PendingRequest &request = it->second;
+            if (request.next_attempt > now)
+            {
+                ++it;
+                continue;
+            }
+            if (request.attempts >= MAX_REQUEST_ATTEMPTS)
+            {
+                unanswered.push_back(it->first);
+                it = pending_requests.erase(it);
+                continue;
+            }
+            request.next_attempt = now + REQUEST_RETRY_INTERVAL * (1 << request.attempts);
+            ++request.attempts;
+            retries.push_back(request);
+            ++it;
+        }
+        for (const auto &[key, request] : pending_requests)
+        {
+            next_deadline = std::min(next_deadline, request.next_attempt);
+        }
+    }
+    for (const auto &key : unanswered)
+    {
+        peer_tracker.record_failure(key.peer.ip());
+        downloads.on_request_failed(key);
+    }
+    for (const auto &pending : retries)
+    {
+        queue_request(pending.request);
+    }
+    flush_requests();
+
+    if (next_deadline != Clock::time_point::max())
+    {
+        schedule_timers(next_deadline);
+    }
+}
+
+void UDP_Communicator::send_ack(uint32_t transfer_id, uint64_t echo_timestamp, const SelectiveAck &ack,
+                                const sockaddr_in &target)
+{
+    P2PAckMessage ack_message = {};
+    ack_message.header.message_type = static_cast<uint8_t>(MessageType::ACK);
+    ack_message.transfer_id = transfer_id;
+    ack_message.echo_timestamp = echo_timestamp;
+    ack_message.ack = ack;
+
+    uint8_t packet[ACK_WIRE_SIZE];
+    size_t packet_length = serialize(ack_message, packet, sizeof(packet));
+    if (sendto(sockfd, packet, packet_length, 0, reinterpret_cast<const sockaddr *>(&target), sizeof(target)) < 0)
+    {
+        std::cerr << "Failed to send ACK: " << strerror(errno) << std::endl;
+    }
 }
 
 
 void UDP_Communicator::dispatch_message() {
-    char buffer[sizeof(P2PDataMessage)]; // Allocate enough space for the largest message
-    sockaddr_in sender_addr = {};
-    socklen_t sender_len = sizeof(sender_addr);
-
-    ssize_t received_bytes = recvfrom(
-        sockfd,
-        buffer,
-        sizeof(buffer),
-        0,
-        reinterpret_cast<sockaddr*>(&sender_addr),
-        &sender_len
-    );
-
-    if (received_bytes < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            // No data available; return without processing
+    size_t handled = 0;
+    while (handled < MAX_DATAGRAMS_PER_WAKEUP) {
+        size_t received = receive_ring->receive([this](const uint8_t *datagram, size_t length, const sockaddr_in &sender) {
+            dispatch_datagram(datagram, length, sender);
+        });
+        if (received == 0) {
             return;
         }
-        std::cerr << "Failed to receive data: " << strerror(errno) << std::endl;
+        handled += received;
+    }
+}
+
+void UDP_Communicator::dispatch_datagram(const uint8_t *buffer, size_t received_bytes, const sockaddr_in &sender_addr) {
+    // Only the header is decoded up front; message bodies are parsed straight out of the receive buffer
+    P2PHeader header;
+    if (!parse_header(buffer, received_bytes, header)) {
+        std::cerr << "Received datagram with an unknown protocol header." << std::endl;
         return;
     }
 
-    // Cast the buffer to a P2PHeader to inspect the message type
-    P2PHeader* header = reinterpret_cast<P2PHeader*>(buffer);
+    switch (header.message_type) {
+        case static_cast<int>(MessageType::REQUEST):
+        case static_cast<int>(MessageType::REQUEST_BATCH):
+        case static_cast<int>(MessageType::RESPONSE):
+        case static_cast<int>(MessageType::DATA): {
+            // Serving requests and writing chunks may block, so they are left to the worker pool.
+            InboundPacket packet;
+            packet.message_type = header.message_type;
+            packet.datagram = packet_pool.acquire();
+            packet.datagram.assign(buffer, received_bytes);
+            packet.sender_addr = sender_addr;
+            if (!workers.submit(std::move(packet))) {
+                std::cerr << "Worker queue full, dropping datagram." << std::endl;
+            }
+            break;
+        }
+        case static_cast<int>(MessageType::ACK): {
+            P2PAckMessage ack_message;
+            if (parse(buffer, received_bytes, ack_message)) {
+                handle_ack(ack_message, sender_addr);
+            } else {
+                std::cerr << "Received incomplete P2PAckMessage." << std::endl;
+            }
+            break;
+        }
+        case static_cast<int>(MessageType::BROADCAST): {
+            // A catalog snapshot we asked the sender for.
+            P2PBroadcastMessage advertisement;
+            if (parse(buffer, received_bytes, advertisement)) {
+                handle_advertisement(advertisement, sender_addr);
+            } else {
+                std::cerr << "Received malformed broadcast message." << std::endl;
+            }
+            break;
+        }
+        default:
+            std::cerr << "Unknown message type received: " << static_cast<int>(header.message_type) << std::endl;
+        break;
+    }
+}
+
+void UDP_Communicator::process_packet(InboundPacket &packet)
+{
+    const uint8_t *buffer = packet.datagram.data();
+    size_t length = packet.datagram.size();
 
-    switch (header->message_type) {
+    switch (packet.message_type) {
         case static_cast<int>(MessageType::REQUEST): {
-            if (received_bytes >= sizeof(P2PRequestMessage)) {
-                P2PRequestMessage* request_message = reinterpret_cast<P2PRequestMessage*>(buffer);
-                handle_request(*request_message, sender_addr);
+            P2PRequestMessage request_message;
+            if (parse(buffer, length, request_message)) {
+                handle_request(request_message, packet.sender_addr);
             } else {
                 std::cerr << "Received incomplete P2PRequestMessage." << std::endl;
             }
             break;
         }
+        case static_cast<int>(MessageType::REQUEST_BATCH): {
+            // Served in order, so the answers stream back to back.
+            P2PRequestBatch batch;
+            if (parse(buffer, length, batch)) {
+                for (size_t i = 0; i < batch.request_count; ++i) {
+                    handle_request(batch.requests[i], packet.sender_addr);
+                }
+            } else {
+                std::cerr << "Received malformed P2PRequestBatch." << std::endl;
+            }
+            break;
+        }
+        case static_cast<int>(MessageType::RESPONSE): {
+            P2PResponseMessage response_message;
+            if (parse(buffer, length, response_message)) {
+                handle_response(response_message, packet.sender_addr);
+            } else {
+                std::cerr << "Received incomplete P2PResponseMessage." << std::endl;
+            }
+            break;
+        }
         case static_cast<int>(MessageType::DATA): {
-            if (received_bytes >= sizeof(P2PDataMessage)) {
-                P2PDataMessage* data_message = reinterpret_cast<P2PDataMessage*>(buffer);
-                receive_data(*data_message, sender_addr);
+            P2PDataMessage data_message;
+            if (parse(buffer, length, data_message)) {
+                receive_data(data_message, packet.sender_addr);
             } else {
                 std::cerr << "Received incomplete P2PDataMessage." << std::endl;
             }
             break;
         }
         default:
-            std::cerr << "Unknown message type received: " << static_cast<int>(header->message_type) << std::endl;
-        break;
+            break;
     }
 }
 
 
-P2PDataMessage UDP_Communicator::receive_data(const P2PDataMessage& data_message, const sockaddr_in& sender_addr) {
-    std::cout << "Data received from "
-              << inet_ntoa(sender_addr.sin_addr) << ":" << ntohs(sender_addr.sin_port) << std::endl;
-    std::string name = data_message.header.message_id;
+static std::string endpoint_name(const sockaddr_in &address)
+{
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &address.sin_addr, ip, sizeof(ip));
+    return std::string(ip) + ":" + std::to_string(ntohs(address.sin_port));
+}
 
-    std::vector<u_char> data_vector;
-    size_t data_size = data_message.data_length;
+void UDP_Communicator::receive_data(const P2PDataMessage& received_message, const sockaddr_in& sender_addr) {
+    // Runs for every chunk, so nothing here allocates unless something goes wrong.
+    TransferKey key{PeerEndpoint::from_sockaddr(sender_addr), received_message.transfer_id};
+    std::shared_ptr<IncomingTransfer> transfer = downloads.find_transfer(key);
+    if (!transfer)
+    {
+        // Nobody asked for it, or the range has been given up on.
+        return;
+    }
 
-    if (data_size > sizeof(data_message.data)) {
-        data_size = sizeof(data_message.data);
+    // A compressed chunk is expanded on its own before anything else looks at it, and checked like any other after.
+    P2PDataMessage data_message = received_message;
+    u_char expanded[MAX_CHUNK_SIZE];
+    if (data_message.flags & DATA_FLAG_COMPRESSED)
+    {
+        size_t expanded_length =
+            compressor.expand(compression, data_message.data, data_message.data_length, expanded, sizeof(expanded));
+        if (expanded_length == 0)
+        {
+            std::cerr << "Dropping undecodable compressed chunk from " << key.peer.to_string() << std::endl;
+            return;
+        }
+        data_message.data_length = static_cast<uint16_t>(expanded_length);
+        data_message.data = expanded;
     }
 
-    data_vector.resize(data_size);
-    std::memcpy(data_vector.data(), data_message.data, data_size);
+    bool first_chunk;
+    bool range_complete;
+    {
+        std::lock_guard<std::mutex> transfer_lock(transfer->mutex);
+        bool repair = data_message.flags & DATA_FLAG_REPAIR;
+        if (repair ? !transfer->matches_repair(data_message) : !transfer->matches(data_message))
+        {
+            std::cerr << "Dropping inconsistent data chunk from " << key.peer.to_string() << std::endl;
+            return;
+        }
+        first_chunk = !std::exchange(transfer->request_answered, true);
 
-    resource_manager.add_received_resource(name, data_vector, true);
+        try
+        {
+            if (repair)
+            {
+                transfer->store_repair(data_message.sequence, static_cast<uint32_t>(data_message.offset),
+                                       data_message.data, data_message.data_length);
+            }
+            else if (transfer->store_chunk(data_message.sequence, data_message.data, data_message.data_length) ==
+                     ChunkResult::CORRUPT)
+            {
+                // The hole in the acknowledgement below gets just this chunk sent again.
+                std::cerr << "Chunk " << data_message.sequence << " of transfer " << data_message.transfer_id
+                          << " from " << key.peer.to_string() << " failed verification" << std::endl;
+            }
+        }
+        catch (const std::exception &e)
+        {
+            // Not acknowledged, so the sender will try this chunk again.
+            std::cerr << e.what() << std::endl;
+            return;
+        }
+        // Duplicates are acknowledged as well, the previous ACK may have been the one that got lost.
+        SelectiveAck ack = transfer->selective_ack();
+        send_ack(data_message.transfer_id, data_message.timestamp, ack, sender_addr);
+        range_complete = ack.cumulative_ack == transfer->chunk_count;
+    }
 
-    return data_message;
+    if (first_chunk)
+    {
+        on_request_answered(key);
+    }
+    if (range_complete)
+    {
+        downloads.on_range_complete(key);
+    }
 }
 
-
-void UDP_Communicator::send_broadcast_message() {
-    if (broadcast_running == false) {
-        return;
+void UDP_Communicator::on_download_complete(const std::string &resource_name, const std::filesystem::path &path,
+                                            const std::shared_ptr<const ChunkHashes> &hashes)
+{
+    try
+    {
+        resource_manager.add_received_resource(resource_name, path, hashes);
+        std::cout << "Resource '" << resource_name << "' received into " << path << std::endl;
     }
-
-    int broadcastEnable = 1;
-    if (setsockopt(broadcast_sock, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable)) < 0)
+    catch (const std::exception &e)
     {
-        perror("setsockopt failed");
-        close(broadcast_sock);
-        return;
+        std::cerr << "Failed to store received resource '" << resource_name << "': " << e.what() << std::endl;
     }
+}
 
-    P2PBroadcastMessage message = {};
-
-    message.header.message_type = static_cast<uint8_t>(MessageType::BROADCAST);
-    std::memcpy(message.header.sender_ip, &broadcast_address.sin_addr, 4);
-    message.header.sender_port = ntohs(broadcast_address.sin_port);
-
+Advertisement UDP_Communicator::snapshot_advertisement() const
+{
+    std::vector<RemoteResource> catalog;
+    uint32_t version = resource_manager.get_catalog(catalog);
+    return catalog_advertisement(std::move(catalog), catalog_epoch, version);
+}
 
-    std::string resources;
-    for (const auto &resource_name : resource_manager.get_resource_names())
+bool UDP_Communicator::send_advertisement(const Advertisement &advertisement, int socket, const sockaddr_in &target)
+{
+    for (auto &message : build_advertisement(advertisement))
     {
-        if (!resources.empty())
-        {
-            resources += ", ";
-        }
-        resources += resource_name;
-    }
+        std::memcpy(message.header.sender_ip, &broadcast_address.sin_addr, 4);
+        message.header.sender_port = ntohs(broadcast_address.sin_port);
 
-    snprintf(
-        message.broadcast_message,
-        sizeof(message.broadcast_message),
-        "Host %p broadcasts: %s", message.header.sender_ip, resources.c_str());
+        uint8_t packet[MAX_DATAGRAM_SIZE];
+        size_t packet_length = serialize(message, packet, sizeof(packet));
 
         ssize_t sent_bytes = sendto(
-            broadcast_sock,
-            &message,
-            sizeof(message),
+            socket,
+            packet,
+            packet_length,
             0,
-            (struct sockaddr*)&broadcast_address,
-    sizeof(broadcast_address)
+            (struct sockaddr*)&target,
+            sizeof(target)
         );
 
-    if (sent_bytes < 0)
+        if (sent_bytes < 0)
+        {
+            std::cerr << "Failed to send broadcast message: " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+void UDP_Communicator::send_broadcast_message() {
+    if (broadcast_running == false) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(advertise_mutex);
+    Advertisement advertisement;
+    advertisement.kind = AdvertKind::DELTA;
+    advertisement.epoch = catalog_epoch;
+    advertisement.base_version = advertised_version;
+    // With nothing changed this still goes out, empty, so peers that missed something find out.
+    if (!advertised || !resource_manager.get_catalog_changes(advertised_version, advertisement.changes,
+                                                            advertisement.version))
     {
-        std::cerr << "Failed to send broadcast message: " << strerror(errno) << std::endl;
+        advertisement = snapshot_advertisement();
     }
-    else
+
+    if (send_advertisement(advertisement, broadcast_sock, broadcast_address))
     {
-        std::cout << "Broadcast message sent: " << message.broadcast_message << std::endl;
+        advertised = true;
+        advertised_version = advertisement.version;
+        if (advertisement.summary)
+        {
+            std::cout << "Broadcast summary of catalog version " << advertisement.version << " in "
+                      << advertisement.summary->bytes().size() << " bytes" << std::endl;
+        }
+        else
+        {
+            const char *unit = advertisement.kind == AdvertKind::DELTA ? " change(s)" : " resource(s)";
+            std::cout << "Broadcast catalog version " << advertisement.version << " with "
+                      << advertisement.changes.size() << unit << std::endl;
+        }
     }
 }
 
-void UDP_Communicator::start_broadcast_thread()
+void UDP_Communicator::start_broadcast()
 {
     if (broadcast_running == true)
     {
-        std::cerr << "Broadcast thread is already running." << std::endl;
+        std::cerr << "Broadcast is already running." << std::endl;
         return;
     }
 
-    broadcast_running = true;
-
     broadcast_sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (broadcast_sock < 0)
     {
         std::cerr << "Failed to create socket." << strerror(errno) << std::endl;
-        broadcast_running = false;
         return;
     }
 
     memset(&broadcast_address, 0, sizeof(broadcast_address));
     broadcast_address.sin_family = AF_INET;
     broadcast_address.sin_addr.s_addr = inet_addr("255.255.255.255");
-    broadcast_address.sin_port = htons(8888);
+    broadcast_address.sin_port = htons(BROADCAST_PORT);
 
     int opt = 1;
-    if (setsockopt(broadcast_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+    if (setsockopt(broadcast_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        setsockopt(broadcast_sock, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(opt)) < 0)
     {
         std::cerr << "Failed to set socket options." << strerror(errno) << std::endl;
         close(broadcast_sock);
-        broadcast_running = false;
+        broadcast_sock = -1;
         return;
     }
 
@@ -315,63 +1034,123 @@ void UDP_Communicator::start_broadcast_thread()
     {
         std::cerr << "Failed to bind socket." << strerror(errno) << std::endl;
         close(broadcast_sock);
-        broadcast_running = false;
+        broadcast_sock = -1;
         return;
     }
 
-    broadcast_thread = std::thread([this]()
-                                   {
-        P2PBroadcastMessage receivedMessage;
+    broadcast_running = true;
+    event_loop.add_fd(broadcast_sock, [this]() { receive_broadcasts(); });
+    event_loop.arm_periodic_timer(broadcast_timer, BROADCAST_INTERVAL);
+}
+
+void UDP_Communicator::receive_broadcasts()
+{
+    P2PBroadcastMessage receivedMessage;
+    uint8_t buffer[MAX_DATAGRAM_SIZE];
 
-        while (broadcast_running) {
+    for (int i = 0; i < MAX_DATAGRAMS_PER_WAKEUP; ++i) {
 
-            sockaddr_in from_addr;
-            socklen_t from_addr_len = sizeof(from_addr);
+        sockaddr_in from_addr;
+        socklen_t from_addr_len = sizeof(from_addr);
 
-            ssize_t len = recvfrom(broadcast_sock, &receivedMessage, sizeof(receivedMessage), 0,
-                                (struct sockaddr *)&from_addr, &from_addr_len);
+        ssize_t len = recvfrom(broadcast_sock, buffer, sizeof(buffer), MSG_DONTWAIT,
+                            (struct sockaddr *)&from_addr, &from_addr_len);
 
-            if (len < 0) {
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
                 std::cerr << "recvfrom failed." << std::endl;
-                broadcast_running = false;
-                close(broadcast_sock);
-                return;
             }
+            return;
+        }
+
+        if (!parse(buffer, len, receivedMessage)) {
+            std::cerr << "Received malformed broadcast message." << std::endl;
+            continue;
+        }
 
-            char ip_str[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &from_addr.sin_addr, ip_str, INET_ADDRSTRLEN);
-            std::string sender_ip(ip_str);
-            std::vector<std::string> resources;
+        handle_advertisement(receivedMessage, from_addr);
+    }
+}
 
-            std::string message_str(receivedMessage.broadcast_message);
-            size_t pos = message_str.find(": ");
-            if (pos != std::string::npos)
+void UDP_Communicator::handle_advertisement(const P2PBroadcastMessage &message, const sockaddr_in &sender_addr)
+{
+    char ip_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &sender_addr.sin_addr, ip_str, INET_ADDRSTRLEN);
+    std::string sender_ip(ip_str);
+    Clock::time_point now = Clock::now();
+    peer_tracker.seen(sender_ip, now);
+
+    Advertisement advertisement;
+    switch (advertisements.add(sender_ip, message, now, advertisement))
+    {
+        case CatalogUpdate::NONE:
+            break;
+        case CatalogUpdate::SNAPSHOT: {
+            std::vector<RemoteResource> catalog;
+            catalog.reserve(advertisement.changes.size());
+            for (auto &change : advertisement.changes)
             {
-                std::string resource_list = message_str.substr(pos + 2);
-                size_t start = 0, end;
-                while ((end = resource_list.find(", ", start)) != std::string::npos)
-                {
-                    resources.push_back(resource_list.substr(start, end - start));
-                    start = end + 2;
-                }
-                resources.push_back(resource_list.substr(start));
+                catalog.push_back(std::move(change.resource));
             }
-            resource_manager.add_remote_resource(sender_ip, resources);
-
-
-            std::cout << "Received broadcast message: " << receivedMessage.broadcast_message << "\n";
+            resource_manager.add_remote_resource(sender_ip, catalog);
+            std::cout << "Received catalog version " << advertisement.version << " of " << catalog.size()
+                      << " resource(s) from " << sender_ip << "\n";
+            break;
         }
+        case CatalogUpdate::SUMMARY:
+            std::cout << "Received summary of catalog version " << advertisement.version << " from " << sender_ip
+                      << "\n";
+            resource_manager.add_remote_summary(sender_ip, std::move(*advertisement.summary));
+            break;
+        case CatalogUpdate::DELTA:
+            resource_manager.apply_remote_changes(sender_ip, advertisement.changes);
+            if (!advertisement.changes.empty())
+            {
+                std::cout << "Received catalog version " << advertisement.version << " with "
+                          << advertisement.changes.size() << " change(s) from " << sender_ip << "\n";
+            }
+            break;
+        case CatalogUpdate::GAP:
+            request_catalog(sender_addr);
+            break;
+    }
+}
 
-        close(broadcast_sock);
-        broadcast_running = false;
-    });
+void UDP_Communicator::expire_peers()
+{
+    for (const auto &ip : peer_tracker.expire(Clock::now()))
+    {
+        advertisements.forget(ip);
+        resource_manager.remove_remote_peer(ip);
+        std::cout << "Peer " << ip << " has not been heard from for too long, forgetting its resources" << std::endl;
+    }
 }
 
+void UDP_Communicator::request_catalog(const sockaddr_in &sender_addr)
+{
+    P2PRequestMessage request_message = {};
+    request_message.header.message_type = static_cast<uint8_t>(MessageType::REQUEST);
+    request_message.request_type = static_cast<uint8_t>(RequestType::CATALOG);
 
+    // Like downloads, this relies on every peer listening on the same port as we do.
+    sockaddr_in target_addr = sender_addr;
+    target_addr.sin_port = htons(port);
 
-void UDP_Communicator::stop_broadcast_thread() {
-    broadcast_running = false;
-    if (broadcast_thread.joinable()) {
-        broadcast_thread.join();
+    uint8_t encoded[MAX_DATAGRAM_SIZE];
+    size_t encoded_length = serialize(request_message, encoded, sizeof(encoded));
+    if (sendto(sockfd, encoded, encoded_length, 0, reinterpret_cast<const sockaddr *>(&target_addr),
+               sizeof(target_addr)) < 0)
+    {
+        std::cerr << "Failed to request catalog: " << strerror(errno) << std::endl;
+    }
+}
+
+void UDP_Communicator::stop_broadcast() {
+    if (!broadcast_running.exchange(false)) {
+        return;
     }
+    event_loop.disarm_timer(broadcast_timer);
+    event_loop.remove_fd(broadcast_sock);
+    close(broadcast_sock);
+    broadcast_sock = -1;
 }
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <chrono>
+#include <filesystem>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -11,95 +12,249 @@
 #include <cstring>
 #include <iostream>
 #include <bits/std_thread.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "Advertisement.h"
+#include "Compression.h"
+#include "DatagramBatch.h"
+#include "DownloadManager.h"
+#include "EventLoop.h"
+#include "PacketPool.h"
+#include "PeerTracker.h"
+#include "Protocol.h"
 #include "ResourceManager.h"
+#include "Transfer.h"
+#include "UploadScheduler.h"
+#include "WorkerPool.h"
 
+constexpr int SOCKET_BUFFER_SIZE = 4 * 1024 * 1024;
+constexpr uint16_t BROADCAST_PORT = 8888;
+constexpr std::chrono::seconds BROADCAST_INTERVAL{30};
+// Datagrams read per readiness event before other sockets and timers get their turn.
+constexpr int MAX_DATAGRAMS_PER_WAKEUP = 64;
+constexpr std::chrono::seconds REQUEST_RETRY_INTERVAL{1};
+constexpr int MAX_REQUEST_ATTEMPTS = 5;
+constexpr std::chrono::seconds DOWNLOAD_CHECK_INTERVAL{1};
+constexpr size_t DEFAULT_WORKER_THREADS = 4;
+// Datagrams waiting for a worker; anything beyond this is dropped and left to the sender's retransmission.
+constexpr size_t WORKER_QUEUE_CAPACITY = 4096;
 
-enum class MessageType {
-    REQUEST,
-    DATA,
-    BROADCAST,
-};
-
-struct P2PHeader {
-    uint8_t message_type;
-    char message_id[32];
-    uint8_t sender_ip[4];
-    uint16_t sender_port;
-    uint8_t receiver_ip[4];
-    uint16_t receiver_port;
-};
-
-struct P2PBroadcastMessage
-{
-    P2PHeader header;
-    char broadcast_message[256];
-};
-
-struct P2PRequestMessage
+struct PendingRequest
 {
-    P2PHeader header;
-    char resource_name[64];
-    char additional_info[128];
+    DownloadRequest request;
+    int attempts = 0;
+    Clock::time_point first_sent;
+    Clock::time_point next_attempt;
 };
 
-struct P2PResponseMessage
+// A datagram handed from the receiving thread to a worker.
+struct InboundPacket
 {
-    P2PHeader header;
-    char resource_name[64];
-    uint8_t status_code;
-    char response_data[512];
-};
-
-struct P2PDataMessage
-{
-    P2PHeader header;
-    size_t data_length;
-    char data[32000];
+    uint8_t message_type = 0;
+    PacketBuffer datagram;
+    sockaddr_in sender_addr = {};
 };
 
 class UDP_Communicator
 {
 public:
-    UDP_Communicator(int port, ResourceManager &manager);
+    UDP_Communicator(int port, ResourceManager &manager, size_t worker_threads = DEFAULT_WORKER_THREADS,
+                     std::chrono::seconds peer_ttl = DEFAULT_PEER_TTL,
+                     CongestionAlgorithm congestion_algorithm = CongestionAlgorithm::CUBIC, RateLimits rate_limits = {},
+                     uint8_t fec_repair = 0, Compression compression = Compression::NONE,
+                     std::filesystem::path download_directory = "downloads");
 
     ~UDP_Communicator();
 
-    void send_broadcast_message();
+    // Runs the event loop serving all sockets and timers on a background thread.
+    void start();
 
-    void start_broadcast_thread();
+    // Stops the event loop and the workers. Called by the destructor as well.
+    void stop();
 
-    void stop_broadcast_thread();
+    // Announces what changed in our catalog since the previous announcement, or all of it if that is no longer
+    // known, in as many datagrams as it takes.
+    void send_broadcast_message();
+
+    // Starts listening for advertisements from other peers and announcing ours every BROADCAST_INTERVAL.
+    void start_broadcast();
 
-    void send_to_host(const P2PDataMessage &message, const std::string &target_address, int target_port);
+    void stop_broadcast();
 
-    void send_file_sync(const std::string &resource_name, const std::string &target_address, uint16_t target_port);
+    // Starts sending a range of the resource, or of its chunk hash list, to target, or tells it why not. Every FEC block
+    // of the range is followed by fec_repair repair symbols, and chunks that shrink go out compressed with compression.
+    void send_file_sync(const std::string &resource_name, const PeerEndpoint &target, uint32_t transfer_id,
+                        uint64_t offset, uint64_t length, RequestType type = RequestType::RANGE,
+                        uint8_t fec_repair = 0, Compression compression = Compression::NONE);
 
+    // Reads the datagrams waiting on the communication socket.
     void dispatch_message();
 
-    P2PDataMessage receive_data(const P2PDataMessage& data_message, const sockaddr_in& sender_addr);
+    void receive_data(const P2PDataMessage& received_message, const sockaddr_in& sender_addr);
 
+    // Downloads the resource from the one peer given.
     void send_request(const std::string &resource_name, const std::string &target_ip, uint16_t target_port);
 
+    // Downloads the resource from every healthy peer that has, or by its summary may have, it, fastest first. Throws
+    // std::invalid_argument if there is none, or if the resource is already being downloaded.
+    void download(const std::string &resource_name);
+
+    void download(const std::string &resource_name, const std::vector<PeerEndpoint> &peers);
+
+    // Downloads every resource named, skipping those no peer advertises or already being downloaded, and returns
+    // how many it started. Their first requests to each peer go out batched together.
+    size_t download(const std::vector<std::string> &resource_names);
+
     void handle_request(const P2PRequestMessage& request_message, const sockaddr_in& sender_addr);
 
+    void handle_response(const P2PResponseMessage& response_message, const sockaddr_in& sender_addr);
+
+    void handle_ack(const P2PAckMessage& ack_message, const sockaddr_in& sender_addr);
+
+    void process_timers();
+
+    PacketPoolStats packet_pool_stats() const { return packet_pool.stats(); }
+
+    std::map<std::string, PeerStats> peer_stats() const { return peer_tracker.stats(); }
+
+    CompressionStats compression_stats() const { return compressor.stats(); }
 
 private:
+    void send_ack(uint32_t transfer_id, uint64_t echo_timestamp, const SelectiveAck &ack, const sockaddr_in &target);
+
+    void send_response(const sockaddr_in &target, uint32_t transfer_id, ResponseStatus status,
+                       uint64_t total_length, const std::string &resource_name, const Digest &content_hash = {});
+
+    // Sends a request on behalf of a download and keeps retrying it until the peer answers.
+    void issue_request(const DownloadRequest &request);
+
+    // Puts a request in the outbox, for the event loop to send along with whatever else is in there for the peer.
+    void queue_request(const DownloadRequest &request);
+
+    // Sends the requests in the outbox, those to the same peer batched together. Does nothing while requests are
+    // held back.
+    void flush_requests();
+
+    P2PRequestMessage build_request(const DownloadRequest &request) const;
+
+    void transmit_request(const DownloadRequest &request);
+
+    // Sends requests to the peer in as few P2PRequestBatch datagrams as they fit in.
+    void transmit_batch(const PeerEndpoint &peer, const std::vector<DownloadRequest> &requests);
+
+    void on_download_complete(const std::string &resource_name, const std::filesystem::path &path,
+                              const std::shared_ptr<const ChunkHashes> &hashes);
+
+    // Sends whatever the transfer's window allows, up to budget bytes of datagrams, and returns how many bytes went
+    // out; the caller holds transfer.mutex.
+    size_t pump_transfer(OutgoingTransfer &transfer, size_t budget = SIZE_MAX);
+
+    // Sends what the transfer has ready, right away or through the upload scheduler when rates are limited, and
+    // arms its timers. Called with transfer_lock held on the transfer's mutex, which it may release.
+    void send_ready_chunks(const std::shared_ptr<OutgoingTransfer> &transfer,
+                           std::unique_lock<std::mutex> &transfer_lock);
+
+    // Lets the upload scheduler send from the queued transfers.
+    void run_uploads();
+
+    void dispatch_datagram(const uint8_t *buffer, size_t received_bytes, const sockaddr_in &sender_addr);
+
+    void process_packet(InboundPacket &packet);
+
+    void receive_broadcasts();
+
+    // Takes an advertisement datagram into our copy of the sender's catalog. Only called on the event loop thread.
+    void handle_advertisement(const P2PBroadcastMessage &message, const sockaddr_in &sender_addr);
+
+    // Asks the peer that sent an advertisement from sender_addr for a snapshot of its catalog.
+    void request_catalog(const sockaddr_in &sender_addr);
+
+    Advertisement snapshot_advertisement() const;
+
+    // Returns false if a datagram could not be sent.
+    bool send_advertisement(const Advertisement &advertisement, int socket, const sockaddr_in &target);
+
+    // Forgets the resources of peers not heard from for their ttl.
+    void expire_peers();
+
+    // Takes a request off the retry list once the peer answered it.
+    void on_request_answered(const TransferKey &key);
+
+    // Makes sure process_timers() runs no later than deadline.
+    void schedule_timers(Clock::time_point deadline);
+
     int port;
+    // Every outgoing transfer gets a controller of its own, so concurrent transfers share the path like separate flows.
+    CongestionAlgorithm congestion_algorithm;
+    // Repair symbols per FEC block our range requests ask for, 0 to go without FEC.
+    uint8_t fec_repair;
+    // Codec our range requests ask senders to compress chunks with.
+    Compression compression;
+    // Compresses the chunks we send and expands those we receive.
+    ChunkCompressor compressor;
 
     int sockfd;
     struct sockaddr_in address
     {
     };
+    std::unique_ptr<SocketFeatures> socket_features;
+    // Only touched by the event loop thread.
+    std::unique_ptr<ReceiveRing> receive_ring;
 
-    int data_sock;
-    sockaddr_in data_address;
-
-    int broadcast_sock;
+    int broadcast_sock = -1;
     struct sockaddr_in broadcast_address
     {
     };
     mutable std::atomic<bool> broadcast_running;
-    std::thread broadcast_thread;
+    // Random, so peers notice when we restart and start numbering catalog versions over.
+    uint32_t catalog_epoch;
+    std::mutex advertise_mutex;
+    // The catalog version our last announcement brought peers to, if there was one.
+    bool advertised = false;
+    uint32_t advertised_version = 0;
+    // Only touched by the event loop thread.
+    AdvertisementAssembler advertisements;
+
+    EventLoop event_loop;
+    std::thread event_thread;
+    int retransmit_timer;
+    int broadcast_timer;
+    int download_timer;
+    int expiry_timer;
+    std::mutex timer_mutex;
+    Clock::time_point armed_deadline = Clock::time_point::max();
+
+    // Received resources are written here and served from there afterwards.
+    std::filesystem::path download_directory;
+
+    // Owns the receiving side of every transfer.
+    DownloadManager downloads;
+
+    // The map mutex only guards lookups; each transfer has its own mutex, so workers serving different transfers
+    // do not wait on each other.
+    std::mutex outgoing_mutex;
+    std::map<TransferKey, std::shared_ptr<OutgoingTransfer>> outgoing_transfers;
+
+    std::mutex requests_mutex;
+    std::map<TransferKey, PendingRequest> pending_requests;
+
+    // Requests waiting to go out, by peer, so those issued at about the same time share datagrams; sent by the event
+    // loop unless outbox_holds says a caller is about to add more.
+    std::mutex outbox_mutex;
+    std::map<PeerEndpoint, std::vector<DownloadRequest>> outbox;
+    size_t outbox_holds = 0;
 
     ResourceManager &resource_manager;
+
+    PeerTracker peer_tracker;
+
+    // Only in the way of sending when rate limits are set.
+    UploadScheduler uploads;
+
+    // Datagrams waiting for or being handled by a worker live in here.
+    PacketPool packet_pool;
+
+    // Declared last so the workers are stopped before anything they use is torn down.
+    WorkerPool<InboundPacket> workers;
 };
@@ -0,0 +1,112 @@
+#include "UploadScheduler.h"
+
+#include <algorithm>
+
+static size_t burst_for(uint64_t rate)
+{
+    auto burst = static_cast<size_t>(rate * std::chrono::duration<double>(UPLOAD_BURST).count());
+    return std::max(burst, 4 * UPLOAD_QUANTUM);
+}
+
+UploadScheduler::UploadScheduler(RateLimits limits) : limits(limits), global(burst_for(limits.upload))
+{
+    global.set_rate(static_cast<double>(limits.upload), Clock::now());
+}
+
+UploadScheduler::PeerQueue &UploadScheduler::peer_queue(const std::string &peer, Clock::time_point now)
+{
+    auto it = peers.find(peer);
+    if (it == peers.end())
+    {
+        it = peers.emplace(peer, burst_for(limits.peer_upload)).first;
+        it->second.bucket.set_rate(static_cast<double>(limits.peer_upload), now);
+    }
+    return it->second;
+}
+
+void UploadScheduler::activate(const std::shared_ptr<OutgoingTransfer> &transfer)
+{
+    std::string peer = transfer->target.ip();
+    std::lock_guard<std::mutex> lock(mutex);
+    PeerQueue &queue = peer_queue(peer, Clock::now());
+    if (std::find(queue.transfers.begin(), queue.transfers.end(), transfer) != queue.transfers.end())
+    {
+        return;
+    }
+    if (queue.transfers.empty())
+    {
+        turns.push_back(peer);
+    }
+    queue.transfers.push_back(transfer);
+}
+
+Clock::time_point UploadScheduler::run(Clock::time_point now, const Sender &send)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Clock::time_point wakeup = Clock::time_point::max();
+    // Turns in a row that sent nothing; once every peer has had one, only time can change that.
+    size_t idle_turns = 0;
+    while (!turns.empty() && idle_turns < turns.size())
+    {
+        size_t global_budget = global.available(now);
+        if (global_budget < MAX_DATAGRAM_SIZE)
+        {
+            wakeup = std::min(wakeup, global.ready_at(MAX_DATAGRAM_SIZE, now));
+            break;
+        }
+
+        std::string peer = std::move(turns.front());
+        turns.pop_front();
+        PeerQueue &queue = peers.at(peer);
+        size_t peer_budget = queue.bucket.available(now);
+        if (peer_budget < MAX_DATAGRAM_SIZE)
+        {
+            // A peer waiting for its own limit does not build up deficit meanwhile.
+            wakeup = std::min(wakeup, queue.bucket.ready_at(MAX_DATAGRAM_SIZE, now));
+            turns.push_back(std::move(peer));
+            ++idle_turns;
+            continue;
+        }
+
+        queue.deficit += UPLOAD_QUANTUM;
+        size_t budget = std::min({queue.deficit, peer_budget, global_budget});
+        size_t remaining = budget;
+        // Each transfer of the peer gets an equal part of the turn; those not reached go first next time.
+        for (size_t count = queue.transfers.size(); count > 0 && remaining >= MAX_DATAGRAM_SIZE; --count)
+        {
+            std::shared_ptr<OutgoingTransfer> transfer = std::move(queue.transfers.front());
+            queue.transfers.pop_front();
+            bool more = false;
+            size_t share = std::max(remaining / count, MAX_DATAGRAM_SIZE);
+            remaining -= std::min(remaining, send(*transfer, share, more));
+            if (more)
+            {
+                queue.transfers.push_back(std::move(transfer));
+            }
+        }
+        size_t sent = budget - remaining;
+        queue.bucket.consume(sent, now);
+        global.consume(sent, now);
+        idle_turns = sent > 0 ? 0 : idle_turns + 1;
+
+        if (queue.transfers.empty())
+        {
+            // An idle peer starts over, but keeps its bucket until it has filled up again.
+            queue.deficit = 0;
+            continue;
+        }
+        // Whatever a limit kept the peer from using carries over, up to one more turn's worth.
+        queue.deficit = std::min(queue.deficit - std::min(queue.deficit, sent), UPLOAD_QUANTUM);
+        turns.push_back(std::move(peer));
+    }
+
+    if (now - last_sweep >= UPLOAD_SWEEP_INTERVAL)
+    {
+        last_sweep = now;
+        std::erase_if(peers, [&](const auto &entry) {
+            const PeerQueue &queue = entry.second;
+            return queue.transfers.empty() && queue.bucket.available(now) >= burst_for(limits.peer_upload);
+        });
+    }
+    return wakeup;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "CongestionControl.h"
+#include "Transfer.h"
+
+// Bytes a peer may send per turn of the round robin, on top of whatever it did not use of its previous turns.
+constexpr size_t UPLOAD_QUANTUM = 8 * MAX_DATAGRAM_SIZE;
+// The limits allow bursts of this long at the limited rate, but never less than a few quanta.
+constexpr std::chrono::milliseconds UPLOAD_BURST{20};
+// Peers that stopped downloading are forgotten this often, once their buckets have filled up.
+constexpr std::chrono::seconds UPLOAD_SWEEP_INTERVAL{10};
+
+// Upload bandwidth caps in bytes per second of datagrams on the wire, 0 meaning unlimited.
+struct RateLimits
+{
+    uint64_t upload = 0;
+    uint64_t peer_upload = 0;
+
+    bool limited() const { return upload > 0 || peer_upload > 0; }
+};
+
+// Shares limited upload bandwidth between the peers we send to by deficit round robin: every peer with chunks ready
+// takes its turn sending up to its deficit, so each one gets an equal share however many transfers it runs, and the
+// transfers of one peer take turns in the same way. A global and a per-peer token bucket cap the rates. Safe for
+// concurrent use; one thread at a time does the sending.
+class UploadScheduler
+{
+public:
+    // Sends what it can of the transfer within budget and returns the bytes that went out. Sets more if the
+    // transfer has chunks ready to go right away still. Called with the scheduler's lock held.
+    using Sender = std::function<size_t(OutgoingTransfer &transfer, size_t budget, bool &more)>;
+
+    explicit UploadScheduler(RateLimits limits);
+
+    bool limited() const { return limits.limited(); }
+
+    // Queues a transfer that has chunks ready to go, if it is not queued already.
+    void activate(const std::shared_ptr<OutgoingTransfer> &transfer);
+
+    // Sends from the queued transfers until the limits or their windows stop them. Returns when the limits let
+    // queued transfers send again, Clock::time_point::max() if none is waiting for the limits.
+    Clock::time_point run(Clock::time_point now, const Sender &send);
+
+private:
+    struct PeerQueue
+    {
+        explicit PeerQueue(size_t burst) : bucket(burst) {}
+
+        TokenBucket bucket;
+        std::deque<std::shared_ptr<OutgoingTransfer>> transfers;
+        size_t deficit = 0;
+    };
+
+    PeerQueue &peer_queue(const std::string &peer, Clock::time_point now);
+
+    const RateLimits limits;
+    std::mutex mutex;
+    TokenBucket global;
+    std::map<std::string, PeerQueue> peers;
+    // Peers with queued transfers, in the order of their turns.
+    std::deque<std::string> turns;
+    Clock::time_point last_sweep = Clock::now();
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <semaphore>
+#include <thread>
+#include <vector>
+
+#include "BoundedQueue.h"
+
+// A fixed set of threads running handler on submitted jobs. Jobs wait in a lock-free bounded queue; idle workers
+// sleep on a semaphore so they cost nothing while there is no work.
+template<typename Job>
+class WorkerPool
+{
+public:
+    WorkerPool(size_t thread_count, size_t queue_capacity, std::function<void(Job &)> handler) :
+        queue(queue_capacity), handler(std::move(handler))
+    {
+        for (size_t i = 0; i < std::max<size_t>(1, thread_count); ++i)
+        {
+            threads.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~WorkerPool() { stop(); }
+
+    // Waits for the workers to finish their current job; jobs still queued are dropped. Safe to call repeatedly.
+    void stop()
+    {
+        if (!running.exchange(false))
+        {
+            return;
+        }
+        available.release(static_cast<std::ptrdiff_t>(threads.size()));
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    // Returns false when the queue is full; the caller decides whether to drop the job.
+    bool submit(Job &&job)
+    {
+        if (!queue.try_push(std::move(job)))
+        {
+            return false;
+        }
+        available.release();
+        return true;
+    }
+
+    size_t size() const { return threads.size(); }
+
+private:
+    void run()
+    {
+        Job job;
+        while (true)
+        {
+            available.acquire();
+            if (!running)
+            {
+                return;
+            }
+            // Every release follows a completed push, so an item is there even if another worker raced us to the
+            // one that was released for us.
+            while (!queue.try_pop(job))
+            {
+                std::this_thread::yield();
+            }
+            try
+            {
+                handler(job);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error handling request: " << e.what() << std::endl;
+            }
+            // Let go of whatever the job holds instead of keeping it until the next one arrives.
+            job = Job();
+        }
+    }
+
+    BoundedQueue<Job> queue;
+    std::function<void(Job &)> handler;
+    std::counting_semaphore<> available{0};
+    std::atomic<bool> running{true};
+    std::vector<std::thread> threads;
+};
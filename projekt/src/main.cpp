@@ -1,229 +1,475 @@
-#include <filesystem>
-#include <iostream>
-#include <limits>
-#include <string>
-#include <iomanip>
-
-#include "ResourceManager.h"
-#include "exceptions/FileNotFoundException.h"
-#include "UDPCommunicator.h"
-
-const uint16_t BROADCAST_PORT = 8888;
-const uint16_t COMMUNICATION_PORT = 5555;
-
-
-void print_choices()
-{
-    std::cout << "1. Add resource" << std::endl;
-    std::cout << "2. Remove resource" << std::endl;
-    std::cout << "3. Display resources" << std::endl;
-    std::cout << "4. Display remote resources" << std::endl;
-    std::cout << "5. Broadcast" << std::endl;
-    std::cout << "6. Exit program" << std::endl;
-    std::cout << "7. Send request" << std::endl;
-    std::cout << std::endl;
-}
-
-void print_formatted_resources(const std::map<std::string, Resource> &resources)
-{
-    std::cout << std::left << std::setw(5) << "" << std::setw(20) << "Resource Name" << std::setw(15) << "Size (bytes)"
-              << std::setw(25) << "Time of Addition" << std::endl;
-    std::cout << std::string(65, '-') << std::endl;
-
-    int counter = 1;
-    for (const auto &resource : resources)
-    {
-        std::time_t time = std::chrono::system_clock::to_time_t(resource.second.time_of_addition);
-
-        std::cout << std::left << std::setw(5) << counter++ << std::setw(20) << resource.first << std::setw(15)
-                  << resource.second.size << std::setw(25) << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S")
-                  << std::endl;
-    }
-    std::cout << std::endl;
-}
-
-void print_formated_remote_resources(const std::map<std::string, std::vector<std::string>> &remote_resources)
-{
-    std::cout << std::left << std::setw(5) << "" << std::setw(20) << "IP Address" << std::setw(25) << "Resources" << std::endl;
-    std::cout << std::string(50, '-') << std::endl;
-
-    int counter = 1;
-    for (const auto &remote_resource : remote_resources)
-    {
-        std::string resource_list;
-        for (const auto &resource : remote_resource.second)
-        {
-            if (!resource_list.empty())
-            {
-                resource_list += ", ";
-            }
-            resource_list += resource;
-        }
-        std::cout << std::left << std::setw(5) << counter++ << std::setw(20) << remote_resource.first << std::setw(25) << resource_list << std::endl;
-    }
-    std::cout << std::endl;
-}
-
-int main(int argc, char *argv[])
-{
-    ResourceManager manager;
-    UDP_Communicator udp_communicator(COMMUNICATION_PORT, manager);
-    std::cout << "UDP Communicator initialized on port " << COMMUNICATION_PORT << std::endl;
-    std::cout << "Current working directory: " << std::filesystem::current_path() << std::endl;
-
-    udp_communicator.start_broadcast_thread();
-
-    std::thread dispatch_message_handler([&udp_communicator]()
-                                {
-        while (true) {
-            try {
-                udp_communicator.dispatch_message();
-            } catch (const std::exception& e) {
-                std::cerr << "Error handling request: " << e.what() << std::endl;
-            }
-        } });
-    dispatch_message_handler.detach();
-
-    while (true)
-    {
-        print_choices();
-        std::cout << "Enter choice number: ";
-        int choice;
-
-        if (!(std::cin >> choice))
-        {
-            std::cout << std::endl;
-            std::cout << "Invalid choice. Please enter a valid number." << std::endl;
-            std::cout << std::endl;
-            std::cin.clear();
-            std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-            continue;
-        }
-        std::cout << std::endl;
-
-        if (choice == 1)
-        {
-            std::string name;
-            std::string path;
-            std::cout << "Enter resource name: ";
-            std::cin >> name;
-            std::cout << "Enter resource path: ";
-            std::cin >> path;
-            std::cout << std::endl;
-            try
-            {
-                manager.add_local_resource(name, path);
-                std::cout << "Resource added." << std::endl;
-                std::cout << std::endl;
-            }
-            catch (const FileNotFoundException &e)
-            {
-                std::cout << e.what() << ", resource has not been added." << std::endl;
-                std::cout << std::endl;
-            }
-            catch (const std::ios_base::failure &e)
-            {
-                std::cout << "File name cannot be a directory." << std::endl;
-                std::cout << std::endl;
-            }
-            catch (const std::invalid_argument &e)
-            {
-                std::cout << e.what() << std::endl;
-                std::cout << "Would you like to replace the existing resource? (y/n): ";
-                char overwrite_choice;
-                std::cin >> overwrite_choice;
-                if (overwrite_choice == 'y')
-                {
-                    manager.add_local_resource(name, path, true);
-                    std::cout << "Resource replaced." << std::endl;
-                }
-                else
-                {
-                    std::cout << "Resource has not been replaced." << std::endl;
-                }
-                std::cout << std::endl;
-            }
-        }
-        else if (choice == 2)
-        {
-            std::string name;
-            std::cout << "Enter resource name: ";
-            std::cin >> name;
-            try
-            {
-                manager.remove_resource(name);
-                std::cout << "Resource: " << "'" << name << "'" << " removed." << std::endl;
-                std::cout << std::endl;
-            }
-            catch (const std::invalid_argument &e)
-            {
-                std::cout << e.what() << std::endl;
-                std::cout << std::endl;
-            }
-        }
-        else if (choice == 3)
-        {
-            if (manager.get_local_resources().empty())
-            {
-                std::cout << "No resources to display." << std::endl;
-                std::cout << std::endl;
-            }
-            else
-            {
-                print_formatted_resources(manager.get_local_resources());
-            }
-        }
-        else if (choice == 4)
-        {
-            if (manager.get_remote_resources().empty())
-            {
-                std::cout << "No remote resources to display." << std::endl;
-                std::cout << std::endl;
-            }
-            else
-            {
-                print_formated_remote_resources(manager.get_remote_resources());
-            }
-        }
-
-        else if (choice == 5)
-        {
-            try
-            {
-                udp_communicator.send_broadcast_message();
-            }
-            catch (const std::exception &e)
-            {
-                std::cerr << "Error initializing UDP communication: " << e.what() << std::endl;
-            }
-        }
-        else if (choice == 6)
-        {
-            break;
-        }
-        else if (choice == 7)
-        {
-            std::string resource_name, target_address;
-
-            std::cout << "Enter resource name: ";
-            std::cin >> resource_name;
-            std::cout << "Enter target IP address: ";
-            std::cin >> target_address;
-
-            try {
-                udp_communicator.send_request(resource_name, target_address, COMMUNICATION_PORT);
-            }
-            catch (const std::exception &e)
-            {
-                std::cerr << "Error sending request: " << e.what() << std::endl;
-            }
-            std::cout << std::endl;
-        }
-        else
-        {
-            std::cout << "Invalid choice.\n"
-                      << std::endl;
-        }
-    }
-    return 0;
-}
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <iomanip>
+
+#include "ResourceManager.h"
+#include "exceptions/FileNotFoundException.h"
+#include "UDPCommunicator.h"
+
+const uint16_t COMMUNICATION_PORT = 5555;
+
+
+void print_choices()
+{
+    std::cout << "1. Add resource" << std::endl;
+    std::cout << "2. Remove resource" << std::endl;
+    std::cout << "3. Display resources" << std::endl;
+    std::cout << "4. Display remote resources" << std::endl;
+    std::cout << "5. Broadcast" << std::endl;
+    std::cout << "6. Exit program" << std::endl;
+    std::cout << "7. Send request" << std::endl;
+    std::cout << "8. Display packet pool statistics" << std::endl;
+    std::cout << "9. Download resource from all peers" << std::endl;
+    std::cout << "10. Search resources" << std::endl;
+    std::cout << "11. Display peer statistics" << std::endl;
+    std::cout << "12. Display compression statistics" << std::endl;
+    std::cout << "13. Download all resources matching a pattern" << std::endl;
+    std::cout << std::endl;
+}
+
+void print_formatted_resources(const std::map<std::string, Resource> &resources)
+{
+    std::cout << std::left << std::setw(5) << "" << std::setw(20) << "Resource Name" << std::setw(15) << "Size (bytes)"
+              << std::setw(25) << "Time of Addition" << "Content Hash" << std::endl;
+    std::cout << std::string(81, '-') << std::endl;
+
+    int counter = 1;
+    for (const auto &resource : resources)
+    {
+        std::time_t time = std::chrono::system_clock::to_time_t(resource.second.time_of_addition);
+
+        std::cout << std::left << std::setw(5) << counter++ << std::setw(20) << resource.first << std::setw(15)
+                  << resource.second.size << std::setw(25) << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S")
+                  << to_hex(resource.second.hashes->root()).substr(0, 16) << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+void print_search_results(const std::vector<SearchResult> &results)
+{
+    std::cout << std::left << std::setw(5) << "" << std::setw(30) << "Resource Name" << std::setw(8) << "Local"
+              << "Peers" << std::endl;
+    std::cout << std::string(63, '-') << std::endl;
+
+    int counter = 1;
+    for (const auto &result : results)
+    {
+        std::string peers;
+        for (const auto &peer : result.peers)
+        {
+            if (!peers.empty())
+            {
+                peers += ", ";
+            }
+            peers += peer;
+        }
+        std::cout << std::left << std::setw(5) << counter++ << std::setw(30) << result.name << std::setw(8)
+                  << (result.local ? "yes" : "no") << peers << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+void print_peer_stats(const std::map<std::string, PeerStats> &peers)
+{
+    std::cout << std::left << std::setw(5) << "" << std::setw(20) << "IP Address" << std::setw(15) << "Last Seen (s)"
+              << std::setw(12) << "RTT (ms)" << std::setw(12) << "Answered" << "Unanswered" << std::endl;
+    std::cout << std::string(74, '-') << std::endl;
+
+    auto now = Clock::now();
+    int counter = 1;
+    for (const auto &[ip, stats] : peers)
+    {
+        auto last_seen = std::chrono::duration_cast<std::chrono::seconds>(now - stats.last_seen).count();
+        std::string rtt = stats.smoothed_rtt.count() == 0 ? "-" : std::to_string(stats.smoothed_rtt.count() / 1000.0);
+        std::cout << std::left << std::setw(5) << counter++ << std::setw(20) << ip << std::setw(15) << last_seen
+                  << std::setw(12) << rtt.substr(0, 8) << std::setw(12) << stats.answered << stats.unanswered
+                  << (stats.healthy() ? "" : " (unhealthy)") << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+void print_chunk_store_stats(const ChunkStoreStats &stats)
+{
+    std::cout << "Chunks stored: " << stats.stored_chunks << " of " << stats.referenced_chunks << " ("
+              << stats.stored_bytes << " of " << stats.referenced_bytes << " bytes, "
+              << stats.referenced_bytes - stats.stored_bytes << " saved by deduplication)" << std::endl;
+    std::cout << std::endl;
+}
+
+void print_packet_pool_stats(const PacketPoolStats &stats)
+{
+    std::cout << "Buffers in use: " << stats.in_use << " of " << stats.capacity << " (peak " << stats.peak_in_use
+              << ")" << std::endl;
+    std::cout << "Buffers acquired: " << stats.acquired << ", heap fallbacks: " << stats.misses << std::endl;
+    std::cout << std::endl;
+}
+
+void print_compression_stats(const CompressionStats &stats)
+{
+    auto per_chunk_us = [](std::chrono::nanoseconds time, uint64_t chunks) {
+        return chunks > 0 ? std::chrono::duration<double, std::micro>(time).count() / chunks : 0.0;
+    };
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "Sent: " << stats.chunks_compressed << " of " << stats.chunks_tried << " chunks tried compressed, "
+              << stats.raw_bytes << " bytes as " << stats.sent_bytes << " (ratio " << stats.send_ratio() << ", "
+              << per_chunk_us(stats.compress_time, stats.chunks_tried) << " us per chunk)" << std::endl;
+    std::cout << "Received: " << stats.chunks_expanded << " compressed chunks, " << stats.received_bytes
+              << " bytes expanded to " << stats.expanded_bytes << " (ratio " << stats.receive_ratio() << ", "
+              << per_chunk_us(stats.expand_time, stats.chunks_expanded) << " us per chunk)" << std::endl;
+    std::cout << std::defaultfloat << std::endl;
+}
+
+void print_formated_remote_resources(const std::map<std::string, RemotePeer> &remote_resources)
+{
+    std::cout << std::left << std::setw(5) << "" << std::setw(20) << "IP Address" << std::setw(25) << "Resources" << std::endl;
+    std::cout << std::string(50, '-') << std::endl;
+
+    int counter = 1;
+    for (const auto &remote_resource : remote_resources)
+    {
+        std::string resource_list;
+        for (const auto &[name, resource] : remote_resource.second.resources)
+        {
+            if (!resource_list.empty())
+            {
+                resource_list += ", ";
+            }
+            resource_list += name;
+        }
+        if (remote_resource.second.summary)
+        {
+            resource_list += resource_list.empty() ? "(summarized)" : ", (more summarized)";
+        }
+        std::cout << std::left << std::setw(5) << counter++ << std::setw(20) << remote_resource.first << std::setw(25) << resource_list << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+bool parse_count(const char *text, size_t &value)
+{
+    const char *end = text + std::strlen(text);
+    auto [parsed_end, error] = std::from_chars(text, end, value);
+    return error == std::errc() && parsed_end == end;
+}
+
+void print_usage(const char *program)
+{
+    std::cout << "Usage: " << program << " [--workers N] [--peer-ttl SECONDS] [--congestion cubic|fixed]"
+              << " [--upload-limit KIB] [--peer-upload-limit KIB] [--fec N] [--compress none|lz4|zstd]" << std::endl;
+    std::cout << "  --workers N             threads serving incoming requests (default " << DEFAULT_WORKER_THREADS
+              << ")" << std::endl;
+    std::cout << "  --peer-ttl SECONDS      forget peers not heard from for this long (default "
+              << DEFAULT_PEER_TTL.count() << ")" << std::endl;
+    std::cout << "  --congestion ALGORITHM  congestion control for outgoing transfers, cubic (default) or fixed"
+              << std::endl;
+    std::cout << "  --upload-limit KIB      cap on the total upload rate in KiB/s (default unlimited)" << std::endl;
+    std::cout << "  --peer-upload-limit KIB cap on the upload rate to each peer in KiB/s (default unlimited)"
+              << std::endl;
+    std::cout << "  --fec N                 ask senders for N repair chunks per " << FEC_BLOCK_CHUNKS
+              << " chunks, up to " << MAX_FEC_REPAIR_SYMBOLS << " (default 0, off)" << std::endl;
+    std::cout << "  --compress CODEC        ask senders to compress chunks with CODEC, none (default)";
+    for (Compression codec : {Compression::LZ4, Compression::ZSTD})
+    {
+        if (compression_supported(codec))
+        {
+            std::cout << ", " << compression_name(codec);
+        }
+    }
+    std::cout << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t worker_threads = DEFAULT_WORKER_THREADS;
+    size_t peer_ttl = DEFAULT_PEER_TTL.count();
+    CongestionAlgorithm congestion_algorithm = CongestionAlgorithm::CUBIC;
+    size_t upload_limit = 0;
+    size_t peer_upload_limit = 0;
+    size_t fec_repair = 0;
+    Compression compression = Compression::NONE;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string argument = argv[i];
+        if (argument == "--workers" && i + 1 < argc && parse_count(argv[++i], worker_threads) && worker_threads > 0)
+        {
+            continue;
+        }
+        if (argument == "--peer-ttl" && i + 1 < argc && parse_count(argv[++i], peer_ttl) && peer_ttl > 0)
+        {
+            continue;
+        }
+        if (argument == "--congestion" && i + 1 < argc)
+        {
+            std::string algorithm = argv[++i];
+            if (algorithm == "cubic" || algorithm == "fixed")
+            {
+                congestion_algorithm = algorithm == "cubic" ? CongestionAlgorithm::CUBIC : CongestionAlgorithm::FIXED;
+                continue;
+            }
+        }
+        if (argument == "--upload-limit" && i + 1 < argc && parse_count(argv[++i], upload_limit) && upload_limit > 0)
+        {
+            continue;
+        }
+        if (argument == "--peer-upload-limit" && i + 1 < argc && parse_count(argv[++i], peer_upload_limit) &&
+            peer_upload_limit > 0)
+        {
+            continue;
+        }
+        if (argument == "--fec" && i + 1 < argc && parse_count(argv[++i], fec_repair) &&
+            fec_repair <= MAX_FEC_REPAIR_SYMBOLS)
+        {
+            continue;
+        }
+        if (argument == "--compress" && i + 1 < argc && parse_compression(argv[++i], compression) &&
+            compression_supported(compression))
+        {
+            continue;
+        }
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    ResourceManager manager;
+    RateLimits rate_limits;
+    rate_limits.upload = upload_limit * 1024;
+    rate_limits.peer_upload = peer_upload_limit * 1024;
+    UDP_Communicator udp_communicator(COMMUNICATION_PORT, manager, worker_threads, std::chrono::seconds(peer_ttl),
+                                      congestion_algorithm, rate_limits, static_cast<uint8_t>(fec_repair),
+                                      compression);
+    std::cout << "UDP Communicator initialized on port " << COMMUNICATION_PORT << " with " << worker_threads
+              << " worker threads" << std::endl;
+    std::cout << "Current working directory: " << std::filesystem::current_path() << std::endl;
+
+    udp_communicator.start();
+    udp_communicator.start_broadcast();
+
+    while (true)
+    {
+        print_choices();
+        std::cout << "Enter choice number: ";
+        int choice;
+
+        if (!(std::cin >> choice))
+        {
+            std::cout << std::endl;
+            std::cout << "Invalid choice. Please enter a valid number." << std::endl;
+            std::cout << std::endl;
+            std::cin.clear();
+            std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            continue;
+        }
+        std::cout << std::endl;
+
+        if (choice == 1)
+        {
+            std::string name;
+            std::string path;
+            std::cout << "Enter resource name: ";
+            std::cin >> name;
+            std::cout << "Enter resource path: ";
+            std::cin >> path;
+            std::cout << std::endl;
+            try
+            {
+                manager.add_local_resource(name, path);
+                std::cout << "Resource added." << std::endl;
+                std::cout << std::endl;
+            }
+            catch (const FileNotFoundException &e)
+            {
+                std::cout << e.what() << ", resource has not been added." << std::endl;
+                std::cout << std::endl;
+            }
+            catch (const std::ios_base::failure &e)
+            {
+                std::cout << "File name cannot be a directory." << std::endl;
+                std::cout << std::endl;
+            }
+            catch (const std::invalid_argument &e)
+            {
+                std::cout << e.what() << std::endl;
+                std::cout << "Would you like to replace the existing resource? (y/n): ";
+                char overwrite_choice;
+                std::cin >> overwrite_choice;
+                if (overwrite_choice == 'y')
+                {
+                    manager.add_local_resource(name, path, true);
+                    std::cout << "Resource replaced." << std::endl;
+                }
+                else
+                {
+                    std::cout << "Resource has not been replaced." << std::endl;
+                }
+                std::cout << std::endl;
+            }
+        }
+        else if (choice == 2)
+        {
+            std::string name;
+            std::cout << "Enter resource name: ";
+            std::cin >> name;
+            try
+            {
+                manager.remove_resource(name);
+                std::cout << "Resource: " << "'" << name << "'" << " removed." << std::endl;
+                std::cout << std::endl;
+            }
+            catch (const std::invalid_argument &e)
+            {
+                std::cout << e.what() << std::endl;
+                std::cout << std::endl;
+            }
+        }
+        else if (choice == 3)
+        {
+            auto local_resources = manager.get_local_resources();
+            if (local_resources.empty())
+            {
+                std::cout << "No resources to display." << std::endl;
+                std::cout << std::endl;
+            }
+            else
+            {
+                print_formatted_resources(local_resources);
+                print_chunk_store_stats(manager.get_chunk_store_stats());
+            }
+        }
+        else if (choice == 4)
+        {
+            auto remote_resources = manager.get_remote_resources();
+            if (remote_resources.empty())
+            {
+                std::cout << "No remote resources to display." << std::endl;
+                std::cout << std::endl;
+            }
+            else
+            {
+                print_formated_remote_resources(remote_resources);
+            }
+        }
+
+        else if (choice == 5)
+        {
+            try
+            {
+                udp_communicator.send_broadcast_message();
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error initializing UDP communication: " << e.what() << std::endl;
+            }
+        }
+        else if (choice == 6)
+        {
+            break;
+        }
+        else if (choice == 7)
+        {
+            std::string resource_name, target_address;
+
+            std::cout << "Enter resource name: ";
+            std::cin >> resource_name;
+            std::cout << "Enter target IP address: ";
+            std::cin >> target_address;
+
+            try {
+                udp_communicator.send_request(resource_name, target_address, COMMUNICATION_PORT);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error sending request: " << e.what() << std::endl;
+            }
+            std::cout << std::endl;
+        }
+        else if (choice == 8)
+        {
+            print_packet_pool_stats(udp_communicator.packet_pool_stats());
+        }
+        else if (choice == 9)
+        {
+            std::string resource_name;
+            std::cout << "Enter resource name: ";
+            std::cin >> resource_name;
+
+            try
+            {
+                udp_communicator.download(resource_name);
+            }
+            catch (const std::invalid_argument &e)
+            {
+                std::cout << e.what() << std::endl;
+            }
+            std::cout << std::endl;
+        }
+        else if (choice == 10)
+        {
+            char mode_choice;
+            std::string pattern;
+            std::cout << "Search by (p)refix, (s)ubstring or (g)lob: ";
+            std::cin >> mode_choice;
+            std::cout << "Enter pattern: ";
+            std::cin >> pattern;
+            std::cout << std::endl;
+
+            SearchMode mode = mode_choice == 'p' ? SearchMode::PREFIX
+                              : mode_choice == 'g' ? SearchMode::GLOB
+                                                   : SearchMode::SUBSTRING;
+            auto results = manager.search(mode, pattern);
+            if (results.empty())
+            {
+                std::cout << "No matching resources." << std::endl;
+                std::cout << std::endl;
+            }
+            else
+            {
+                print_search_results(results);
+            }
+        }
+        else if (choice == 11)
+        {
+            auto peers = udp_communicator.peer_stats();
+            if (peers.empty())
+            {
+                std::cout << "No peers heard from." << std::endl;
+                std::cout << std::endl;
+            }
+            else
+            {
+                print_peer_stats(peers);
+            }
+        }
+        else if (choice == 12)
+        {
+            print_compression_stats(udp_communicator.compression_stats());
+        }
+        else if (choice == 13)
+        {
+            std::string pattern;
+            std::cout << "Enter glob pattern: ";
+            std::cin >> pattern;
+
+            std::vector<std::string> names;
+            for (const auto &result : manager.search(SearchMode::GLOB, pattern, std::numeric_limits<size_t>::max()))
+            {
+                if (!result.local && !result.peers.empty())
+                {
+                    names.push_back(result.name);
+                }
+            }
+            size_t started = udp_communicator.download(names);
+            std::cout << "Started " << started << " of " << names.size() << " matching downloads." << std::endl;
+            std::cout << std::endl;
+        }
+        else
+        {
+            std::cout << "Invalid choice.\n"
+                      << std::endl;
+        }
+    }
+    return 0;
+}